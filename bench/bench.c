@@ -0,0 +1,461 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Timed scenarios against filesys. Images come from mkfat32, each scenario
+// is a generated batch script run with -f, and every result is one tab
+// separated line in the output file. Columns other than the timings are
+// deterministic, so a diff of two runs shows only speed changes unless
+// behaviour changed too (output_hash covers everything filesys printed).
+
+#include "layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_FILESYS_ARGS 16
+#define OUTPUT_CHUNK 65536
+
+typedef struct Profile {
+    const char *name;
+    const char *options;   // mkfat32 options
+    int mutable;           // scenarios change it, so each run starts from a fresh copy
+} Profile;
+
+typedef struct Scale {
+    unsigned int files, fanout, levels, deep, huge, empty, bigMb, sizeMb;
+    unsigned int runs, cdRepeats, lsRepeats, lookups, randomReads, appends, creats;
+} Scale;
+
+typedef struct Result {
+    unsigned long long ops, bytes;
+    double ms[32];
+    unsigned int runs;
+    int failed;
+    unsigned long long outputHash;
+} Result;
+
+static const char *filesysPath = "bin/filesys";
+static const char *mkfat32Path = "bin/mkfat32";
+static const char *workDir = "obj/bench";
+static const char *filesysArgs[MAX_FILESYS_ARGS];
+static int filesysArgCount = 0;
+static Scale scale;
+static FILE *out;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// run argv to completion; stdout is hashed into *hash (if given), stderr dropped
+static int run(char *const argv[], unsigned long long *hash, double *ms) {
+    int pipeFd[2];
+    if (pipe(pipeFd) != 0) {
+        return -1;
+    }
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(pipeFd[1], STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(pipeFd[0]);
+        close(pipeFd[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pipeFd[1]);
+
+    unsigned long long h = 14695981039346656037ULL;  // FNV-1a 64
+    unsigned char buf[OUTPUT_CHUNK];
+    ssize_t n;
+    while ((n = read(pipeFd[0], buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            h = (h ^ buf[i]) * 1099511628211ULL;
+        }
+    }
+    close(pipeFd[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (ms != NULL) {
+        *ms = now_ms() - start;
+    }
+    if (hash != NULL) {
+        *hash = h;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void image_path(char *path, size_t size, const Profile *profile, int fresh) {
+    snprintf(path, size, "%s/%s%s.img", workDir, profile->name, fresh ? ".run" : "");
+}
+
+// generate the profile's image; fresh is the scratch copy a mutable profile
+// gets before each run
+static int make_image(const Profile *profile, int fresh) {
+    char path[512], command[2048];
+    image_path(path, sizeof(path), profile, fresh);
+    snprintf(command, sizeof(command), "%s %s %s > /dev/null", mkfat32Path, path, profile->options);
+    if (system(command) != 0) {
+        fprintf(stderr, "bench: '%s' failed\n", command);
+        return -1;
+    }
+    return 0;
+}
+
+static FILE *open_script(const char *scenario, char *path, size_t size) {
+    snprintf(path, size, "%s/%s.script", workDir, scenario);
+    FILE *script = fopen(path, "w");
+    if (script == NULL) {
+        fprintf(stderr, "bench: cannot write '%s': %s\n", path, strerror(errno));
+    }
+    return script;
+}
+
+static int compare_ms(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// time the script against the profile's image and append one result line
+static void measure(const char *scenario, const Profile *profile, const char *scriptPath, Result *result) {
+    result->runs = 0;
+    result->failed = 0;
+    result->outputHash = 0;
+    for (unsigned int r = 0; r < scale.runs && r < sizeof(result->ms) / sizeof(result->ms[0]); r++) {
+        char image[512];
+        if (profile->mutable && make_image(profile, 1) != 0) {
+            result->failed = 1;
+            break;
+        }
+        image_path(image, sizeof(image), profile, profile->mutable);
+
+        char *argv[MAX_FILESYS_ARGS + 5];
+        int argc = 0;
+        argv[argc++] = (char *)filesysPath;
+        for (int i = 0; i < filesysArgCount; i++) {
+            argv[argc++] = (char *)filesysArgs[i];
+        }
+        argv[argc++] = "-f";
+        argv[argc++] = (char *)scriptPath;
+        argv[argc++] = image;
+        argv[argc] = NULL;
+
+        unsigned long long hash;
+        int status = run(argv, &hash, &result->ms[result->runs]);
+        if (status != 0 || (result->runs > 0 && hash != result->outputHash)) {
+            result->failed = 1;
+        }
+        result->outputHash = hash;
+        result->runs++;
+    }
+
+    double sorted[32];
+    memcpy(sorted, result->ms, result->runs * sizeof(double));
+    qsort(sorted, result->runs, sizeof(double), compare_ms);
+    double median = result->runs ? sorted[result->runs / 2] : 0;
+    double best = result->runs ? sorted[0] : 0;
+    double seconds = median / 1000.0;
+    fprintf(out, "%s\t%s\t%llu\t%llu\t%u\t%.3f\t%.3f\t%.1f\t%.2f\t%s\t%016llx\n", scenario, profile->name,
+            result->ops, result->bytes, result->runs, median, best,
+            seconds > 0 ? result->ops / seconds : 0.0,
+            seconds > 0 ? result->bytes / seconds / (1024.0 * 1024.0) : 0.0,
+            result->failed ? "FAIL" : "ok", result->outputHash);
+    fflush(out);
+    printf("%-14s %-10s %10.3f ms%s\n", scenario, profile->name, median, result->failed ? "  FAILED" : "");
+}
+
+static void scenario_cd_deep(const Profile *profile) {
+    char scriptPath[512], path[256];
+    FILE *script = open_script("cd_deep", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    int len = snprintf(path, sizeof(path), "/DEEP");
+    for (unsigned int i = 0; i < scale.deep && len + 2 < (int)sizeof(path); i++) {
+        len += snprintf(path + len, sizeof(path) - len, "/D");
+    }
+    for (unsigned int i = 0; i < scale.cdRepeats; i++) {
+        fprintf(script, "cd %s\ncd /\n", path);
+    }
+    fclose(script);
+    Result result = { .ops = 2ULL * scale.cdRepeats };
+    measure("cd_deep", profile, scriptPath, &result);
+}
+
+static void scenario_ls_huge(const Profile *profile) {
+    char scriptPath[512];
+    FILE *script = open_script("ls_huge", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    fprintf(script, "cd /HUGE\n");
+    for (unsigned int i = 0; i < scale.lsRepeats; i++) {
+        fprintf(script, "ls\n");
+    }
+    fclose(script);
+    Result result = { .ops = scale.lsRepeats };
+    measure("ls_huge", profile, scriptPath, &result);
+}
+
+// open and close random names in /HUGE: one lookup each
+static void scenario_lookup_huge(const Profile *profile, int longNames) {
+    char scriptPath[512], name[256];
+    const char *scenario = longNames ? "lookup_huge_lfn" : "lookup_huge";
+    FILE *script = open_script(scenario, scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    unsigned long long rng = 42;
+    fprintf(script, "debug off\ncd /HUGE\n");
+    for (unsigned int i = 0; i < scale.lookups; i++) {
+        layout_huge_name(name, sizeof(name), layout_random(&rng) % scale.huge, longNames);
+        fprintf(script, "open \"%s\" -r\nclose \"%s\"\n", name, name);
+    }
+    fclose(script);
+    Result result = { .ops = scale.lookups };
+    measure(scenario, profile, scriptPath, &result);
+}
+
+static void scenario_read_seq(const Profile *profile, const char *scenario) {
+    char scriptPath[512];
+    FILE *script = open_script(scenario, scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    unsigned int chunk = 64 * 1024;
+    unsigned int reads = scale.bigMb * 1024 * 1024 / chunk;
+    fprintf(script, "debug off\nopen /BIG.BIN -r\n");
+    for (unsigned int i = 0; i < reads; i++) {
+        fprintf(script, "read /BIG.BIN %u > /dev/null\n", chunk);
+    }
+    fprintf(script, "close /BIG.BIN\n");
+    fclose(script);
+    Result result = { .ops = reads, .bytes = (unsigned long long)reads * chunk };
+    measure(scenario, profile, scriptPath, &result);
+}
+
+static void scenario_read_random(const Profile *profile, const char *scenario) {
+    char scriptPath[512];
+    FILE *script = open_script(scenario, scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    unsigned int block = 4096;
+    unsigned int blocks = scale.bigMb * 1024 * 1024 / block;
+    unsigned long long rng = 7;
+    fprintf(script, "debug off\nopen /BIG.BIN -r\n");
+    for (unsigned int i = 0; i < scale.randomReads; i++) {
+        fprintf(script, "lseek /BIG.BIN %u\nread /BIG.BIN %u > /dev/null\n", (layout_random(&rng) % blocks) * block, block);
+    }
+    fprintf(script, "close /BIG.BIN\n");
+    fclose(script);
+    Result result = { .ops = scale.randomReads, .bytes = (unsigned long long)scale.randomReads * block };
+    measure(scenario, profile, scriptPath, &result);
+}
+
+static void scenario_write_append(const Profile *profile) {
+    char scriptPath[512];
+    FILE *script = open_script("write_append", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    const char *line = "0123456789abcdef0123456789abcdef";
+    fprintf(script, "debug off\ncreat /APPEND.LOG\nopen /APPEND.LOG -rw\n");
+    for (unsigned int i = 0; i < scale.appends; i++) {
+        fprintf(script, "write /APPEND.LOG \"%s\"\n", line);
+    }
+    fprintf(script, "close /APPEND.LOG\n");
+    fclose(script);
+    Result result = { .ops = scale.appends, .bytes = (unsigned long long)scale.appends * strlen(line) };
+    measure("write_append", profile, scriptPath, &result);
+}
+
+static void scenario_creat_storm(const Profile *profile) {
+    char scriptPath[512];
+    FILE *script = open_script("creat_storm", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    fprintf(script, "debug off\ncd /EMPTY\n");
+    for (unsigned int i = 0; i < scale.creats; i++) {
+        fprintf(script, "creat N%07u\n", i);
+    }
+    fclose(script);
+    Result result = { .ops = scale.creats };
+    measure("creat_storm", profile, scriptPath, &result);
+}
+
+// the same names as creat_storm, created by one 'creat -n' from a host list
+static void scenario_creat_bulk(const Profile *profile) {
+    char scriptPath[512], listPath[512];
+    snprintf(listPath, sizeof(listPath), "%s/creat_bulk.list", workDir);
+    FILE *list = fopen(listPath, "w");
+    if (list == NULL) {
+        fprintf(stderr, "bench: cannot write '%s': %s\n", listPath, strerror(errno));
+        return;
+    }
+    FILE *script = open_script("creat_bulk", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        fclose(list);
+        return;
+    }
+    for (unsigned int i = 0; i < scale.creats; i++) {
+        fprintf(list, "N%07u\n", i);
+    }
+    fclose(list);
+    fprintf(script, "debug off\ncd /EMPTY\ncreat -n < %s\n", listPath);
+    fclose(script);
+    Result result = { .ops = scale.creats };
+    measure("creat_bulk", profile, scriptPath, &result);
+}
+
+// remove the whole /T tree: every file, then the directories bottom-up
+static void scenario_rm_tree(const Profile *profile) {
+    char scriptPath[512], leafPath[256], name[32];
+    FILE *script = open_script("rm_recursive", scriptPath, sizeof(scriptPath));
+    if (script == NULL) {
+        return;
+    }
+    unsigned int leaves = layout_leaf_count(scale.fanout, scale.levels);
+    fprintf(script, "debug off\n");
+    for (unsigned int f = 0; f < scale.files; f++) {
+        layout_leaf_path(leafPath, sizeof(leafPath), f % leaves, scale.fanout, scale.levels);
+        layout_file_name(name, sizeof(name), f);
+        fprintf(script, "rm %s/%s\n", leafPath, name);
+    }
+    unsigned long long ops = scale.files;
+    for (int level = (int)scale.levels; level > 0; level--) {
+        unsigned int count = layout_leaf_count(scale.fanout, level);
+        for (unsigned int d = 0; d < count; d++) {
+            // directory d at this level is the prefix shared by its leaves
+            unsigned int leaf = d * layout_leaf_count(scale.fanout, scale.levels - level);
+            layout_leaf_path(leafPath, sizeof(leafPath), leaf, scale.fanout, scale.levels);
+            char *cut = leafPath;
+            for (int parts = 0; parts <= level && cut != NULL; parts++) {
+                cut = strchr(cut + 1, '/');
+            }
+            if (cut != NULL) {
+                *cut = '\0';
+            }
+            fprintf(script, "rmdir %s\n", leafPath);
+            ops++;
+        }
+    }
+    fprintf(script, "rmdir /T\n");
+    fclose(script);
+    Result result = { .ops = ops + 1 };
+    measure("rm_recursive", profile, scriptPath, &result);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--filesys PATH] [--mkfat32 PATH] [--work DIR] [--out FILE] [--runs N] [--quick]\n"
+                    "       [--arg FILESYS_ARG]...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *outPath = "bench_output.txt";
+    int quick = 0;
+    unsigned int runs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+        } else if (strcmp(argv[i], "--filesys") == 0) {
+            filesysPath = argv[++i];
+        } else if (strcmp(argv[i], "--mkfat32") == 0) {
+            mkfat32Path = argv[++i];
+        } else if (strcmp(argv[i], "--work") == 0) {
+            workDir = argv[++i];
+        } else if (strcmp(argv[i], "--out") == 0) {
+            outPath = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            runs = (unsigned int)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--arg") == 0 && filesysArgCount < MAX_FILESYS_ARGS) {
+            filesysArgs[filesysArgCount++] = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (quick) {
+        scale = (Scale){ .files = 200, .fanout = 4, .levels = 2, .deep = 32, .huge = 2000, .empty = 2000,
+                         .bigMb = 4, .sizeMb = 64, .runs = 1, .cdRepeats = 100, .lsRepeats = 2,
+                         .lookups = 500, .randomReads = 500, .appends = 1000, .creats = 500 };
+    } else {
+        scale = (Scale){ .files = 2000, .fanout = 8, .levels = 2, .deep = 100, .huge = 20000, .empty = 20000,
+                         .bigMb = 32, .sizeMb = 256, .runs = 5, .cdRepeats = 500, .lsRepeats = 5,
+                         .lookups = 5000, .randomReads = 5000, .appends = 10000, .creats = 5000 };
+    }
+    if (runs > 0) {
+        scale.runs = runs;
+    }
+    if (scale.runs > 32) {
+        scale.runs = 32;
+    }
+
+    mkdir(workDir, 0755);  // an existing directory is fine
+
+    char common[256];
+    snprintf(common, sizeof(common), "--size %u --fanout %u --levels %u --files %u --deep %u --huge %u --empty %u --big %u",
+             scale.sizeMb, scale.fanout, scale.levels, scale.files, scale.deep, scale.huge, scale.empty, scale.bigMb);
+    char options[4][320];
+    snprintf(options[0], sizeof(options[0]), "%s --frag 0", common);
+    snprintf(options[1], sizeof(options[1]), "%s --frag 30", common);
+    snprintf(options[2], sizeof(options[2]), "%s --frag 0 --long-names", common);
+    Profile plain = { "plain", options[0], 0 };
+    Profile fragmented = { "frag30", options[1], 0 };
+    Profile longNames = { "lfn", options[2], 0 };
+    Profile scratch = { "scratch", options[0], 1 };
+
+    Profile *images[] = { &plain, &fragmented, &longNames };
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+        if (make_image(images[i], 0) != 0) {
+            return 1;
+        }
+    }
+
+    out = fopen(outPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "bench: cannot write '%s': %s\n", outPath, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "# filesys benchmark: %s %s\n", quick ? "quick" : "full", common);
+    fprintf(out, "# scenario\timage\tops\tbytes\truns\tmedian_ms\tmin_ms\tops_per_s\tmib_per_s\tstatus\toutput_hash\n");
+
+    scenario_cd_deep(&plain);
+    scenario_ls_huge(&plain);
+    scenario_lookup_huge(&plain, 0);
+    scenario_lookup_huge(&longNames, 1);
+    scenario_read_seq(&plain, "read_seq");
+    scenario_read_seq(&fragmented, "read_seq_frag");
+    scenario_read_random(&plain, "read_random");
+    scenario_read_random(&fragmented, "read_random_frag");
+    scenario_write_append(&scratch);
+    scenario_creat_storm(&scratch);
+    scenario_creat_bulk(&scratch);
+    scenario_rm_tree(&scratch);
+
+    fclose(out);
+    printf("Results written to %s\n", outPath);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdio.h>
+
+// Layout of the images mkfat32 generates, shared with bench so its scripts
+// can address the generated entries by path.
+//
+//   /T/Dxx/.../Dxx/Fnnnnn.DAT   fan-out tree, files spread round-robin over the leaves
+//   /DEEP/D/D/.../D             one long chain of directories
+//   /HUGE/...                   one directory with many empty files
+//   /EMPTY                      a directory with room for many entries
+//   /BIG.BIN                    one large file
+
+#define LAYOUT_MAX_LEVELS 6
+
+// path of leaf directory 'leaf' of a tree with the given fan-out and depth
+static inline void layout_leaf_path(char *out, size_t size, unsigned int leaf, unsigned int fanout, unsigned int levels) {
+    int len = snprintf(out, size, "/T");
+    unsigned int span = 1;
+    for (unsigned int i = 1; i < levels; i++) {
+        span *= fanout;
+    }
+    for (unsigned int i = 0; i < levels && len < (int)size; i++) {
+        len += snprintf(out + len, size - len, "/D%02u", (leaf / span) % fanout);
+        span = span > 1 ? span / fanout : 1;
+    }
+}
+
+static inline unsigned int layout_leaf_count(unsigned int fanout, unsigned int levels) {
+    unsigned int count = 1;
+    for (unsigned int i = 0; i < levels; i++) {
+        count *= fanout;
+    }
+    return count;
+}
+
+static inline void layout_file_name(char *out, size_t size, unsigned int file) {
+    snprintf(out, size, "F%05u.DAT", file);
+}
+
+// name of entry n of /HUGE: a plain 8.3 name, or a long one that needs VFAT entries
+static inline void layout_huge_name(char *out, size_t size, unsigned int n, int longNames) {
+    if (longNames) {
+        snprintf(out, size, "entry %u of a very large directory.txt", n);
+    } else {
+        snprintf(out, size, "E%07u.TXT", n);
+    }
+}
+
+// the small deterministic generator both programs use for "random" choices
+static inline unsigned int layout_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (unsigned int)(*state >> 32);
+}
@@ -0,0 +1,395 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Deterministic FAT32 image generator for the benchmarks. The same options
+// and seed always produce the same image byte for byte. See layout.h for
+// what goes where.
+
+#include "fat32.h"
+#include "lfn.h"
+#include "layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SECTOR 512
+#define RESERVED_SECTORS 32
+#define MAX_FRAG_GAP 8      // largest run of clusters a fragmentation jump skips
+
+typedef struct Node {
+    char name[NAME_MAX_BYTES];
+    int isDir;
+    unsigned int size;          // file bytes
+    unsigned int slack;         // spare entry slots for a directory
+    unsigned int first;         // first cluster, 0 for an empty file
+    unsigned int seed;          // content pattern of a file
+    struct Node **children;
+    unsigned int childCount, childCapacity;
+} Node;
+
+typedef struct Options {
+    unsigned int sizeMb, clusterBytes, fanout, levels, files, fileSize;
+    unsigned int deep, huge, empty, bigMb, frag;
+    int longNames;
+    unsigned long long seed;
+} Options;
+
+static unsigned int *fat;
+static unsigned int clusterCount;       // FAT entries, including 0 and 1
+static unsigned int nextCluster = 2;
+static unsigned long long rng;
+static Options opt;
+static int imageFd;
+static long dataStart;
+
+static Node *new_node(const char *name, int isDir) {
+    Node *node = (Node *)calloc(1, sizeof(Node));
+    if (node == NULL) {
+        fprintf(stderr, "mkfat32: out of memory\n");
+        exit(1);
+    }
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    node->isDir = isDir;
+    return node;
+}
+
+static Node *add_child(Node *parent, Node *child) {
+    if (parent->childCount == parent->childCapacity) {
+        parent->childCapacity = parent->childCapacity ? parent->childCapacity * 2 : 8;
+        parent->children = (Node **)realloc(parent->children, parent->childCapacity * sizeof(Node *));
+        if (parent->children == NULL) {
+            fprintf(stderr, "mkfat32: out of memory\n");
+            exit(1);
+        }
+    }
+    parent->children[parent->childCount++] = child;
+    return child;
+}
+
+static Node *child_dir(Node *parent, const char *name) {
+    for (unsigned int i = 0; i < parent->childCount; i++) {
+        if (parent->children[i]->isDir && strcmp(parent->children[i]->name, name) == 0) {
+            return parent->children[i];
+        }
+    }
+    return add_child(parent, new_node(name, 1));
+}
+
+// chain of count clusters. With fragmentation on, each cluster has a frag%
+// chance of starting after a gap left free, so chains and free space both
+// end up in pieces
+static unsigned int alloc_chain(unsigned int count) {
+    unsigned int first = 0, prev = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (opt.frag > 0 && i > 0 && layout_random(&rng) % 100 < opt.frag) {
+            nextCluster += 1 + layout_random(&rng) % MAX_FRAG_GAP;
+        }
+        if (nextCluster >= clusterCount) {
+            fprintf(stderr, "mkfat32: image too small for the requested contents\n");
+            exit(1);
+        }
+        unsigned int cluster = nextCluster++;
+        if (prev != 0) {
+            fat[prev] = cluster;
+        } else {
+            first = cluster;
+        }
+        fat[cluster] = FAT_EOC;
+        prev = cluster;
+    }
+    return first;
+}
+
+static int short_entry_is_exact(const char *name) {
+    unsigned char shortName[11];
+    return lfn_basis(name, shortName);
+}
+
+// directory entries a node's listing takes, with "." and ".." and long names
+static unsigned int entry_slots(Node *dir) {
+    unsigned int slots = 2 + dir->slack;
+    for (unsigned int i = 0; i < dir->childCount; i++) {
+        Node *child = dir->children[i];
+        slots += 1;
+        if (!short_entry_is_exact(child->name)) {
+            unsigned int units = (unsigned int)strlen(child->name);  // generated names are ASCII
+            slots += (units + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+        }
+    }
+    return slots;
+}
+
+// clusters for every directory and file, depth first in child order
+static void assign_clusters(Node *dir, int isRoot) {
+    unsigned int bytes = entry_slots(dir) * sizeof(DIR);
+    dir->first = isRoot ? dir->first : alloc_chain((bytes + opt.clusterBytes - 1) / opt.clusterBytes);
+    for (unsigned int i = 0; i < dir->childCount; i++) {
+        Node *child = dir->children[i];
+        if (child->isDir) {
+            assign_clusters(child, 0);
+        } else if (child->size > 0) {
+            child->first = alloc_chain((child->size + opt.clusterBytes - 1) / opt.clusterBytes);
+        }
+    }
+}
+
+static void write_at(long offset, const void *data, size_t len) {
+    if (pwrite(imageFd, data, len, offset) != (ssize_t)len) {
+        perror("mkfat32: write");
+        exit(1);
+    }
+}
+
+static long cluster_pos(unsigned int cluster) {
+    return dataStart + (long)(cluster - 2) * opt.clusterBytes;
+}
+
+// write buf over a chain, one cluster at a time
+static void write_chain(unsigned int first, const unsigned char *buf, size_t len) {
+    for (unsigned int c = first; c >= 2 && c < FAT_EOC_MIN && len > 0; c = fat[c]) {
+        size_t n = len < opt.clusterBytes ? len : opt.clusterBytes;
+        write_at(cluster_pos(c), buf, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void set_short_entry(DIR *entry, const unsigned char *shortName, Node *node) {
+    memset(entry, 0, sizeof(DIR));
+    memcpy(entry->DIR_Name, shortName, 11);
+    entry->DIR_Attr = node->isDir ? 0x10 : 0x20;
+    entry->DIR_FstClusLO = node->first & 0xFFFF;
+    entry->DIR_FstClusHI = node->first >> 16;
+    entry->DIR_FileSize = node->isDir ? 0 : node->size;
+}
+
+static void write_tree(Node *dir, unsigned int parentCluster, int isRoot) {
+    unsigned int slots = entry_slots(dir);
+    size_t bytes = ((slots * sizeof(DIR) + opt.clusterBytes - 1) / opt.clusterBytes) * opt.clusterBytes;
+    DIR *entries = (DIR *)calloc(1, bytes);
+    if (entries == NULL) {
+        fprintf(stderr, "mkfat32: out of memory\n");
+        exit(1);
+    }
+
+    unsigned int n = 0;
+    Node self = *dir;
+    if (!isRoot) {
+        set_short_entry(&entries[n++], (const unsigned char *)".          ", &self);
+        Node parent = { .isDir = 1, .first = parentCluster };
+        set_short_entry(&entries[n++], (const unsigned char *)"..         ", &parent);
+    }
+    unsigned int tail = 0;
+    for (unsigned int i = 0; i < dir->childCount; i++) {
+        Node *child = dir->children[i];
+        unsigned char shortName[11];
+        if (!lfn_basis(child->name, shortName)) {
+            // generated names here never need more than a counter to be unique
+            unsigned char basis[11];
+            memcpy(basis, shortName, 11);
+            snprintf((char *)shortName, 9, "S%07u", ++tail);
+            memcpy(shortName + 8, basis + 8, 3);
+            n += lfn_encode(child->name, shortName, &entries[n]);
+        }
+        set_short_entry(&entries[n++], shortName, child);
+    }
+    write_chain(dir->first, (const unsigned char *)entries, bytes);
+    free(entries);
+
+    unsigned char *data = (unsigned char *)malloc(opt.clusterBytes);
+    for (unsigned int i = 0; i < dir->childCount; i++) {
+        Node *child = dir->children[i];
+        if (child->isDir) {
+            write_tree(child, isRoot ? 0 : dir->first, 0);
+            continue;
+        }
+        // file contents: a pattern that depends on the file and the offset
+        unsigned int pos = 0;
+        for (unsigned int c = child->first; c >= 2 && c < FAT_EOC_MIN; c = fat[c]) {
+            for (unsigned int b = 0; b < opt.clusterBytes; b++, pos++) {
+                data[b] = pos < child->size ? (unsigned char)(child->seed * 131 + pos * 7 + (pos >> 9)) : 0;
+            }
+            write_at(cluster_pos(c), data, opt.clusterBytes);
+        }
+    }
+    free(data);
+}
+
+static unsigned int parse_number(const char *flag, const char *value) {
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        fprintf(stderr, "mkfat32: bad value '%s' for %s\n", value, flag);
+        exit(1);
+    }
+    return (unsigned int)n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s IMAGE [--size MB] [--cluster BYTES] [--fanout N] [--levels N] [--files N]\n"
+            "       [--file-size BYTES] [--deep N] [--huge N] [--long-names] [--empty N] [--big MB]\n"
+            "       [--frag PERCENT] [--seed N]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    opt = (Options){ .sizeMb = 256, .clusterBytes = 4096, .fanout = 8, .levels = 2, .files = 1000,
+                     .fileSize = 8192, .deep = 64, .huge = 10000, .empty = 10000, .bigMb = 32, .frag = 0,
+                     .longNames = 0, .seed = 1 };
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *flag = argv[i];
+        if (strcmp(flag, "--long-names") == 0) {
+            opt.longNames = 1;
+            continue;
+        }
+        if (flag[0] != '-') {
+            if (path != NULL) {
+                usage(argv[0]);
+            }
+            path = flag;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        unsigned int value = parse_number(flag, argv[++i]);
+        if (strcmp(flag, "--size") == 0) opt.sizeMb = value;
+        else if (strcmp(flag, "--cluster") == 0) opt.clusterBytes = value;
+        else if (strcmp(flag, "--fanout") == 0) opt.fanout = value;
+        else if (strcmp(flag, "--levels") == 0) opt.levels = value;
+        else if (strcmp(flag, "--files") == 0) opt.files = value;
+        else if (strcmp(flag, "--file-size") == 0) opt.fileSize = value;
+        else if (strcmp(flag, "--deep") == 0) opt.deep = value;
+        else if (strcmp(flag, "--huge") == 0) opt.huge = value;
+        else if (strcmp(flag, "--empty") == 0) opt.empty = value;
+        else if (strcmp(flag, "--big") == 0) opt.bigMb = value;
+        else if (strcmp(flag, "--frag") == 0) opt.frag = value;
+        else if (strcmp(flag, "--seed") == 0) opt.seed = value;
+        else usage(argv[0]);
+    }
+    if (path == NULL || opt.clusterBytes < SECTOR || opt.clusterBytes % SECTOR != 0 ||
+        opt.clusterBytes / SECTOR > 128 || opt.fanout == 0 || opt.fanout > 100 ||
+        opt.levels > LAYOUT_MAX_LEVELS || opt.frag > 100) {
+        usage(argv[0]);
+    }
+    rng = opt.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    // geometry: the FAT is sized for every cluster the sectors could hold
+    unsigned int secPerClus = opt.clusterBytes / SECTOR;
+    unsigned int totalSectors = (unsigned int)((unsigned long long)opt.sizeMb * 1024 * 1024 / SECTOR);
+    unsigned int fatSectors = (unsigned int)(((unsigned long long)(totalSectors / secPerClus) + 2) * 4 + SECTOR - 1) / SECTOR;
+    unsigned int dataSectors = totalSectors - RESERVED_SECTORS - 2 * fatSectors;
+    clusterCount = dataSectors / secPerClus + 2;
+    dataStart = (long)(RESERVED_SECTORS + 2 * fatSectors) * SECTOR;
+    fat = (unsigned int *)calloc((size_t)fatSectors * SECTOR / 4, sizeof(unsigned int));
+    if (fat == NULL) {
+        fprintf(stderr, "mkfat32: out of memory\n");
+        return 1;
+    }
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = FAT_EOC;
+
+    // build the tree in memory first so every directory's size is known
+    Node *root = new_node("", 1);
+    unsigned int leaves = layout_leaf_count(opt.fanout, opt.levels);
+    Node *tree = add_child(root, new_node("T", 1));
+    for (unsigned int f = 0; f < opt.files; f++) {
+        char leafPath[256], name[32];
+        layout_leaf_path(leafPath, sizeof(leafPath), f % leaves, opt.fanout, opt.levels);
+        Node *dir = tree;
+        for (char *part = strtok(leafPath + 2, "/"); part != NULL; part = strtok(NULL, "/")) {
+            dir = child_dir(dir, part);
+        }
+        layout_file_name(name, sizeof(name), f);
+        Node *file = add_child(dir, new_node(name, 0));
+        file->size = opt.fileSize;
+        file->seed = f;
+    }
+    if (opt.files == 0) {
+        for (unsigned int leaf = 0; leaf < leaves && opt.levels > 0; leaf++) {
+            char leafPath[256];
+            layout_leaf_path(leafPath, sizeof(leafPath), leaf, opt.fanout, opt.levels);
+            Node *dir = tree;
+            for (char *part = strtok(leafPath + 2, "/"); part != NULL; part = strtok(NULL, "/")) {
+                dir = child_dir(dir, part);
+            }
+        }
+    }
+    Node *deep = add_child(root, new_node("DEEP", 1));
+    for (unsigned int i = 0; i < opt.deep; i++) {
+        deep = add_child(deep, new_node("D", 1));
+    }
+    Node *huge = add_child(root, new_node("HUGE", 1));
+    for (unsigned int i = 0; i < opt.huge; i++) {
+        char name[NAME_MAX_BYTES];
+        layout_huge_name(name, sizeof(name), i, opt.longNames);
+        add_child(huge, new_node(name, 0));
+    }
+    add_child(root, new_node("EMPTY", 1))->slack = opt.empty;
+    Node *big = add_child(root, new_node("BIG.BIN", 0));
+    big->size = opt.bigMb * 1024 * 1024;
+    big->seed = 0xB16;
+
+    root->first = alloc_chain((entry_slots(root) * sizeof(DIR) + opt.clusterBytes - 1) / opt.clusterBytes);
+    assign_clusters(root, 1);
+
+    imageFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (imageFd < 0 || ftruncate(imageFd, (off_t)totalSectors * SECTOR) != 0) {
+        perror("mkfat32: cannot create the image");
+        return 1;
+    }
+
+    BPB bpb;
+    memset(&bpb, 0, sizeof(BPB));
+    memcpy(bpb.BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb.BS_OEMName, "MKFAT32 ", 8);
+    bpb.BPB_BytesPerSec = SECTOR;
+    bpb.BPB_SecsPerClus = secPerClus;
+    bpb.BPB_RsvdSecCnt = RESERVED_SECTORS;
+    bpb.BPB_NumFATs = 2;
+    bpb.BPB_Media = 0xF8;
+    bpb.BPB_SecPerTrk = 32;
+    bpb.BPB_NumHeads = 64;
+    bpb.BPB_TotSec32 = totalSectors;
+    bpb.BPB_FATSz32 = fatSectors;
+    bpb.BPB_RootClus = root->first;
+    bpb.BPB_FSInfo = 1;
+    bpb.BPB_BkBootSe = 6;
+    bpb.BS_DrvNum = 0x80;
+    bpb.BS_BootSig = 0x29;
+    bpb.BS_VollD = (unsigned int)opt.seed;
+    memcpy(bpb.BS_VolLab, "BENCH      ", 11);
+    memcpy(bpb.BS_FilSysType, "FAT32   ", 8);
+    bpb.Signature_word = 0xAA55;
+    write_at(0, &bpb, sizeof(BPB));
+    write_at(6L * SECTOR, &bpb, sizeof(BPB));
+
+    unsigned int freeClusters = 0;
+    for (unsigned int c = 2; c < clusterCount; c++) {
+        freeClusters += fat[c] == FAT_FREE;
+    }
+    unsigned char fsInfo[SECTOR];
+    memset(fsInfo, 0, sizeof(fsInfo));
+    unsigned int fields[][2] = { { 0, 0x41615252 }, { 484, 0x61417272 }, { 488, freeClusters },
+                                 { 492, nextCluster < clusterCount ? nextCluster : 2 }, { 508, 0xAA550000 } };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        memcpy(fsInfo + fields[i][0], &fields[i][1], 4);
+    }
+    write_at(SECTOR, fsInfo, SECTOR);
+
+    write_tree(root, 0, 1);
+    for (int copy = 0; copy < 2; copy++) {
+        write_at((long)(RESERVED_SECTORS + copy * fatSectors) * SECTOR, fat, (size_t)fatSectors * SECTOR);
+    }
+    if (fsync(imageFd) != 0 || close(imageFd) != 0) {
+        perror("mkfat32: cannot write the image");
+        return 1;
+    }
+
+    printf("%s: %u MiB, %u-byte clusters, %u of %u clusters used\n", path, opt.sizeMb, opt.clusterBytes,
+           clusterCount - 2 - freeClusters, clusterCount - 2);
+    return 0;
+}
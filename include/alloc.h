@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdio.h>
+#include "fat32.h"
+
+// Cluster allocator. A free-cluster bitmap is built from the cached FAT at
+// mount, and the FSInfo sector's free count and next-free hint are read at
+// mount and written back on alloc_sync(). All allocation sites go through here.
+int alloc_init(FILE *fp, BPB *bpb);
+void alloc_shutdown(void);
+unsigned int alloc_cluster(void);
+int alloc_clusters(unsigned int count, unsigned int *clusters);
+unsigned int alloc_run(unsigned int count);
+unsigned int alloc_contiguous(unsigned int count);
+void alloc_free(unsigned int cluster);
+void alloc_free_chain(unsigned int first);
+unsigned int alloc_free_count(void);
+int alloc_sync(FILE *fp);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Shared cache of data-region clusters for the stdio backend. The image
+// layer sends every read and write of the data region through it, so the
+// directory and file clusters a session keeps touching are served from
+// memory. Buffers are found by cluster number and evicted with CLOCK;
+// pinned buffers stay put, and dirty ones are written back when evicted or
+// on bcache_flush(). Transfers larger than a quarter of the cache go
+// straight to the image, updating any cached copies as they pass.
+// Not thread-safe: the tree walkers read the image with pread after
+// image_flush() has written everything back.
+int bcache_init(FILE *fp, long start, unsigned int bytesPerCluster, unsigned int clusters, unsigned int count);
+void bcache_shutdown(void);
+int bcache_enabled(void);
+int bcache_covers(long offset, size_t len);
+int bcache_read(long offset, void *buf, size_t len);
+int bcache_write(long offset, const void *buf, size_t len);
+void *bcache_pin(long offset, size_t len);
+void bcache_unpin(const void *data);
+int bcache_mark_dirty(long offset, const void *data, size_t len);
+int bcache_flush(void);
+int bcache_writeback_range(long offset, size_t len);
+void bcache_update_range(long offset, const void *buf, size_t len);
+int bcache_discard_range(long offset, size_t len);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+#include "fat32.h"
+
+// Cursor over the 32-byte entries of a directory's cluster chain. Entries are
+// loaded a whole cluster at a time through the image layer, so on a mapped
+// image dir_next() returns pointers straight into the mapping.
+typedef struct DirCursor {
+    unsigned int cluster;   // cluster being scanned
+    unsigned int index;     // index of the next entry within the cluster
+    unsigned int perCluster;// entries per cluster
+    long offset;            // image offset of the entry returned last
+    DIR *entries;           // entries of the current cluster
+    unsigned char *buffer;  // cluster buffer for the stdio backend
+} DirCursor;
+
+unsigned int cluster_size(BPB *bpb);
+long cluster_offset(BPB *bpb, unsigned int cluster);
+
+void dir_open(BPB *bpb, DirCursor *cursor, unsigned int cluster);
+DIR *dir_next(FILE *fp, BPB *bpb, DirCursor *cursor);
+long dir_next_offset(BPB *bpb, long offset);
+int dir_commit(FILE *fp, DirCursor *cursor, const DIR *entry);
+void dir_close(DirCursor *cursor);
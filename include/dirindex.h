@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdio.h>
+#include "fat32.h"
+
+// Per-directory hash index of entry names. The index for a directory is
+// built the first time its cluster chain is searched and then kept up to
+// date by the functions below that add, rename or remove entries, so a name
+// lookup costs the same in a directory of 20 entries as in one of 20000.
+// Entries with a long name are indexed under both names; names compare
+// without regard to ASCII case, as FAT does. The index also keeps the runs
+// of deleted and never-used entries, so a new entry goes straight to the
+// first run that fits; a directory with none is grown by a zeroed cluster.
+// Scans stop at the first never-used entry, which ends the directory.
+
+// outcome of each name passed to dir_add_entries()
+#define DIR_ADD_OK      0
+#define DIR_ADD_EXISTS  1
+#define DIR_ADD_INVALID 2
+#define DIR_ADD_FULL    3   // no room left in the directory
+
+int dir_lookup(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name, DIR *entry, long *offset);
+int dir_add_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name, DIR *entry, long *offset);
+int dir_add_entries(FILE *fp, BPB *bpb, unsigned int dirCluster, const char **names, DIR *entries, int *status, int count);
+int dir_remove_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name);
+int dir_rename_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *oldName, const char *newName);
+void dir_index_drop(unsigned int dirCluster);
+void dir_index_clear(void);
@@ -0,0 +1,26 @@
+#pragma once
+
+// Run-length map of a file's cluster chain. Each extent covers 'length'
+// physically contiguous clusters starting at 'start', and is the file's
+// 'fileCluster'-th cluster onwards, so the cluster holding any offset is
+// found with a binary search instead of a FAT walk.
+typedef struct Extent {
+    unsigned int fileCluster;  // index of the extent's first cluster within the file
+    unsigned int start;        // first cluster on disk
+    unsigned int length;       // number of contiguous clusters
+} Extent;
+
+typedef struct ExtentMap {
+    Extent *items;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int clusters;     // total clusters mapped
+} ExtentMap;
+
+void extent_init(ExtentMap *map);
+int extent_build(ExtentMap *map, unsigned int firstCluster);
+int extent_append(ExtentMap *map, unsigned int cluster);
+int extent_lookup(const ExtentMap *map, unsigned int fileCluster, unsigned int *cluster, unsigned int *runLeft);
+unsigned int extent_last(const ExtentMap *map);
+void extent_truncate(ExtentMap *map, unsigned int clusters);
+void extent_free(ExtentMap *map);
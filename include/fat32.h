@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+// BPB structure
+typedef struct __attribute__((packed))
+{
+    unsigned char BS_jmpBoot[3];
+    unsigned char BS_OEMName[8];
+    unsigned short BPB_BytesPerSec;
+    unsigned char BPB_SecsPerClus;
+    unsigned short BPB_RsvdSecCnt;
+    unsigned char BPB_NumFATs;
+    unsigned short BPB_RootEntCnt;
+    unsigned short BPB_TotSec16;
+    unsigned char BPB_Media;
+    unsigned short BPB_FATSz16;
+    unsigned short BPB_SecPerTrk;
+    unsigned short BPB_NumHeads;
+    unsigned int BPB_HiddSec;
+    unsigned int BPB_TotSec32;
+    unsigned int BPB_FATSz32;
+    unsigned short BPB_ExtFlags;
+    unsigned short BPB_FSVer;
+    unsigned int BPB_RootClus;
+    unsigned short BPB_FSInfo;
+    unsigned short BPB_BkBootSe;
+    unsigned char BPB_Reserved[12];
+    unsigned char BS_DrvNum;
+    unsigned char BS_Reserved1;
+    unsigned char BS_BootSig;
+    unsigned int BS_VollD;
+    unsigned char BS_VolLab[11];
+    unsigned char BS_FilSysType[8];
+    unsigned char empty[420];
+    unsigned short Signature_word;
+} BPB;
+
+// directory entry structure
+typedef struct __attribute__((packed)) {
+    unsigned char DIR_Name[11];          
+    unsigned char DIR_Attr;              
+    unsigned char DIR_NTRes;             
+    unsigned char DIR_CrtTimeTenth;     
+    unsigned short DIR_CrtTime;          
+    unsigned short DIR_CrtDate;          
+    unsigned short DIR_LstAccDate;       
+    unsigned short DIR_FstClusHI;        
+    unsigned short DIR_WrtTime;          
+    unsigned short DIR_WrtDate;          
+    unsigned short DIR_FstClusLO;        
+    unsigned int DIR_FileSize;           
+} DIR;
+
+// long file name entry; a run of these, last part first, precedes the short
+// entry they name
+typedef struct __attribute__((packed)) {
+    unsigned char LDIR_Ord;              // part number, 0x40 set on the last part
+    unsigned short LDIR_Name1[5];
+    unsigned char LDIR_Attr;             // always ATTR_LONG_NAME
+    unsigned char LDIR_Type;
+    unsigned char LDIR_Chksum;           // checksum of the short name
+    unsigned short LDIR_Name2[6];
+    unsigned short LDIR_FstClusLO;       // always 0
+    unsigned short LDIR_Name3[2];
+} LDIR;
+
+#define ATTR_LONG_NAME 0x0F  // read-only | hidden | system | volume id
+
+typedef unsigned int Cluster;  // FAT32 clusters are typically 32-bit values (unsigned int)
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF  // top 4 bits of a FAT32 entry are reserved
+#define FAT_FREE       0x00000000
+#define FAT_BAD        0x0FFFFFF7  // cluster marked unusable
+#define FAT_EOC_MIN    0x0FFFFFF8  // anything >= this ends a cluster chain
+#define FAT_EOC        0x0FFFFFFF  // end-of-chain marker we write
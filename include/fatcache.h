@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "fat32.h"
+
+// In-memory copy of the active FAT. The table is read once at mount; lookups
+// and updates hit the array and changed entries are tracked in a dirty bitmap
+// until fat_sync() writes them back, as coalesced runs, to every mirrored
+// FAT copy. On a mapped image the table can be the active copy's mapping
+// itself; the journal asks for a private copy so changes wait for a checkpoint.
+int fat_load(FILE *fp, BPB *bpb, int inPlace);
+void fat_unload(void);
+unsigned int fat_get(unsigned int cluster);
+void fat_set(unsigned int cluster, unsigned int value);
+unsigned int fat_entry_count(void);
+int fat_sync(FILE *fp);
+int fat_track_changes(void);
+int fat_log_changes(int (*emit)(long offset, const void *data, size_t len));
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdio.h>
+#include "fat32.h"
+
+// Consistency check of the FAT against the directory tree. Chains of every
+// file and directory are walked in parallel to build a per-cluster
+// reference count, then the FAT is split into ranges that are scanned in
+// parallel for allocated clusters nobody references. Reports cross-linked
+// chains, lost clusters, bad chain entries (pointing at free, reserved or
+// out of range clusters), looping chains and files larger than their chain.
+// With repair set the problems are fixed through the FAT cache and the
+// allocator, unless the walk had to leave directories out, in which case
+// nothing is changed; the report goes to out. Returns the number of
+// problems found.
+int fsck_run(FILE *fp, BPB *bpb, int threads, int repair, FILE *out);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Image access layer. By default every access goes through stdio on the
+// image's FILE *. With image_open(fp, 1) the whole image is mapped and
+// image_map() hands back pointers straight into the mapping, so DIR
+// records, FAT entries and cluster data are used in place without copies.
+// image_use_uring() moves the stdio backend's batched reads and writes onto
+// an io_uring, with single accesses still going through stdio.
+// image_use_cache() puts a buffer cache of data-region clusters in front of
+// the stdio backend (see bufcache.h).
+
+// one request of a batch
+typedef struct ImageIo {
+    long offset;
+    void *buf;
+    size_t len;
+} ImageIo;
+
+int image_open(FILE *fp, int useMmap);
+void image_close(void);
+int image_is_mapped(void);
+int image_read(FILE *fp, long offset, void *buf, size_t len);
+int image_write(FILE *fp, long offset, const void *buf, size_t len);
+void *image_map(FILE *fp, long offset, size_t len, void *buf);
+void image_unmap(const void *data);
+int image_can_map(void);
+void *image_map_pread(FILE *fp, long offset, size_t len, void *buf);
+int image_commit(FILE *fp, long offset, const void *data, size_t len);
+int image_copy_out(FILE *fp, long offset, size_t len, int outFd);
+int image_copy_in(FILE *fp, long offset, size_t len, int inFd, long inOffset);
+int image_sync(FILE *fp);
+int image_flush(FILE *fp);
+int image_use_cache(FILE *fp, long dataStart, unsigned int clusterBytes, unsigned int clusters, size_t bytes);
+void image_advise(FILE *fp, long offset, size_t len);
+int image_use_uring(unsigned int depth, size_t fixedBytes);
+int image_is_async(void);
+int image_read_batch(FILE *fp, const ImageIo *ios, int count);
+int image_write_batch(FILE *fp, const ImageIo *ios, int count);
+void *image_io_buffer(size_t len);
+void image_io_buffer_free(void *buf);
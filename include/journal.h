@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Optional metadata journal in a sidecar file next to the image. FAT
+// changes and directory-entry writes are appended to it as physical records
+// before they reach the image: the FAT changes so far, then the old and new
+// bytes of each directory write. The FAT itself stays in memory until a
+// checkpoint. Each command ends with a commit record, and the log is
+// fsync'ed once per group of commands (every N commands, or once the group
+// is T ms old, checked at every logged write), so a power loss can cost the
+// last group; a crashed process loses nothing that committed. A checkpoint
+// writes the FAT and FSInfo in place, syncs the image and empties the log.
+// Mounting redoes committed commands and rolls back the directory writes of
+// one that didn't commit; FSInfo is then recounted from the recovered FAT.
+//
+// Directory writes go to the image as soon as they are logged, ahead of
+// their group's fsync, rather than being held back until the group
+// commits: every later lookup reads the directory from the image, so held
+// back writes would have to be overlaid on each read. Each in-place write
+// is preceded by an undo record, which is what keeps an uncommitted
+// command from surviving recovery.
+//
+// FAT32_WAL_CRASH_AFTER=N in the environment makes the process exit right
+// after logging its N-th record, before the write it covers, to test recovery.
+int journal_recover(FILE *fp, const char *walPath);
+int journal_open(const char *walPath, unsigned int groupOps, unsigned int groupMs);
+int journal_enabled(void);
+int journal_write(FILE *fp, long offset, const void *data, size_t len);
+int journal_end_op(FILE *fp);
+int journal_checkpoint(FILE *fp);
+void journal_close(void);
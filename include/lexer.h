@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
@@ -13,3 +14,18 @@ tokenlist * get_tokens(char *input);
 tokenlist * new_tokenlist(void);
 void add_token(tokenlist *tokens, char *item);
 void free_tokens(tokenlist *tokens);
+
+/* Reusable lexer state. The line buffer and token array grow as needed and
+ * are kept between commands; tokens are slices of the line, NUL-terminated
+ * in place, and stay valid until the next read or tokenize. */
+typedef struct {
+	char * line;
+	size_t lineCapacity;
+	tokenlist tokens;
+	size_t tokenCapacity;
+} lexer_session;
+
+void lexer_init(lexer_session *lex);
+void lexer_free(lexer_session *lex);
+char * lexer_read_line(lexer_session *lex, FILE *in);
+char * lexer_tokenize(lexer_session *lex, char *text, tokenlist **tokens);
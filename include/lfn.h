@@ -0,0 +1,32 @@
+#pragma once
+
+#include "fat32.h"
+
+// VFAT long file names. Names are UTF-8 in the shell and UTF-16 on disk, up
+// to 255 units split 13 to an entry. A name that isn't a plain upper-case
+// 8.3 name gets a generated short name ("BASIS~N.EXT") plus a run of long
+// name entries tied to it by the short name's checksum.
+
+#define LFN_MAX_CHARS 255              // UTF-16 units in a long name
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_ENTRIES 20             // entries for a name of LFN_MAX_CHARS
+#define NAME_MAX_BYTES (LFN_MAX_CHARS * 3 + 1)  // longest name as UTF-8, with its NUL
+
+// state carried across the entries of one directory scan
+typedef struct LfnState {
+    unsigned short chars[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    int next;                // part number expected next, 0 outside a run
+    int parts;               // parts in the current run
+    unsigned char checksum;
+    long start;              // image offset of the run's first entry
+} LfnState;
+
+unsigned char lfn_checksum(const unsigned char *shortName);
+void lfn_reset(LfnState *state);
+int lfn_scan(LfnState *state, const DIR *entry, long offset, char *name);
+void short_name_format(const unsigned char *shortName, unsigned char caseFlags, char *name);
+
+int lfn_name_valid(const char *name);
+int lfn_basis(const char *name, unsigned char *shortName);
+void lfn_tail(unsigned char *shortName, const unsigned char *basis, const char *name, unsigned int n);
+int lfn_encode(const char *name, const unsigned char *shortName, DIR *entries);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdio.h>
+#include "fat32.h"
+
+#define PATH_MAX_LEN 256
+
+// Path resolution. Paths may be absolute or relative to the current
+// directory and may contain "." and ".." components. Directory clusters
+// found while walking a path are kept in a bounded cache keyed by the
+// canonical path prefix, so repeated deep paths skip re-walking the tree.
+int path_normalize(const char *cwd, const char *path, char *out);
+int path_lookup_dir(FILE *fp, BPB *bpb, const char *absPath, unsigned int *cluster);
+int path_resolve_parent(FILE *fp, BPB *bpb, const char *cwd, const char *path, unsigned int *dirCluster, char *leaf);
+void path_cache_invalidate(const char *absPath);
+void path_cache_clear(void);
@@ -0,0 +1,12 @@
+#pragma once
+
+// Unix domain socket listener behind --serve. Every accepted connection
+// gets a thread of its own running session(fd, arg); the descriptor is
+// closed once session returns. Connections past maxSessions are turned away
+// with an error line. SIGINT or SIGTERM stops accepting, shuts down the
+// reading side of the open connections so their sessions see end of input,
+// and waits for them before server_run() returns. A stale socket file left
+// at socketPath is replaced, and the one created is removed on the way out.
+typedef void (*SessionFn)(int fd, void *arg);
+
+int server_run(const char *socketPath, int maxSessions, SessionFn session, void *arg);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+// Session instrumentation. The counters are bumped on the image I/O and
+// metadata hot paths in a copy private to the thread, so the tree walkers'
+// workers never contend on them; stats_flush() adds a thread's counts to
+// the shared totals, and workers call it before they return. Each
+// dispatched command is timed into a per-command latency histogram and,
+// with a trace file open, written out as one JSON line with the counters
+// it moved.
+typedef struct StatsCounters {
+    unsigned long long seeks;         // stdio repositionings of the image
+    unsigned long long reads;         // image read requests
+    unsigned long long writes;        // image write requests
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    unsigned long long syncs;         // image flushes
+    unsigned long long fatReads;      // FAT entries looked up
+    unsigned long long fatWrites;     // FAT entries set
+    unsigned long long dirEntries;    // directory entries scanned
+    unsigned long long cacheHits;     // clusters found in the buffer cache
+    unsigned long long cacheMisses;   // clusters the buffer cache had to load or make room for
+    unsigned long long cacheWritebacks; // dirty clusters written back by the buffer cache
+} StatsCounters;
+
+typedef struct StatsMark {
+    StatsCounters counters;
+    struct timespec start;
+} StatsMark;
+
+extern StatsCounters stats;
+extern __thread StatsCounters threadStats;
+
+#define STATS_ADD(field, n) (threadStats.field += (n))
+
+void stats_flush(void);
+void stats_snapshot(StatsCounters *out);
+void stats_begin(StatsMark *mark);
+void stats_end(const StatsMark *mark, const char *command, int argc, char **argv, int failed);
+void stats_print(FILE *out);
+void stats_reset(void);
+int stats_trace_open(const char *path);
+void stats_trace_close(void);
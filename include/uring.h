@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include "image.h"
+
+// Minimal io_uring engine on the raw system calls, for the image layer's
+// batched reads and writes. A batch is pushed through the ring with up to
+// the ring's depth of requests in flight; short transfers are resubmitted
+// for the rest. Requests whose buffer lies inside the registered buffer go
+// as fixed-buffer operations. Where the kernel or headers lack io_uring,
+// uring_open() fails and the image layer stays synchronous.
+int uring_open(unsigned int depth);
+void uring_close(void);
+int uring_ready(void);
+int uring_register_buffer(void *base, size_t len);
+int uring_transfer(int fd, const ImageIo *ios, int count, int writing);
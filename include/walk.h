@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "fat32.h"
+
+// Parallel traversal of a directory tree. Worker threads each keep a deque
+// of directories still to scan, pop their own work LIFO and steal from the
+// other end of a busy worker's deque when they run dry. Directory clusters
+// are read with pread (or straight from the mapping), never through stdio.
+// The entries come back sorted by path, so the result doesn't depend on the
+// thread count or scheduling. Every file and directory is visited, whatever
+// its other attribute bits; only long name parts and the volume label are
+// left out. Directories below WALK_MAX_DEPTH (walk.c) aren't scanned, and
+// the result says so.
+typedef struct WalkEntry {
+    char *path;                // absolute path in the image
+    const char *name;          // last component of path
+    int depth;                 // 0 for the starting directory
+    unsigned char attr;
+    unsigned int fileSize;
+    unsigned int firstCluster;
+    unsigned int clusters;     // length of the entry's cluster chain
+    long entryPos;             // image offset of its directory entry, -1 for the start
+} WalkEntry;
+
+typedef struct WalkResult {
+    WalkEntry *items;
+    size_t count;
+    size_t capacity;
+    int truncated;             // some directory was too deep or unreadable and wasn't scanned
+} WalkResult;
+
+int walk_tree(FILE *fp, BPB *bpb, const char *rootPath, unsigned int rootCluster, int threads, WalkResult *result);
+void walk_free(WalkResult *result);
+int walk_default_threads(void);
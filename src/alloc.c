@@ -0,0 +1,287 @@
+#include "alloc.h"
+#include "fatcache.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUC_SIG  0x61417272
+#define FSINFO_TRAIL_SIG  0xAA550000
+#define FSINFO_UNKNOWN    0xFFFFFFFF
+
+// FSInfo sector layout (FAT32 spec, section 5)
+typedef struct __attribute__((packed)) {
+    unsigned int FSI_LeadSig;
+    unsigned char FSI_Reserved1[480];
+    unsigned int FSI_StrucSig;
+    unsigned int FSI_Free_Count;
+    unsigned int FSI_Nxt_Free;
+    unsigned char FSI_Reserved2[12];
+    unsigned int FSI_TrailSig;
+} FSInfo;
+
+static uint64_t *usedMap = NULL;     // bit set = cluster in use
+static unsigned int mapWords = 0;
+static unsigned int clusterCount = 0; // number of FAT entries, including 0 and 1
+static unsigned int freeCount = 0;
+static unsigned int nextFree = 2;     // where the next search starts
+static long fsInfoOffset = -1;        // byte offset of FSInfo, -1 if the sector is unusable
+static int fsInfoDirty = 0;
+
+static void set_used(unsigned int cluster) {
+    usedMap[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+}
+
+static void set_free(unsigned int cluster) {
+    usedMap[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+}
+
+static int is_used(unsigned int cluster) {
+    return (usedMap[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+// first free cluster at or after 'start', wrapping once; 0 if the volume is full
+static unsigned int find_free_from(unsigned int start) {
+    if (freeCount == 0) {
+        return 0;
+    }
+    if (start < 2 || start >= clusterCount) {
+        start = 2;
+    }
+
+    unsigned int word = start / 64;
+    uint64_t bits = usedMap[word] | (((uint64_t)1 << (start % 64)) - 1); // ignore bits below start
+    for (unsigned int n = 0; n <= mapWords; n++) {
+        if (bits != UINT64_MAX) {
+            unsigned int cluster = word * 64 + __builtin_ctzll(~bits);
+            if (cluster < clusterCount) {
+                return cluster;
+            }
+        }
+        word = (word + 1) % mapWords;
+        bits = usedMap[word];
+    }
+    return 0;
+}
+
+int alloc_init(FILE *fp, BPB *bpb) {
+    alloc_shutdown();
+
+    clusterCount = fat_entry_count();
+    mapWords = (clusterCount + 63) / 64;
+    usedMap = (uint64_t *)calloc(mapWords, sizeof(uint64_t));
+    if (usedMap == NULL) {
+        return -1;
+    }
+
+    // clusters 0 and 1 are reserved, and bits past the end of the FAT are never free
+    set_used(0);
+    set_used(1);
+    for (unsigned int i = clusterCount; i < mapWords * 64; i++) {
+        set_used(i);
+    }
+
+    freeCount = 0;
+    for (unsigned int i = 2; i < clusterCount; i++) {
+        if (fat_get(i) != FAT_FREE) {
+            set_used(i);
+        } else {
+            freeCount++;
+        }
+    }
+
+    // pick up the next-free hint from FSInfo if the sector is valid
+    nextFree = 2;
+    fsInfoOffset = -1;
+    if (bpb->BPB_FSInfo != 0 && bpb->BPB_FSInfo < bpb->BPB_RsvdSecCnt) {
+        FSInfo info;
+        long offset = (long)bpb->BPB_FSInfo * bpb->BPB_BytesPerSec;
+        if (image_read(fp, offset, &info, sizeof(FSInfo)) == 0 &&
+            info.FSI_LeadSig == FSINFO_LEAD_SIG && info.FSI_StrucSig == FSINFO_STRUC_SIG &&
+            info.FSI_TrailSig == FSINFO_TRAIL_SIG) {
+            fsInfoOffset = offset;
+            if (info.FSI_Nxt_Free != FSINFO_UNKNOWN && info.FSI_Nxt_Free >= 2 && info.FSI_Nxt_Free < clusterCount) {
+                nextFree = info.FSI_Nxt_Free;
+            }
+            // the bitmap count is authoritative; rewrite a stale value on sync
+            if (info.FSI_Free_Count != freeCount) {
+                fsInfoDirty = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void alloc_shutdown(void) {
+    free(usedMap);
+    usedMap = NULL;
+    mapWords = 0;
+    clusterCount = 0;
+    freeCount = 0;
+    fsInfoDirty = 0;
+}
+
+unsigned int alloc_free_count(void) {
+    return freeCount;
+}
+
+// allocate one cluster and mark it as end of chain; returns 0 when the volume is full
+unsigned int alloc_cluster(void) {
+    unsigned int cluster = find_free_from(nextFree);
+    if (cluster == 0) {
+        return 0;
+    }
+
+    set_used(cluster);
+    fat_set(cluster, FAT_EOC);
+    freeCount--;
+    nextFree = cluster + 1;
+    fsInfoDirty = 1;
+    return cluster;
+}
+
+// allocate count separate one-cluster chains, all or none. They come
+// from the next-free hint upwards, so a batch of new directories lands in
+// as few contiguous runs as free space allows
+int alloc_clusters(unsigned int count, unsigned int *clusters) {
+    if (count > freeCount) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        clusters[i] = alloc_cluster();
+    }
+    return 0;
+}
+
+// allocate 'count' clusters linked into one chain, preferring a contiguous run
+// starting at the first free cluster; returns the first cluster or 0 on failure
+unsigned int alloc_run(unsigned int count) {
+    if (count == 0 || count > freeCount) {
+        return 0;
+    }
+
+    unsigned int first = alloc_cluster();
+    unsigned int prev = first;
+    for (unsigned int i = 1; i < count; i++) {
+        unsigned int next;
+        if (prev + 1 < clusterCount && !is_used(prev + 1)) {
+            // extend the current run in place
+            next = prev + 1;
+            set_used(next);
+            fat_set(next, FAT_EOC);
+            freeCount--;
+            nextFree = next + 1;
+        } else {
+            next = alloc_cluster();
+        }
+        fat_set(prev, next);
+        prev = next;
+    }
+    fsInfoDirty = 1;
+    return first;
+}
+
+// allocate 'count' physically contiguous clusters linked into one chain,
+// taking the smallest free run that fits (best fit) so large holes stay
+// available; returns the first cluster, or 0 if no run is long enough
+unsigned int alloc_contiguous(unsigned int count) {
+    if (count == 0 || count > freeCount) {
+        return 0;
+    }
+
+    unsigned int best = 0, bestLen = 0;
+    unsigned int runStart = 0, runLen = 0;
+    unsigned int cluster = 2;
+    while (cluster <= clusterCount) {
+        // bits past the end are always marked used, so the last run closes there
+        int used = cluster == clusterCount || is_used(cluster);
+        if (!used && cluster % 64 == 0 && usedMap[cluster / 64] == 0) {
+            // whole free word
+            if (runLen == 0) {
+                runStart = cluster;
+            }
+            runLen += 64;
+            cluster += 64;
+            continue;
+        }
+        if (!used) {
+            if (runLen == 0) {
+                runStart = cluster;
+            }
+            runLen++;
+            cluster++;
+            continue;
+        }
+
+        if (runLen >= count && (bestLen == 0 || runLen < bestLen)) {
+            best = runStart;
+            bestLen = runLen;
+            if (bestLen == count) {
+                break;  // exact fit, can't do better
+            }
+        }
+        runLen = 0;
+        if (cluster % 64 == 0 && cluster < clusterCount && usedMap[cluster / 64] == UINT64_MAX) {
+            cluster += 64;  // whole used word
+        } else {
+            cluster++;
+        }
+    }
+    if (bestLen == 0) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        set_used(best + i);
+        fat_set(best + i, i + 1 < count ? best + i + 1 : FAT_EOC);
+    }
+    freeCount -= count;
+    if (nextFree >= best && nextFree < best + count) {
+        nextFree = best + count;
+    }
+    fsInfoDirty = 1;
+    return best;
+}
+
+void alloc_free(unsigned int cluster) {
+    if (cluster < 2 || cluster >= clusterCount) {
+        return;
+    }
+
+    fat_set(cluster, FAT_FREE);
+    if (is_used(cluster)) {
+        set_free(cluster);
+        freeCount++;
+        fsInfoDirty = 1;
+    }
+    if (cluster < nextFree) {
+        nextFree = cluster;
+    }
+}
+
+// free every cluster of the chain starting at 'first'
+void alloc_free_chain(unsigned int first) {
+    unsigned int cluster = first;
+    while (cluster >= 2 && cluster < FAT_EOC_MIN && cluster < clusterCount) {
+        unsigned int next = fat_get(cluster);
+        alloc_free(cluster);
+        cluster = next;
+    }
+}
+
+// write the free count and next-free hint back to FSInfo
+int alloc_sync(FILE *fp) {
+    if (!fsInfoDirty || fsInfoOffset < 0) {
+        return 0;
+    }
+
+    unsigned int fields[2] = { freeCount, nextFree };
+    if (image_write(fp, fsInfoOffset + offsetof(FSInfo, FSI_Free_Count), fields, sizeof(fields)) != 0) {
+        return -1;
+    }
+    fsInfoDirty = 0;
+    return image_sync(fp);
+}
@@ -0,0 +1,405 @@
+#include "bufcache.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BCACHE_NONE (-1)
+#define BCACHE_MIN  8      // fewest buffers worth having
+
+typedef struct CacheBuf {
+    unsigned int cluster;     // cluster held, 0 when the buffer is empty
+    unsigned int pins;        // callers holding a pointer into the buffer
+    unsigned char dirty;      // newer than the image
+    unsigned char referenced; // hit since the clock hand last passed
+    int next;                 // next buffer in the same hash bucket
+} CacheBuf;
+
+static FILE *cacheFp = NULL;           // NULL while the cache is off
+static CacheBuf *bufs = NULL;
+static unsigned char *cacheData = NULL; // capacity clusters back to back
+static unsigned int capacity = 0;
+static int *buckets = NULL;            // first buffer of each hash chain
+static unsigned int bucketMask = 0;
+static unsigned int hand = 0;          // clock hand
+static long dataStart = 0;             // image offset of cluster 2
+static unsigned int clusterBytes = 0;
+static unsigned int clusterEnd = 0;    // first cluster number past the data region
+static size_t bypassBytes = 0;         // larger transfers go around the cache
+
+static unsigned char *buf_data(CacheBuf *b) {
+    return cacheData + (size_t)(b - bufs) * clusterBytes;
+}
+
+static long buf_offset(CacheBuf *b) {
+    return dataStart + (long)(b->cluster - 2) * clusterBytes;
+}
+
+static unsigned int bucket_of(unsigned int cluster) {
+    return (cluster * 2654435761u) & bucketMask;
+}
+
+static int raw_read(long offset, void *buf, size_t len) {
+    STATS_ADD(seeks, 1);
+    fseek(cacheFp, offset, SEEK_SET);
+    return fread(buf, 1, len, cacheFp) == len ? 0 : -1;
+}
+
+static int raw_write(long offset, const void *buf, size_t len) {
+    STATS_ADD(seeks, 1);
+    fseek(cacheFp, offset, SEEK_SET);
+    return fwrite(buf, 1, len, cacheFp) == len ? 0 : -1;
+}
+
+static CacheBuf *find(unsigned int cluster) {
+    for (int i = buckets[bucket_of(cluster)]; i != BCACHE_NONE; i = bufs[i].next) {
+        if (bufs[i].cluster == cluster) {
+            return &bufs[i];
+        }
+    }
+    return NULL;
+}
+
+// take b out of its hash chain and leave it empty
+static void drop(CacheBuf *b) {
+    int index = (int)(b - bufs);
+    int *link = &buckets[bucket_of(b->cluster)];
+    while (*link != index) {
+        link = &bufs[*link].next;
+    }
+    *link = b->next;
+    b->cluster = 0;
+    b->dirty = 0;
+    b->referenced = 0;
+}
+
+static int write_back(CacheBuf *b) {
+    if (!b->dirty) {
+        return 0;
+    }
+    if (raw_write(buf_offset(b), buf_data(b), clusterBytes) != 0) {
+        return -1;
+    }
+    b->dirty = 0;
+    STATS_ADD(cacheWritebacks, 1);
+    return 0;
+}
+
+// a buffer to reuse: the first unpinned one the hand reaches that wasn't
+// hit since its last pass, written back first if dirty; NULL when they're
+// all pinned
+static CacheBuf *evict(void) {
+    for (unsigned int step = 0; step < 2 * capacity; step++) {
+        CacheBuf *b = &bufs[hand];
+        hand = (hand + 1) % capacity;
+        if (b->pins > 0) {
+            continue;
+        }
+        if (b->referenced) {
+            b->referenced = 0;
+            continue;
+        }
+        if (b->cluster != 0) {
+            if (write_back(b) != 0) {
+                return NULL;
+            }
+            drop(b);
+        }
+        return b;
+    }
+    return NULL;
+}
+
+// buffer holding cluster, loaded on a miss; fetch = 0 skips reading the old
+// contents when the caller is about to overwrite all of them. NULL when no
+// buffer can be freed or the read fails, and the caller goes to the image
+static CacheBuf *get(unsigned int cluster, int fetch) {
+    CacheBuf *b = find(cluster);
+    if (b != NULL) {
+        STATS_ADD(cacheHits, 1);
+        b->referenced = 1;
+        return b;
+    }
+
+    // a cluster seen once starts unreferenced, so a long scan only
+    // recycles its own buffers
+    STATS_ADD(cacheMisses, 1);
+    b = evict();
+    if (b == NULL || (fetch && raw_read(dataStart + (long)(cluster - 2) * clusterBytes, buf_data(b), clusterBytes) != 0)) {
+        return NULL;
+    }
+    unsigned int bucket = bucket_of(cluster);
+    b->cluster = cluster;
+    b->next = buckets[bucket];
+    buckets[bucket] = (int)(b - bufs);
+    return b;
+}
+
+// cache capacity clusters of clusterBytes each out of the data region that
+// starts at dataStart; capacity 0 leaves the cache off
+int bcache_init(FILE *fp, long start, unsigned int bytesPerCluster, unsigned int clusters, unsigned int count) {
+    bcache_shutdown();
+    if (count == 0 || bytesPerCluster == 0) {
+        return 0;
+    }
+    if (count < BCACHE_MIN) {
+        count = BCACHE_MIN;
+    }
+
+    unsigned int bucketCount = 1;
+    while (bucketCount < 2 * count) {
+        bucketCount *= 2;
+    }
+    bufs = (CacheBuf *)calloc(count, sizeof(CacheBuf));
+    cacheData = (unsigned char *)malloc((size_t)count * bytesPerCluster);
+    buckets = (int *)malloc(bucketCount * sizeof(int));
+    if (bufs == NULL || cacheData == NULL || buckets == NULL) {
+        free(bufs);
+        free(cacheData);
+        free(buckets);
+        bufs = NULL;
+        cacheData = NULL;
+        buckets = NULL;
+        return -1;
+    }
+    for (unsigned int i = 0; i < bucketCount; i++) {
+        buckets[i] = BCACHE_NONE;
+    }
+
+    cacheFp = fp;
+    capacity = count;
+    bucketMask = bucketCount - 1;
+    hand = 0;
+    dataStart = start;
+    clusterBytes = bytesPerCluster;
+    clusterEnd = clusters;
+    bypassBytes = (size_t)(count / 4) * bytesPerCluster;
+    return 0;
+}
+
+// write back whatever is dirty and turn the cache off
+void bcache_shutdown(void) {
+    if (cacheFp == NULL) {
+        return;
+    }
+    bcache_flush();
+    fflush(cacheFp);
+    free(bufs);
+    free(cacheData);
+    free(buckets);
+    bufs = NULL;
+    cacheData = NULL;
+    buckets = NULL;
+    cacheFp = NULL;
+    capacity = 0;
+}
+
+int bcache_enabled(void) {
+    return cacheFp != NULL;
+}
+
+// whether len bytes at offset lie in the cached data region
+int bcache_covers(long offset, size_t len) {
+    if (cacheFp == NULL || len == 0 || offset < dataStart) {
+        return 0;
+    }
+    unsigned long long end = (unsigned long long)(clusterEnd - 2) * clusterBytes;
+    return (unsigned long long)(offset - dataStart) + len <= end;
+}
+
+// call fn on each cached cluster overlapping len bytes at offset, walking
+// whichever is shorter: the clusters of the range or the cache itself
+static int for_range(long offset, size_t len, int (*fn)(CacheBuf *b, long offset, size_t len, const void *buf), const void *buf) {
+    unsigned int first = (unsigned int)((offset - dataStart) / clusterBytes) + 2;
+    unsigned int last = (unsigned int)((offset - dataStart + (long)len - 1) / clusterBytes) + 2;
+    if (last - first + 1 > capacity) {
+        for (unsigned int i = 0; i < capacity; i++) {
+            if (bufs[i].cluster >= first && bufs[i].cluster <= last && fn(&bufs[i], offset, len, buf) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    for (unsigned int c = first; c <= last; c++) {
+        CacheBuf *b = find(c);
+        if (b != NULL && fn(b, offset, len, buf) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the part of b that overlaps len bytes at offset: where it starts in b and
+// in the range, and how long it is
+static size_t overlap(CacheBuf *b, long offset, size_t len, size_t *inBuf, size_t *inRange) {
+    long start = buf_offset(b);
+    long from = offset > start ? offset : start;
+    long to = offset + (long)len < start + (long)clusterBytes ? offset + (long)len : start + (long)clusterBytes;
+    *inBuf = (size_t)(from - start);
+    *inRange = (size_t)(from - offset);
+    return (size_t)(to - from);
+}
+
+static int copy_dirty_out(CacheBuf *b, long offset, size_t len, const void *buf) {
+    if (b->dirty) {
+        size_t inBuf, inRange;
+        size_t n = overlap(b, offset, len, &inBuf, &inRange);
+        memcpy((unsigned char *)buf + inRange, buf_data(b) + inBuf, n);
+    }
+    return 0;
+}
+
+static int copy_in(CacheBuf *b, long offset, size_t len, const void *buf) {
+    size_t inBuf, inRange;
+    size_t n = overlap(b, offset, len, &inBuf, &inRange);
+    memcpy(buf_data(b) + inBuf, (const unsigned char *)buf + inRange, n);
+    return 0;
+}
+
+static int write_back_one(CacheBuf *b, long offset, size_t len, const void *buf) {
+    return write_back(b);
+}
+
+static int discard_one(CacheBuf *b, long offset, size_t len, const void *buf) {
+    // a pinned buffer is still in use, so it gets the new contents instead
+    if (b->pins > 0) {
+        return raw_read(buf_offset(b), buf_data(b), clusterBytes);
+    }
+    drop(b);
+    return 0;
+}
+
+int bcache_read(long offset, void *buf, size_t len) {
+    if (len > bypassBytes) {
+        // too big to keep: read around the cache, then lay the cached
+        // changes that haven't reached the image over it
+        if (raw_read(offset, buf, len) != 0) {
+            return -1;
+        }
+        return for_range(offset, len, copy_dirty_out, buf);
+    }
+
+    unsigned char *out = (unsigned char *)buf;
+    long rel = offset - dataStart;
+    while (len > 0) {
+        unsigned int cluster = (unsigned int)(rel / clusterBytes) + 2;
+        size_t within = (size_t)(rel % clusterBytes);
+        size_t piece = clusterBytes - within < len ? clusterBytes - within : len;
+        CacheBuf *b = get(cluster, 1);
+        if (b != NULL) {
+            memcpy(out, buf_data(b) + within, piece);
+        } else if (raw_read(dataStart + rel, out, piece) != 0) {
+            return -1;
+        }
+        rel += (long)piece;
+        out += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+int bcache_write(long offset, const void *buf, size_t len) {
+    if (len > bypassBytes) {
+        if (raw_write(offset, buf, len) != 0) {
+            return -1;
+        }
+        bcache_update_range(offset, buf, len);
+        return 0;
+    }
+
+    const unsigned char *in = (const unsigned char *)buf;
+    long rel = offset - dataStart;
+    while (len > 0) {
+        unsigned int cluster = (unsigned int)(rel / clusterBytes) + 2;
+        size_t within = (size_t)(rel % clusterBytes);
+        size_t piece = clusterBytes - within < len ? clusterBytes - within : len;
+        CacheBuf *b = get(cluster, piece < clusterBytes);
+        if (b != NULL) {
+            memcpy(buf_data(b) + within, in, piece);
+            b->dirty = 1;
+        } else if (raw_write(dataStart + rel, in, piece) != 0) {
+            return -1;
+        }
+        rel += (long)piece;
+        in += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+// the buffer for one whole cluster at offset, held in the cache until
+// bcache_unpin(); NULL for anything else or when nothing can be freed
+void *bcache_pin(long offset, size_t len) {
+    if (!bcache_covers(offset, len) || len != clusterBytes || (offset - dataStart) % clusterBytes != 0) {
+        return NULL;
+    }
+    CacheBuf *b = get((unsigned int)((offset - dataStart) / clusterBytes) + 2, 1);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->pins++;
+    return buf_data(b);
+}
+
+static CacheBuf *owner(const void *data) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (cacheFp == NULL || p < cacheData || p >= cacheData + (size_t)capacity * clusterBytes) {
+        return NULL;
+    }
+    return &bufs[(size_t)(p - cacheData) / clusterBytes];
+}
+
+void bcache_unpin(const void *data) {
+    CacheBuf *b = owner(data);
+    if (b != NULL && b->pins > 0) {
+        b->pins--;
+    }
+}
+
+// data was changed in place inside a pinned buffer: mark it for write-back.
+// Returns 0 when data isn't the cache's copy of offset
+int bcache_mark_dirty(long offset, const void *data, size_t len) {
+    CacheBuf *b = owner(data);
+    if (b == NULL || b->cluster == 0 || buf_offset(b) + ((const unsigned char *)data - buf_data(b)) != offset ||
+        ((const unsigned char *)data - buf_data(b)) + len > clusterBytes) {
+        return 0;
+    }
+    b->dirty = 1;
+    return 1;
+}
+
+// write every dirty buffer back, keeping the clean copies
+int bcache_flush(void) {
+    int result = 0;
+    for (unsigned int i = 0; cacheFp != NULL && i < capacity; i++) {
+        if (bufs[i].cluster != 0 && write_back(&bufs[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// before reading the image's descriptor directly: put cached changes to
+// len bytes at offset on the image
+int bcache_writeback_range(long offset, size_t len) {
+    if (!bcache_covers(offset, len)) {
+        return 0;
+    }
+    return for_range(offset, len, write_back_one, NULL);
+}
+
+// after writing buf to the image directly: bring cached copies up to date
+void bcache_update_range(long offset, const void *buf, size_t len) {
+    if (bcache_covers(offset, len)) {
+        for_range(offset, len, copy_in, buf);
+    }
+}
+
+// after the image changed underneath without a copy in hand: forget cached
+// copies of the range, which bcache_writeback_range() made clean beforehand
+int bcache_discard_range(long offset, size_t len) {
+    if (!bcache_covers(offset, len)) {
+        return 0;
+    }
+    return for_range(offset, len, discard_one, NULL);
+}
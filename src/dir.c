@@ -0,0 +1,92 @@
+#include "dir.h"
+#include "fatcache.h"
+#include "image.h"
+#include "journal.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bytes in one cluster
+unsigned int cluster_size(BPB *bpb) {
+    return bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
+}
+
+// byte offset of a data cluster in the image; cluster 0 stands for the root directory
+long cluster_offset(BPB *bpb, unsigned int cluster) {
+    if (cluster < 2) {
+        cluster = bpb->BPB_RootClus;
+    }
+    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
+    long dataRegionStart = (long)rootDirSector * bpb->BPB_BytesPerSec;
+    return dataRegionStart + (long)(cluster - 2) * cluster_size(bpb);
+}
+
+void dir_open(BPB *bpb, DirCursor *cursor, unsigned int cluster) {
+    cursor->cluster = cluster < 2 ? bpb->BPB_RootClus : cluster;
+    cursor->index = 0;
+    cursor->perCluster = cluster_size(bpb) / sizeof(DIR);
+    cursor->offset = -1;
+    cursor->entries = NULL;
+    // with the journal on, entries are edited in a copy so the old bytes
+    // are still in the image when journal_write() logs them
+    cursor->buffer = image_can_map() && !journal_enabled() ? NULL : (unsigned char *)malloc(cluster_size(bpb));
+}
+
+// next entry of the chain, or NULL once the chain ends
+DIR *dir_next(FILE *fp, BPB *bpb, DirCursor *cursor) {
+    if (cursor->entries != NULL && cursor->index == cursor->perCluster) {
+        // move to the next cluster in the chain
+        cursor->cluster = fat_get(cursor->cluster);
+        if (cursor->buffer == NULL) {
+            image_unmap(cursor->entries);
+        }
+        cursor->entries = NULL;
+        cursor->index = 0;
+    }
+
+    if (cursor->entries == NULL) {
+        if (cursor->cluster < 2 || cursor->cluster >= FAT_EOC_MIN) {
+            return NULL;
+        }
+        long offset = cluster_offset(bpb, cursor->cluster);
+        if (cursor->buffer != NULL) {
+            cursor->entries = image_read(fp, offset, cursor->buffer, cluster_size(bpb)) == 0 ? (DIR *)cursor->buffer : NULL;
+        } else {
+            cursor->entries = (DIR *)image_map(fp, offset, cluster_size(bpb), NULL);
+        }
+        if (cursor->entries == NULL) {
+            return NULL;
+        }
+    }
+
+    cursor->offset = cluster_offset(bpb, cursor->cluster) + (long)cursor->index * sizeof(DIR);
+    STATS_ADD(dirEntries, 1);
+    return &cursor->entries[cursor->index++];
+}
+
+// image offset of the entry after the one at offset, following the chain
+// into the next cluster; -1 past the end of the chain
+long dir_next_offset(BPB *bpb, long offset) {
+    long dataStart = cluster_offset(bpb, 2);
+    long next = offset + sizeof(DIR);
+    if ((next - dataStart) % cluster_size(bpb) != 0) {
+        return next;
+    }
+    unsigned int cluster = fat_get((unsigned int)((offset - dataStart) / cluster_size(bpb)) + 2);
+    return cluster >= 2 && cluster < FAT_EOC_MIN ? cluster_offset(bpb, cluster) : -1;
+}
+
+// write entry back to the slot returned last by dir_next()
+int dir_commit(FILE *fp, DirCursor *cursor, const DIR *entry) {
+    return journal_write(fp, cursor->offset, entry, sizeof(DIR));
+}
+
+void dir_close(DirCursor *cursor) {
+    if (cursor->buffer == NULL) {
+        image_unmap(cursor->entries);
+    }
+    free(cursor->buffer);
+    cursor->buffer = NULL;
+    cursor->entries = NULL;
+}
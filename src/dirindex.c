@@ -0,0 +1,751 @@
+#include "dirindex.h"
+#include "dir.h"
+#include "fatcache.h"
+#include "image.h"
+#include "journal.h"
+#include "lfn.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAX_DIR_INDEXES 128      // directories indexed at once; least recently used is evicted
+#define INDEX_MIN_SLOTS 64       // initial hash table size (power of two)
+#define MAX_SHORT_TAILS 999999   // short name candidates tried before giving up
+
+typedef struct IndexSlot {
+    char *key;                   // folded name, NULL marks an empty slot
+    unsigned int hash;
+    unsigned char shortName[11]; // the entry's short name, to spot a stale slot
+    unsigned char attr;
+    unsigned char span;          // entries the name takes: long name parts plus the short entry
+    unsigned int firstCluster;
+    long offset;                 // image offset of the 32-byte short entry
+    long start;                  // image offset of the first entry of the name
+    unsigned int firstEntry;     // number of that entry within the directory
+} IndexSlot;
+
+// a run of free entries, numbered from the start of the directory
+typedef struct FreeRun {
+    unsigned int first;
+    unsigned int length;
+} FreeRun;
+
+typedef struct DirIndex {
+    unsigned int cluster;        // first cluster of the indexed directory, 0 if unused
+    unsigned long lastUse;
+    unsigned int slotCount;      // power of two
+    unsigned int used;           // live entries
+    unsigned int tombstones;     // removed entries still occupying slots
+    IndexSlot *slots;
+    unsigned int *chain;         // the directory's clusters in order, to place entry numbers
+    unsigned int chainLength;
+    unsigned int chainCapacity;
+    unsigned int perCluster;     // entries per cluster
+    FreeRun *runs;               // deleted and never-used entries, in order
+    unsigned int runCount;
+    unsigned int runCapacity;
+} DirIndex;
+
+static char tombstone[] = "";    // key of a removed slot, never a valid name
+
+static DirIndex indexes[MAX_DIR_INDEXES];
+static unsigned long useClock = 0;
+// --serve sessions look names up concurrently; the functions that change a
+// directory only run while every other session is held off
+static pthread_mutex_t lookupLock = PTHREAD_MUTEX_INITIALIZER;
+
+// names match case-insensitively; keys are the name with ASCII letters upper-cased
+static char *fold_name(const char *name) {
+    size_t len = strlen(name);
+    char *key = (char *)malloc(len + 1);
+    if (key == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i <= len; i++) {
+        key[i] = name[i] >= 'a' && name[i] <= 'z' ? name[i] - 'a' + 'A' : name[i];
+    }
+    return key;
+}
+
+// FNV-1a over the key bytes
+static unsigned int hash_key(const char *key) {
+    unsigned int h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static IndexSlot *find_slot(DirIndex *index, const char *key) {
+    unsigned int hash = hash_key(key);
+    unsigned int mask = index->slotCount - 1;
+    for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+        IndexSlot *slot = &index->slots[i];
+        if (slot->key == NULL) {
+            return NULL;
+        }
+        if (slot->key != tombstone && slot->hash == hash && strcmp(slot->key, key) == 0) {
+            return slot;
+        }
+    }
+}
+
+static void insert_slot(DirIndex *index, const IndexSlot *entry);
+
+static int resize(DirIndex *index, unsigned int slotCount) {
+    IndexSlot *old = index->slots;
+    unsigned int oldCount = index->slotCount;
+
+    index->slots = (IndexSlot *)calloc(slotCount, sizeof(IndexSlot));
+    if (index->slots == NULL) {
+        index->slots = old;
+        return -1;
+    }
+    index->slotCount = slotCount;
+    index->used = 0;
+    index->tombstones = 0;
+    for (unsigned int i = 0; i < oldCount; i++) {
+        if (old[i].key != NULL && old[i].key != tombstone) {
+            insert_slot(index, &old[i]);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// add an entry, taking over its key; the first entry with a given key wins,
+// like a linear scan
+static void insert_slot(DirIndex *index, const IndexSlot *entry) {
+    if ((index->used + index->tombstones + 1) * 10 > index->slotCount * 7) {
+        unsigned int size = index->slotCount;
+        while ((index->used + 1) * 10 > size * 5) {
+            size *= 2;
+        }
+        if (resize(index, size) != 0) {
+            free(entry->key);
+            return;
+        }
+    }
+
+    unsigned int mask = index->slotCount - 1;
+    IndexSlot *reuse = NULL;
+    for (unsigned int i = entry->hash & mask; ; i = (i + 1) & mask) {
+        IndexSlot *slot = &index->slots[i];
+        if (slot->key == NULL) {
+            if (reuse == NULL) {
+                reuse = slot;
+            } else {
+                index->tombstones--;
+            }
+            break;
+        }
+        if (slot->key == tombstone) {
+            if (reuse == NULL) {
+                reuse = slot;
+            }
+            continue;
+        }
+        if (slot->hash == entry->hash && strcmp(slot->key, entry->key) == 0) {
+            free(entry->key);
+            return;
+        }
+    }
+    *reuse = *entry;
+    index->used++;
+}
+
+static void remove_key(DirIndex *index, const char *name, long offset) {
+    char *key = fold_name(name);
+    if (key == NULL) {
+        return;
+    }
+    IndexSlot *slot = find_slot(index, key);
+    if (slot != NULL && slot->offset == offset) {
+        free(slot->key);
+        slot->key = tombstone;
+        index->used--;
+        index->tombstones++;
+    }
+    free(key);
+}
+
+// index an entry under its name and, when that is a long name, under its
+// short name too
+static void index_add(DirIndex *index, const char *name, const DIR *entry, long offset, long start, unsigned int firstEntry, int span) {
+    IndexSlot slot;
+    memcpy(slot.shortName, entry->DIR_Name, 11);
+    slot.attr = entry->DIR_Attr;
+    slot.span = span;
+    slot.firstCluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+    slot.offset = offset;
+    slot.start = start;
+    slot.firstEntry = firstEntry;
+
+    if ((slot.key = fold_name(name)) != NULL) {
+        slot.hash = hash_key(slot.key);
+        insert_slot(index, &slot);
+    }
+    if (span > 1) {
+        char shortName[13];
+        short_name_format(entry->DIR_Name, entry->DIR_NTRes, shortName);
+        if ((slot.key = fold_name(shortName)) != NULL) {
+            slot.hash = hash_key(slot.key);
+            insert_slot(index, &slot);
+        }
+    }
+}
+
+static void release(DirIndex *index) {
+    for (unsigned int i = 0; index->slots != NULL && i < index->slotCount; i++) {
+        if (index->slots[i].key != tombstone) {
+            free(index->slots[i].key);
+        }
+    }
+    free(index->slots);
+    free(index->chain);
+    free(index->runs);
+    memset(index, 0, sizeof(DirIndex));
+}
+
+// image offset of entry number n of the directory
+static long entry_offset(BPB *bpb, DirIndex *index, unsigned int n) {
+    return cluster_offset(bpb, index->chain[n / index->perCluster]) + (long)(n % index->perCluster) * sizeof(DIR);
+}
+
+// mark entries first..first+length-1 free, merging with the runs around them
+static void add_free(DirIndex *index, unsigned int first, unsigned int length) {
+    unsigned int lo = 0, hi = index->runCount;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (index->runs[mid].first < first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    FreeRun *before = lo > 0 ? &index->runs[lo - 1] : NULL;
+    FreeRun *after = lo < index->runCount ? &index->runs[lo] : NULL;
+    if (before != NULL && before->first + before->length == first) {
+        before->length += length;
+        if (after != NULL && first + length == after->first) {
+            before->length += after->length;
+            memmove(after, after + 1, (index->runCount - lo - 1) * sizeof(FreeRun));
+            index->runCount--;
+        }
+        return;
+    }
+    if (after != NULL && first + length == after->first) {
+        after->first = first;
+        after->length += length;
+        return;
+    }
+
+    if (index->runCount == index->runCapacity) {
+        unsigned int capacity = index->runCapacity > 0 ? index->runCapacity * 2 : 16;
+        FreeRun *runs = (FreeRun *)realloc(index->runs, capacity * sizeof(FreeRun));
+        if (runs == NULL) {
+            return;  // the entries just stay unused until the index is rebuilt
+        }
+        index->runs = runs;
+        index->runCapacity = capacity;
+    }
+    memmove(&index->runs[lo + 1], &index->runs[lo], (index->runCount - lo) * sizeof(FreeRun));
+    index->runs[lo].first = first;
+    index->runs[lo].length = length;
+    index->runCount++;
+}
+
+// take the first run of count free entries; returns its first entry number or -1
+static long take_free(DirIndex *index, unsigned int count) {
+    for (unsigned int i = 0; i < index->runCount; i++) {
+        FreeRun *run = &index->runs[i];
+        if (run->length >= count) {
+            unsigned int first = run->first;
+            run->first += count;
+            run->length -= count;
+            if (run->length == 0) {
+                memmove(run, run + 1, (index->runCount - i - 1) * sizeof(FreeRun));
+                index->runCount--;
+            }
+            return first;
+        }
+    }
+    return -1;
+}
+
+static int append_cluster(DirIndex *index, unsigned int cluster) {
+    if (index->chainLength == index->chainCapacity) {
+        unsigned int capacity = index->chainCapacity > 0 ? index->chainCapacity * 2 : 8;
+        unsigned int *chain = (unsigned int *)realloc(index->chain, capacity * sizeof(unsigned int));
+        if (chain == NULL) {
+            return -1;
+        }
+        index->chain = chain;
+        index->chainCapacity = capacity;
+    }
+    index->chain[index->chainLength++] = cluster;
+    return 0;
+}
+
+// add a zeroed cluster to the end of the directory's chain. The cluster is
+// cleared before it is linked, so the chain never holds stale entries
+static int grow_directory(FILE *fp, BPB *bpb, DirIndex *index) {
+    if (index->chainLength == 0) {
+        return -1;
+    }
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned char *zeros = (unsigned char *)calloc(1, bytesPerCluster);
+    unsigned int cluster = zeros != NULL ? alloc_cluster() : 0;
+    if (cluster == 0 || journal_write(fp, cluster_offset(bpb, cluster), zeros, bytesPerCluster) != 0) {
+        free(zeros);
+        if (cluster != 0) {
+            alloc_free(cluster);
+        }
+        return -1;
+    }
+    free(zeros);
+
+    dir_index_drop(cluster);  // left over from a directory that used the cluster
+    unsigned int last = index->chain[index->chainLength - 1];
+    if (append_cluster(index, cluster) != 0) {
+        alloc_free(cluster);
+        return -1;
+    }
+    fat_set(last, cluster);
+    add_free(index, (index->chainLength - 1) * index->perCluster, index->perCluster);
+    return 0;
+}
+
+// entry number of a run of count free entries, growing the directory when
+// none is long enough; -1 if the volume is full
+static long take_entries(FILE *fp, BPB *bpb, DirIndex *index, unsigned int count) {
+    long first;
+    while ((first = take_free(index, count)) < 0) {
+        if (grow_directory(fp, bpb, index) != 0) {
+            return -1;
+        }
+    }
+    return first;
+}
+
+static DirIndex *find_index(unsigned int dirCluster) {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        if (indexes[i].cluster == dirCluster && indexes[i].slots != NULL) {
+            indexes[i].lastUse = ++useClock;
+            return &indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// scan the directory chain once and index every named entry, assembling
+// long names on the way
+static DirIndex *build_index(FILE *fp, BPB *bpb, unsigned int dirCluster) {
+    DirIndex *index = &indexes[0];
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        if (indexes[i].slots == NULL) {
+            index = &indexes[i];
+            break;
+        }
+        if (indexes[i].lastUse < index->lastUse) {
+            index = &indexes[i];
+        }
+    }
+    release(index);
+
+    index->slots = (IndexSlot *)calloc(INDEX_MIN_SLOTS, sizeof(IndexSlot));
+    if (index->slots == NULL) {
+        return NULL;
+    }
+    index->slotCount = INDEX_MIN_SLOTS;
+    index->cluster = dirCluster;
+    index->lastUse = ++useClock;
+    index->perCluster = cluster_size(bpb) / sizeof(DIR);
+
+    unsigned int limit = fat_entry_count();
+    for (unsigned int c = dirCluster; c >= 2 && c < FAT_EOC_MIN && index->chainLength < limit; c = fat_get(c)) {
+        if (append_cluster(index, c) != 0) {
+            release(index);
+            return NULL;
+        }
+    }
+
+    DirCursor cursor;
+    DIR *dirEntry;
+    LfnState lfn;
+    char name[NAME_MAX_BYTES];
+    unsigned int n = 0;  // number of the entry dir_next() returned
+    lfn_reset(&lfn);
+    dir_open(bpb, &cursor, dirCluster);
+    for (; (dirEntry = dir_next(fp, bpb, &cursor)) != NULL; n++) {
+        // a never-used entry ends the directory; all of the chain after it is free
+        if (dirEntry->DIR_Name[0] == 0x00) {
+            break;
+        }
+        if (dirEntry->DIR_Name[0] == 0xE5) {
+            add_free(index, n, 1);
+        }
+        // skip deleted and long name entries, and the volume label
+        int span = lfn_scan(&lfn, dirEntry, cursor.offset, name);
+        if (span == 0 || (dirEntry->DIR_Attr & 0x08)) {
+            continue;
+        }
+        index_add(index, name, dirEntry, cursor.offset, lfn.start, n + 1 - span, span);
+    }
+    dir_close(&cursor);
+    unsigned int total = index->chainLength * index->perCluster;
+    if (n < total) {
+        add_free(index, n, total - n);
+    }
+    return index;
+}
+
+static DirIndex *get_index(FILE *fp, BPB *bpb, unsigned int dirCluster) {
+    DirIndex *index = find_index(dirCluster);
+    return index != NULL ? index : build_index(fp, bpb, dirCluster);
+}
+
+// the slot for name, with its short entry re-read into *current so callers
+// always see the current size and cluster
+static IndexSlot *lookup_slot(FILE *fp, BPB *bpb, DirIndex **indexOut, unsigned int dirCluster, const char *name, DIR *current) {
+    if (strlen(name) >= NAME_MAX_BYTES) {
+        return NULL;
+    }
+    char *key = fold_name(name);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    IndexSlot *slot = NULL;
+    for (int attempt = 0; attempt < 2 && slot == NULL; attempt++) {
+        DirIndex *index = get_index(fp, bpb, dirCluster);
+        if (index == NULL || (slot = find_slot(index, key)) == NULL) {
+            break;
+        }
+        if (image_read(fp, slot->offset, current, sizeof(DIR)) != 0 ||
+            memcmp(current->DIR_Name, slot->shortName, 11) != 0 || (current->DIR_Attr & 0x3F) == ATTR_LONG_NAME) {
+            // the directory changed behind our back; rebuild and try once more
+            dir_index_drop(dirCluster);
+            slot = NULL;
+            continue;
+        }
+        slot->firstCluster = current->DIR_FstClusLO | (current->DIR_FstClusHI << 16);
+        slot->attr = current->DIR_Attr;
+        *indexOut = index;
+    }
+    free(key);
+    return slot;
+}
+
+// find name in the directory starting at dirCluster, by its long or short
+// name; on success the short entry is copied to *entry and its image offset
+// stored in *offset
+int dir_lookup(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name, DIR *entry, long *offset) {
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+
+    DirIndex *index;
+    DIR current;
+    pthread_mutex_lock(&lookupLock);
+    IndexSlot *slot = lookup_slot(fp, bpb, &index, dirCluster, name, &current);
+    if (slot != NULL && entry != NULL) {
+        *entry = current;
+    }
+    if (slot != NULL && offset != NULL) {
+        *offset = slot->offset;
+    }
+    pthread_mutex_unlock(&lookupLock);
+    return slot != NULL;
+}
+
+static int short_name_taken(DirIndex *index, const unsigned char *shortName) {
+    char name[13];
+    short_name_format(shortName, 0, name);
+    char *key = fold_name(name);
+    int taken = key == NULL || find_slot(index, key) != NULL;
+    free(key);
+    return taken;
+}
+
+// pick a short name for name that is unique in the directory and build the
+// entries that go on disk: long name parts first, entry last. Returns the
+// number of long name parts, or -1 if no short name is left
+static int make_entries(DirIndex *index, const char *name, DIR *entry, DIR *entries) {
+    unsigned char basis[11];
+    int parts = 0;
+    if (lfn_basis(name, basis) && !short_name_taken(index, basis)) {
+        memcpy(entry->DIR_Name, basis, 11);
+    } else {
+        // the index holds every short name in the directory, so each candidate is one probe
+        unsigned int n = 1;
+        lfn_tail(entry->DIR_Name, basis, name, n);
+        while (short_name_taken(index, entry->DIR_Name)) {
+            if (++n > MAX_SHORT_TAILS) {
+                return -1;
+            }
+            lfn_tail(entry->DIR_Name, basis, name, n);
+        }
+        parts = lfn_encode(name, entry->DIR_Name, entries);
+    }
+    entries[parts] = *entry;
+    return parts;
+}
+
+// add an entry called name to the directory; entry holds everything but the
+// name. A name that isn't a plain upper-case 8.3 name gets a unique
+// generated short name with long name entries in front of it. The short
+// name ends up in entry->DIR_Name. Returns -1 if the name can't be used or
+// the directory has no room
+int dir_add_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name, DIR *entry, long *offset) {
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+    DirIndex *index = get_index(fp, bpb, dirCluster);
+    if (index == NULL || !lfn_name_valid(name)) {
+        return -1;
+    }
+
+    DIR entries[LFN_MAX_ENTRIES + 1];
+    int parts = make_entries(index, name, entry, entries);
+    if (parts < 0) {
+        return -1;
+    }
+
+    long first = take_entries(fp, bpb, index, parts + 1);
+    if (first < 0) {
+        return -1;
+    }
+    long offsets[LFN_MAX_ENTRIES + 1];
+    for (int i = 0; i <= parts; i++) {
+        offsets[i] = entry_offset(bpb, index, first + i);
+    }
+    // long name parts go first: without their short entry they are orphans every scan skips
+    for (int i = 0; i <= parts; i++) {
+        if (journal_write(fp, offsets[i], &entries[i], sizeof(DIR)) != 0) {
+            dir_index_drop(dirCluster);  // rebuilt from disk next time
+            return -1;
+        }
+    }
+
+    index_add(index, name, entry, offsets[parts], offsets[0], first, parts + 1);
+    if (offset != NULL) {
+        *offset = offsets[parts];
+    }
+    return 0;
+}
+
+// add count entries at once. Names are checked against the index and put
+// in its free runs, growing the directory as needed; entries that land in
+// the same cluster are packed into a copy of it that is written back whole,
+// so a batch costs about one write per cluster it fills. entries[i] holds
+// everything but the name, as for dir_add_entry(), and gets the short name.
+// status[i] is set to one of the DIR_ADD_* codes; returns how many entries
+// were added
+int dir_add_entries(FILE *fp, BPB *bpb, unsigned int dirCluster, const char **names, DIR *entries, int *status, int count) {
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+    for (int i = 0; i < count; i++) {
+        status[i] = DIR_ADD_FULL;
+    }
+    DirIndex *index = get_index(fp, bpb, dirCluster);
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    DIR *buffer = (DIR *)malloc(bytesPerCluster);
+    if (index == NULL || buffer == NULL) {
+        free(buffer);
+        return 0;
+    }
+
+    int added = 0;
+    int failed = 0;
+    long base = -1;        // image offset of the cluster in buffer, -1 if none
+    int dirty = 0;
+    int unwritten = 0;     // first name whose entries may still be only in buffer
+    int i;
+    for (i = 0; i < count && !failed; i++) {
+        const char *name = names[i];
+        char *key = fold_name(name);
+        int exists = key == NULL || find_slot(index, key) != NULL;
+        free(key);
+        if (exists || !lfn_name_valid(name)) {
+            status[i] = exists ? DIR_ADD_EXISTS : DIR_ADD_INVALID;
+            continue;
+        }
+        DIR set[LFN_MAX_ENTRIES + 1];
+        int parts = make_entries(index, name, &entries[i], set);
+        long first = parts < 0 ? -1 : take_entries(fp, bpb, index, parts + 1);
+        if (first < 0) {
+            continue;  // no short name left, or the volume is full
+        }
+
+        unsigned int perCluster = index->perCluster;
+        long setBase = cluster_offset(bpb, index->chain[first / perCluster]);
+        if (setBase != base || (first + parts) / perCluster != first / perCluster) {
+            // moving on to another cluster: write back the one in the buffer
+            if (dirty && journal_write(fp, base, buffer, bytesPerCluster) != 0) {
+                failed = 1;
+                break;
+            }
+            dirty = 0;
+            unwritten = i;
+            base = image_read(fp, setBase, buffer, bytesPerCluster) == 0 ? setBase : -1;
+        }
+        if (base >= 0 && (first + parts) / perCluster == first / perCluster) {
+            memcpy(&buffer[first % perCluster], set, (parts + 1) * sizeof(DIR));
+            dirty = 1;
+        } else {
+            // a name that runs into the next cluster goes in entry by entry
+            base = -1;
+            for (int j = 0; j <= parts && !failed; j++) {
+                failed = journal_write(fp, entry_offset(bpb, index, first + j), &set[j], sizeof(DIR)) != 0;
+            }
+            if (failed) {
+                break;
+            }
+            unwritten = i + 1;
+        }
+        index_add(index, name, &entries[i], entry_offset(bpb, index, first + parts), entry_offset(bpb, index, first),
+                  first, parts + 1);
+        status[i] = DIR_ADD_OK;
+        added++;
+    }
+    if (!failed && dirty && journal_write(fp, base, buffer, bytesPerCluster) != 0) {
+        failed = 1;
+    }
+    free(buffer);
+
+    if (failed) {
+        // the index already has the names that didn't make it to disk
+        for (int j = unwritten; j < i && j < count; j++) {
+            if (status[j] == DIR_ADD_OK) {
+                status[j] = DIR_ADD_FULL;
+                added--;
+            }
+        }
+        dir_index_drop(dirCluster);
+    }
+    return added;
+}
+
+// take both keys of the entry in slot out of the index; current is its short
+// entry. The long name is recovered from disk
+static void unindex_entry(FILE *fp, BPB *bpb, DirIndex *index, const IndexSlot *slot, const DIR *current) {
+    long offset = slot->offset;
+    char longName[NAME_MAX_BYTES];
+    LfnState lfn;
+    lfn_reset(&lfn);
+    longName[0] = '\0';
+    for (long pos = slot->start; pos >= 0; pos = dir_next_offset(bpb, pos)) {
+        DIR part;
+        if (image_read(fp, pos, &part, sizeof(DIR)) != 0 || lfn_scan(&lfn, &part, pos, longName) != 0 || pos == offset) {
+            break;
+        }
+    }
+    int span = slot->span;
+    char shortName[13];
+    short_name_format(current->DIR_Name, current->DIR_NTRes, shortName);
+    remove_key(index, shortName, offset);
+    if (span > 1 && longName[0] != '\0') {
+        remove_key(index, longName, offset);
+    }
+}
+
+// mark the entry called name deleted, together with its long name entries
+int dir_remove_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *name) {
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+    DirIndex *index;
+    DIR current;
+    IndexSlot *slot = lookup_slot(fp, bpb, &index, dirCluster, name, &current);
+    if (slot == NULL) {
+        return -1;
+    }
+    long start = slot->start;
+    unsigned int firstEntry = slot->firstEntry;
+    int span = slot->span;
+    unindex_entry(fp, bpb, index, slot, &current);
+
+    unsigned char deletedMarker = 0xE5;
+    long pos = start;
+    for (int i = 0; i < span && pos >= 0; i++) {
+        if (journal_write(fp, pos, &deletedMarker, sizeof(unsigned char)) != 0) {
+            return -1;
+        }
+        pos = dir_next_offset(bpb, pos);
+    }
+    add_free(index, firstEntry, span);
+    return 0;
+}
+
+// give the entry called oldName the name newName, keeping everything else.
+// A name that fits in the old name's entries is written over them, so the
+// short entry stays where it is and open handles keep pointing at it. A
+// longer one moves the entry: the new entries are written before the old
+// ones go, so a full directory leaves the old name in place
+int dir_rename_entry(FILE *fp, BPB *bpb, unsigned int dirCluster, const char *oldName, const char *newName) {
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+    DirIndex *index;
+    DIR entry;
+    IndexSlot *slot = lookup_slot(fp, bpb, &index, dirCluster, oldName, &entry);
+    if (slot == NULL || !lfn_name_valid(newName)) {
+        return -1;
+    }
+    DIR old = entry;
+    entry.DIR_NTRes &= ~0x18;  // case flags belong to the old short name
+    DIR entries[LFN_MAX_ENTRIES + 1];
+    int parts = make_entries(index, newName, &entry, entries);
+    if (parts < 0) {
+        return -1;
+    }
+    if (parts + 1 > slot->span) {
+        if (dir_add_entry(fp, bpb, dirCluster, newName, &entry, NULL) != 0) {
+            return -1;
+        }
+        return dir_remove_entry(fp, bpb, dirCluster, oldName);
+    }
+
+    // the new entries take the end of the old run; what's left in front is freed
+    unsigned int firstEntry = slot->firstEntry;
+    unsigned int newFirst = firstEntry + slot->span - (parts + 1);
+    long offset = slot->offset;
+    unindex_entry(fp, bpb, index, slot, &old);
+    unsigned char deletedMarker = 0xE5;
+    for (unsigned int n = firstEntry; n < newFirst; n++) {
+        if (journal_write(fp, entry_offset(bpb, index, n), &deletedMarker, sizeof(unsigned char)) != 0) {
+            dir_index_drop(dirCluster);  // rebuilt from disk next time
+            return -1;
+        }
+    }
+    for (int i = 0; i <= parts; i++) {
+        if (journal_write(fp, entry_offset(bpb, index, newFirst + i), &entries[i], sizeof(DIR)) != 0) {
+            dir_index_drop(dirCluster);
+            return -1;
+        }
+    }
+    if (newFirst > firstEntry) {
+        add_free(index, firstEntry, newFirst - firstEntry);
+    }
+    index_add(index, newName, &entry, offset, entry_offset(bpb, index, newFirst), newFirst, parts + 1);
+    return 0;
+}
+
+// discard the index of a directory that was removed
+void dir_index_drop(unsigned int dirCluster) {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        if (indexes[i].cluster == dirCluster && indexes[i].slots != NULL) {
+            release(&indexes[i]);
+        }
+    }
+}
+
+void dir_index_clear(void) {
+    for (int i = 0; i < MAX_DIR_INDEXES; i++) {
+        release(&indexes[i]);
+    }
+}
@@ -0,0 +1,111 @@
+#include "extent.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include <stdlib.h>
+
+void extent_init(ExtentMap *map) {
+    map->items = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->clusters = 0;
+}
+
+// add one cluster to the end of the file, growing the last extent when the
+// cluster directly follows it
+int extent_append(ExtentMap *map, unsigned int cluster) {
+    if (map->count > 0) {
+        Extent *last = &map->items[map->count - 1];
+        if (last->start + last->length == cluster) {
+            last->length++;
+            map->clusters++;
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        unsigned int capacity = map->capacity ? map->capacity * 2 : 4;
+        Extent *items = (Extent *)realloc(map->items, capacity * sizeof(Extent));
+        if (items == NULL) {
+            return -1;
+        }
+        map->items = items;
+        map->capacity = capacity;
+    }
+
+    Extent *extent = &map->items[map->count++];
+    extent->fileCluster = map->clusters;
+    extent->start = cluster;
+    extent->length = 1;
+    map->clusters++;
+    return 0;
+}
+
+// compact the chain starting at firstCluster into extents
+int extent_build(ExtentMap *map, unsigned int firstCluster) {
+    extent_free(map);
+    for (unsigned int c = firstCluster; c >= 2 && c < FAT_EOC_MIN; c = fat_get(c)) {
+        if (extent_append(map, c) != 0) {
+            return -1;
+        }
+        // a looped chain can't be longer than the FAT
+        if (map->clusters > fat_entry_count()) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// disk cluster holding the file's fileCluster-th cluster, and how many
+// contiguous clusters (including it) follow on disk; returns 0 past the end
+int extent_lookup(const ExtentMap *map, unsigned int fileCluster, unsigned int *cluster, unsigned int *runLeft) {
+    if (fileCluster >= map->clusters) {
+        return 0;
+    }
+
+    unsigned int lo = 0;
+    unsigned int hi = map->count - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        if (map->items[mid].fileCluster <= fileCluster) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    const Extent *extent = &map->items[lo];
+    unsigned int skip = fileCluster - extent->fileCluster;
+    *cluster = extent->start + skip;
+    if (runLeft != NULL) {
+        *runLeft = extent->length - skip;
+    }
+    return 1;
+}
+
+// last cluster of the file, 0 for an empty file
+unsigned int extent_last(const ExtentMap *map) {
+    if (map->count == 0) {
+        return 0;
+    }
+    const Extent *last = &map->items[map->count - 1];
+    return last->start + last->length - 1;
+}
+
+// forget everything past the file's first clusters clusters
+void extent_truncate(ExtentMap *map, unsigned int clusters) {
+    while (map->count > 0 && map->items[map->count - 1].fileCluster >= clusters) {
+        map->count--;
+    }
+    if (map->count > 0) {
+        Extent *last = &map->items[map->count - 1];
+        if (last->fileCluster + last->length > clusters) {
+            last->length = clusters - last->fileCluster;
+        }
+    }
+    map->clusters = map->count > 0 ? clusters : 0;
+}
+
+void extent_free(ExtentMap *map) {
+    free(map->items);
+    extent_init(map);
+}
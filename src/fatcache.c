@@ -0,0 +1,262 @@
+#include "fatcache.h"
+#include "image.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// dirty runs closer than this many entries are merged into one write
+#define FAT_FLUSH_GAP 128
+// with an io_uring the FAT is loaded as this many bytes per request, all in flight together
+#define FAT_LOAD_CHUNK (1024 * 1024)
+
+static unsigned int *fatTable = NULL;    // cached FAT entries
+static unsigned char *fatDirty = NULL;   // one bit per entry
+static unsigned int fatEntries = 0;      // number of entries in the table
+static unsigned int fatDirtyCount = 0;   // entries changed since the last sync
+static long fatStart = 0;                // byte offset of the active FAT in the image
+static long fatBase = 0;                 // byte offset of FAT #1
+static long fatBytes = 0;                // size of one FAT copy
+static unsigned int fatCopies = 1;       // copies written on sync: all of them when mirroring
+static unsigned int fatActive = 0;       // copy the table was loaded from
+static int fatMapped = 0;                // fatTable points into the image mapping
+static unsigned char *fatUnlogged = NULL; // entries changed since the journal last saw them, NULL without one
+
+// load the active FAT into memory. BPB_ExtFlags bit 7 clear means every
+// copy mirrors the active one; set means only the copy numbered in bits 0-3
+// is in use and the others are left alone
+// inPlace lets a mapped image's table be used straight from the mapping
+int fat_load(FILE *fp, BPB *bpb, int inPlace) {
+    fat_unload();
+
+    fatBase = (long)bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec;
+    fatBytes = (long)bpb->BPB_FATSz32 * bpb->BPB_BytesPerSec;
+    fatActive = 0;
+    fatCopies = bpb->BPB_NumFATs > 0 ? bpb->BPB_NumFATs : 1;
+    if (bpb->BPB_ExtFlags & 0x80) {
+        unsigned int active = bpb->BPB_ExtFlags & 0x0F;
+        fatActive = active < fatCopies ? active : 0;
+        fatCopies = 1;
+    }
+    fatStart = fatBase + fatActive * fatBytes;
+    fatEntries = (bpb->BPB_FATSz32 * bpb->BPB_BytesPerSec) / 4;
+
+    // the data region may end before the FAT does
+    unsigned int dataSectors = bpb->BPB_TotSec32 - (bpb->BPB_RsvdSecCnt + bpb->BPB_NumFATs * bpb->BPB_FATSz32);
+    unsigned int lastCluster = dataSectors / bpb->BPB_SecsPerClus + 2;
+    if (lastCluster < fatEntries) {
+        fatEntries = lastCluster;
+    }
+
+    // with a mapped image the table is the active copy itself; only the mirrors need writes
+    fatDirty = (unsigned char *)calloc((fatEntries + 7) / 8, 1);
+    if (fatDirty == NULL) {
+        fat_unload();
+        return -1;
+    }
+    if (inPlace && image_is_mapped()) {
+        fatTable = (unsigned int *)image_map(fp, fatStart, (size_t)fatEntries * sizeof(unsigned int), NULL);
+        fatMapped = fatTable != NULL;
+    } else {
+        size_t tableBytes = (size_t)fatEntries * sizeof(unsigned int);
+        size_t chunkBytes = image_is_async() && tableBytes > FAT_LOAD_CHUNK ? FAT_LOAD_CHUNK : tableBytes;
+        int chunks = tableBytes > 0 ? (int)((tableBytes + chunkBytes - 1) / chunkBytes) : 1;
+        fatTable = (unsigned int *)malloc(tableBytes);
+        ImageIo *ios = (ImageIo *)malloc(chunks * sizeof(ImageIo));
+        for (int i = 0; fatTable != NULL && ios != NULL && i < chunks; i++) {
+            size_t start = (size_t)i * chunkBytes;
+            ios[i].offset = fatStart + (long)start;
+            ios[i].buf = (unsigned char *)fatTable + start;
+            ios[i].len = tableBytes - start < chunkBytes ? tableBytes - start : chunkBytes;
+        }
+        if (fatTable != NULL && (ios == NULL || image_read_batch(fp, ios, chunks) != 0)) {
+            free(fatTable);
+            fatTable = NULL;
+        }
+        free(ios);
+    }
+    if (fatTable == NULL) {
+        fat_unload();
+        return -1;
+    }
+
+    fatDirtyCount = 0;
+    return 0;
+}
+
+void fat_unload(void) {
+    if (!fatMapped) {
+        free(fatTable);
+    }
+    free(fatDirty);
+    free(fatUnlogged);
+    fatUnlogged = NULL;
+    fatMapped = 0;
+    fatTable = NULL;
+    fatDirty = NULL;
+    fatEntries = 0;
+    fatDirtyCount = 0;
+}
+
+unsigned int fat_entry_count(void) {
+    return fatEntries;
+}
+
+// next cluster in the chain; out of range clusters read as end of chain
+unsigned int fat_get(unsigned int cluster) {
+    STATS_ADD(fatReads, 1);
+    if (cluster >= fatEntries) {
+        return FAT_EOC;
+    }
+    return fatTable[cluster] & FAT_ENTRY_MASK;
+}
+
+void fat_set(unsigned int cluster, unsigned int value) {
+    // clusters 0 and 1 are reserved
+    if (cluster < 2 || cluster >= fatEntries) {
+        return;
+    }
+    STATS_ADD(fatWrites, 1);
+
+    // keep the reserved high bits of the existing entry
+    unsigned int entry = (fatTable[cluster] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+    if (entry == fatTable[cluster]) {
+        return;
+    }
+    fatTable[cluster] = entry;
+
+    if (!(fatDirty[cluster / 8] & (1 << (cluster % 8)))) {
+        fatDirty[cluster / 8] |= 1 << (cluster % 8);
+        fatDirtyCount++;
+    }
+    if (fatUnlogged != NULL) {
+        fatUnlogged[cluster / 8] |= 1 << (cluster % 8);
+    }
+}
+
+// start tracking changes for the journal, separately from the sync bitmap
+int fat_track_changes(void) {
+    if (fatUnlogged == NULL) {
+        fatUnlogged = (unsigned char *)calloc((fatEntries + 7) / 8, 1);
+    }
+    return fatUnlogged != NULL ? 0 : -1;
+}
+
+// hand every entry changed since the last call to emit, as coalesced runs
+// at their image offsets in each FAT copy that fat_sync() will write
+int fat_log_changes(int (*emit)(long offset, const void *data, size_t len)) {
+    if (fatUnlogged == NULL) {
+        return 0;
+    }
+
+    unsigned int i = 0;
+    while (i < fatEntries) {
+        if (fatUnlogged[i / 8] == 0) {
+            i = (i / 8 + 1) * 8;
+            continue;
+        }
+        if (!(fatUnlogged[i / 8] & (1 << (i % 8)))) {
+            i++;
+            continue;
+        }
+        unsigned int runStart = i;
+        while (i < fatEntries && (fatUnlogged[i / 8] & (1 << (i % 8)))) {
+            i++;
+        }
+
+        long offset = (long)runStart * 4;
+        size_t len = (i - runStart) * sizeof(unsigned int);
+        for (unsigned int copy = 0; copy < fatCopies; copy++) {
+            long start = fatCopies > 1 ? fatBase + copy * fatBytes : fatStart;
+            if (emit(start + offset, &fatTable[runStart], len) != 0) {
+                return -1;
+            }
+        }
+    }
+    memset(fatUnlogged, 0, (fatEntries + 7) / 8);
+    return 0;
+}
+
+static int is_dirty(unsigned int cluster) {
+    return fatDirty[cluster / 8] & (1 << (cluster % 8));
+}
+
+// queue the writes for a run of entries to the active FAT and every mirror
+static int queue_run(FILE *fp, ImageIo **ios, int *count, int *capacity, unsigned int runStart, unsigned int runEnd) {
+    long offset = (long)runStart * 4;
+    size_t len = (runEnd - runStart) * sizeof(unsigned int);
+    if (*count + (int)fatCopies > *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if (*capacity < *count + (int)fatCopies) {
+            *capacity = *count + (int)fatCopies;
+        }
+        ImageIo *grown = (ImageIo *)realloc(*ios, *capacity * sizeof(ImageIo));
+        if (grown == NULL) {
+            return -1;
+        }
+        *ios = grown;
+    }
+
+    // a table used from the mapping is already the active copy
+    if (fatMapped) {
+        image_commit(fp, fatStart + offset, &fatTable[runStart], len);
+    } else {
+        (*ios)[(*count)++] = (ImageIo){ fatStart + offset, &fatTable[runStart], len };
+    }
+    for (unsigned int copy = 0; fatCopies > 1 && copy < fatCopies; copy++) {
+        if (copy != fatActive) {
+            (*ios)[(*count)++] = (ImageIo){ fatBase + copy * fatBytes + offset, &fatTable[runStart], len };
+        }
+    }
+    return 0;
+}
+
+// write dirty entries back in ascending order, one write per coalesced run
+// and FAT copy, all submitted as a single batch
+int fat_sync(FILE *fp) {
+    if (fatTable == NULL || fatDirtyCount == 0) {
+        return 0;
+    }
+
+    ImageIo *ios = NULL;
+    int count = 0;
+    int capacity = 0;
+    unsigned int i = 0;
+    while (i < fatEntries) {
+        // skip whole clean bytes of the bitmap quickly
+        if (fatDirty[i / 8] == 0) {
+            i = (i / 8 + 1) * 8;
+            continue;
+        }
+        if (!is_dirty(i)) {
+            i++;
+            continue;
+        }
+
+        // extend the run until we see a gap of clean entries wider than FAT_FLUSH_GAP
+        unsigned int runStart = i;
+        unsigned int runEnd = i + 1;
+        unsigned int j = runEnd;
+        while (j < fatEntries && j - runEnd <= FAT_FLUSH_GAP) {
+            if (is_dirty(j)) {
+                runEnd = j + 1;
+            }
+            j++;
+        }
+
+        if (queue_run(fp, &ios, &count, &capacity, runStart, runEnd) != 0) {
+            free(ios);
+            return -1;
+        }
+        i = runEnd;
+    }
+    int result = image_write_batch(fp, ios, count);
+    free(ios);
+    if (result != 0) {
+        return -1;
+    }
+
+    memset(fatDirty, 0, (fatEntries + 7) / 8);
+    fatDirtyCount = 0;
+    return image_sync(fp);
+}
@@ -0,0 +1,479 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fsck.h"
+#include "fatcache.h"
+#include "alloc.h"
+#include "image.h"
+#include "journal.h"
+#include "dir.h"
+#include "walk.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FSCK_MAX_THREADS 16
+#define FSCK_MAX_REPORTED 20   // lines printed per kind of problem
+#define FSCK_REPAIR_PASSES 4
+#define FSCK_ENTRY_BATCH 64    // entries a thread claims at a time
+
+enum {
+    ISSUE_BAD_FIRST,   // directory entry's first cluster is out of range
+    ISSUE_BAD_NEXT,    // chain entry points at a free, reserved or out of range cluster
+    ISSUE_LOOP,        // chain runs back into itself
+    ISSUE_CROSS,       // chain shares a cluster with another entry's chain
+    ISSUE_SIZE,        // file is larger than its chain
+    ISSUE_LOST,        // allocated cluster no chain references
+    ISSUE_KINDS
+};
+
+typedef struct Issue {
+    int kind;
+    size_t entry;          // walk entry the problem belongs to
+    unsigned int cluster;  // cluster holding the bad value, shared or lost
+    unsigned int value;    // bad FAT value, or the owning entry for ISSUE_CROSS
+    unsigned int prev;     // cluster before 'cluster' in the chain, 0 if first
+} Issue;
+
+typedef struct IssueList {
+    Issue *items;
+    size_t count, capacity;
+    int failed;            // an issue was dropped for lack of memory
+} IssueList;
+
+typedef struct Check {
+    BPB *bpb;
+    WalkResult *tree;
+    unsigned int clusterCount;     // FAT entries, including 0 and 1
+    unsigned short *refs;          // chains referencing each cluster (saturating)
+    unsigned int *owner;           // lowest entry index referencing each cluster, +1
+    unsigned int *chainLen;        // clusters in each entry's chain
+    size_t nextEntry;              // next batch of entries to claim
+    int threads;
+    int phase;
+    IssueList lists[FSCK_MAX_THREADS];
+} Check;
+
+typedef struct CheckWorker {
+    Check *check;
+    int id;
+} CheckWorker;
+
+static void issue_add(IssueList *list, int kind, size_t entry, unsigned int cluster, unsigned int value, unsigned int prev) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 32;
+        Issue *items = (Issue *)realloc(list->items, capacity * sizeof(Issue));
+        if (items == NULL) {
+            list->failed = 1;
+            return;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    Issue issue = { kind, entry, cluster, value, prev };
+    list->items[list->count++] = issue;
+}
+
+// the chain starting at a walk entry; the start directory has no entry of its own
+static unsigned int first_cluster(Check *check, size_t e) {
+    return check->tree->items[e].firstCluster;
+}
+
+static int valid_cluster(Check *check, unsigned int cluster) {
+    return cluster >= 2 && cluster < check->clusterCount;
+}
+
+// phase 0: count references and note bad links and loops along one chain
+static void count_chain(Check *check, IssueList *issues, size_t e) {
+    unsigned int cluster = first_cluster(check, e);
+    unsigned int prev = 0;
+    unsigned int length = 0;
+    unsigned int limit = check->clusterCount;
+
+    if (cluster == 0) {
+        check->chainLen[e] = 0;
+        return;
+    }
+    if (!valid_cluster(check, cluster)) {
+        issue_add(issues, ISSUE_BAD_FIRST, e, 0, cluster, 0);
+        check->chainLen[e] = 0;
+        return;
+    }
+    while (1) {
+        unsigned short refs = __atomic_load_n(&check->refs[cluster], __ATOMIC_RELAXED);
+        while (refs < 0xFFFF && !__atomic_compare_exchange_n(&check->refs[cluster], &refs, refs + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        unsigned int mine = (unsigned int)e + 1;
+        unsigned int owner = __atomic_load_n(&check->owner[cluster], __ATOMIC_RELAXED);
+        while ((owner == 0 || mine < owner) &&
+               !__atomic_compare_exchange_n(&check->owner[cluster], &owner, mine, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+
+        if (++length > limit) {
+            issue_add(issues, ISSUE_LOOP, e, cluster, 0, prev);
+            break;
+        }
+        unsigned int next = fat_get(cluster);
+        if (next >= FAT_EOC_MIN) {
+            break;
+        }
+        if (!valid_cluster(check, next) || fat_get(next) == FAT_FREE) {
+            issue_add(issues, ISSUE_BAD_NEXT, e, cluster, next, prev);
+            break;
+        }
+        prev = cluster;
+        cluster = next;
+    }
+    check->chainLen[e] = length;
+}
+
+// phase 1: with the counts known, find where a chain first runs into a
+// cluster that belongs to an earlier entry
+static void find_cross_link(Check *check, IssueList *issues, size_t e) {
+    unsigned int cluster = first_cluster(check, e);
+    unsigned int prev = 0;
+    unsigned int mine = (unsigned int)e + 1;
+
+    for (unsigned int n = 0; n < check->chainLen[e] && valid_cluster(check, cluster); n++) {
+        if (check->refs[cluster] > 1 && check->owner[cluster] != mine) {
+            issue_add(issues, ISSUE_CROSS, e, cluster, check->owner[cluster] - 1, prev);
+            return;
+        }
+        prev = cluster;
+        cluster = fat_get(cluster);
+    }
+}
+
+static void *check_worker(void *arg) {
+    CheckWorker *worker = (CheckWorker *)arg;
+    Check *check = worker->check;
+    IssueList *issues = &check->lists[worker->id];
+
+    if (check->phase < 2) {
+        // chains vary wildly in length, so entries are handed out in small batches
+        size_t total = check->tree->count;
+        while (1) {
+            size_t start = __atomic_fetch_add(&check->nextEntry, FSCK_ENTRY_BATCH, __ATOMIC_RELAXED);
+            if (start >= total) {
+                break;
+            }
+            size_t end = start + FSCK_ENTRY_BATCH < total ? start + FSCK_ENTRY_BATCH : total;
+            for (size_t e = start; e < end; e++) {
+                if (check->phase == 0) {
+                    count_chain(check, issues, e);
+                } else {
+                    find_cross_link(check, issues, e);
+                }
+            }
+        }
+        stats_flush();
+        return NULL;
+    }
+
+    // phase 2: each thread scans its own range of the FAT for lost clusters
+    unsigned int span = (check->clusterCount - 2 + check->threads - 1) / check->threads;
+    unsigned int start = 2 + worker->id * span;
+    unsigned int end = start + span < check->clusterCount ? start + span : check->clusterCount;
+    for (unsigned int cluster = start; cluster < end; cluster++) {
+        unsigned int value = fat_get(cluster);
+        if (value != FAT_FREE && value != FAT_BAD && check->refs[cluster] == 0) {
+            issue_add(issues, ISSUE_LOST, 0, cluster, value, 0);
+        }
+    }
+    stats_flush();
+    return NULL;
+}
+
+static void run_phase(Check *check, int phase) {
+    pthread_t ids[FSCK_MAX_THREADS];
+    CheckWorker workers[FSCK_MAX_THREADS];
+    check->phase = phase;
+    check->nextEntry = 0;
+
+    int started = 0;
+    for (int i = 0; i < check->threads; i++) {
+        workers[i].check = check;
+        workers[i].id = i;
+    }
+    for (int i = 1; i < check->threads; i++) {
+        if (pthread_create(&ids[i], NULL, check_worker, &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    check_worker(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    // a thread that failed to start leaves its FAT range unscanned
+    for (int i = started + 1; phase == 2 && i < check->threads; i++) {
+        check_worker(&workers[i]);
+    }
+}
+
+static int compare_issues(const void *a, const void *b) {
+    const Issue *x = (const Issue *)a;
+    const Issue *y = (const Issue *)b;
+    if (x->kind != y->kind) {
+        return x->kind - y->kind;
+    }
+    if (x->entry != y->entry) {
+        return x->entry < y->entry ? -1 : 1;
+    }
+    return x->cluster < y->cluster ? -1 : x->cluster > y->cluster;
+}
+
+// rewrite the first cluster and size of the directory entry at entryPos
+static void set_entry_chain(FILE *fp, long entryPos, unsigned int firstCluster, unsigned int fileSize) {
+    DIR dirEntry;
+    if (entryPos < 0 || image_read(fp, entryPos, &dirEntry, sizeof(DIR)) != 0) {
+        return;
+    }
+    dirEntry.DIR_FstClusLO = firstCluster & 0xFFFF;
+    dirEntry.DIR_FstClusHI = firstCluster >> 16;
+    if (!(dirEntry.DIR_Attr & 0x10)) {
+        dirEntry.DIR_FileSize = fileSize;
+    }
+    journal_write(fp, entryPos, &dirEntry, sizeof(DIR));
+}
+
+// delete a directory's entry from its parent. Used for directories whose
+// chain can't be kept: an entry with cluster 0 would stand for the root.
+// Long name entries in front of it are left as orphans, which scans skip
+static void remove_entry(FILE *fp, long entryPos) {
+    unsigned char deletedMarker = 0xE5;
+    if (entryPos >= 0) {
+        journal_write(fp, entryPos, &deletedMarker, sizeof(unsigned char));
+    }
+}
+
+// cut a looping chain at the link that returns to a cluster already seen
+static void break_loop(Check *check, unsigned int first) {
+    unsigned char *seen = (unsigned char *)calloc((check->clusterCount + 7) / 8, 1);
+    for (unsigned int cluster = first; valid_cluster(check, cluster); ) {
+        seen[cluster / 8] |= 1 << (cluster % 8);
+        unsigned int next = fat_get(cluster);
+        if (valid_cluster(check, next) && (seen[next / 8] & (1 << (next % 8)))) {
+            fat_set(cluster, FAT_EOC);
+            break;
+        }
+        cluster = next;
+    }
+    free(seen);
+}
+
+static void print_issue(FILE *out, Check *check, Issue *issue) {
+    WalkEntry *entries = check->tree->items;
+    const char *path = entries[issue->entry].path;
+    switch (issue->kind) {
+    case ISSUE_BAD_FIRST:
+        fprintf(out, "Bad first cluster %u in the entry for '%s'.\n", issue->value, path);
+        break;
+    case ISSUE_BAD_NEXT:
+        fprintf(out, "Bad chain entry in cluster %u of '%s': 0x%08X.\n", issue->cluster, path, issue->value);
+        break;
+    case ISSUE_LOOP:
+        fprintf(out, "Cluster chain of '%s' loops back on itself.\n", path);
+        break;
+    case ISSUE_CROSS:
+        fprintf(out, "'%s' is cross-linked with '%s' at cluster %u.\n", path, entries[issue->value].path, issue->cluster);
+        break;
+    case ISSUE_SIZE:
+        fprintf(out, "'%s' is %u bytes but its chain holds only %u cluster(s).\n", path,
+                entries[issue->entry].fileSize, check->chainLen[issue->entry]);
+        break;
+    }
+}
+
+// one full check; fixes what it finds when repair is set. Chain fixes
+// change reference counts, so size and lost-cluster fixes wait for a pass
+// with no chain problems. A walk that left directories out would make their
+// clusters look lost, so then nothing is fixed and *truncated is set.
+// Returns the number of problems found
+static int check_once(FILE *fp, BPB *bpb, int threads, int repair, int report, FILE *out, int *truncated) {
+    WalkResult tree;
+    if (walk_tree(fp, bpb, "/", bpb->BPB_RootClus, threads, &tree) != 0) {
+        fprintf(out, "Error: Failed to walk the directory tree.\n");
+        return -1;
+    }
+
+    Check check;
+    memset(&check, 0, sizeof(Check));
+    check.bpb = bpb;
+    check.tree = &tree;
+    check.threads = threads;
+    check.clusterCount = fat_entry_count();
+    check.refs = (unsigned short *)calloc(check.clusterCount, sizeof(unsigned short));
+    check.owner = (unsigned int *)calloc(check.clusterCount, sizeof(unsigned int));
+    check.chainLen = (unsigned int *)calloc(tree.count, sizeof(unsigned int));
+    if (check.refs == NULL || check.owner == NULL || check.chainLen == NULL) {
+        fprintf(out, "Error: Out of memory.\n");
+        free(check.refs);
+        free(check.owner);
+        free(check.chainLen);
+        walk_free(&tree);
+        return -1;
+    }
+
+    run_phase(&check, 0);
+    run_phase(&check, 1);
+    run_phase(&check, 2);
+
+    // files longer than their chain; a longer chain is space reserved by fallocate
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    for (size_t e = 1; e < tree.count; e++) {
+        WalkEntry *entry = &tree.items[e];
+        if (!(entry->attr & 0x10) && entry->fileSize > (unsigned long long)check.chainLen[e] * bytesPerCluster) {
+            issue_add(&check.lists[0], ISSUE_SIZE, e, 0, 0, 0);
+        }
+    }
+
+    // merge per-thread findings into one deterministic list
+    IssueList all = { NULL, 0, 0, 0 };
+    for (int i = 0; i < threads; i++) {
+        for (size_t j = 0; j < check.lists[i].count; j++) {
+            Issue *issue = &check.lists[i].items[j];
+            issue_add(&all, issue->kind, issue->entry, issue->cluster, issue->value, issue->prev);
+        }
+        all.failed |= check.lists[i].failed;
+        free(check.lists[i].items);
+    }
+    if (all.failed) {
+        fprintf(out, "Error: Out of memory.\n");
+        free(all.items);
+        free(check.refs);
+        free(check.owner);
+        free(check.chainLen);
+        walk_free(&tree);
+        return -1;
+    }
+    qsort(all.items, all.count, sizeof(Issue), compare_issues);
+
+    size_t counts[ISSUE_KINDS] = {0};
+    for (size_t i = 0; i < all.count; i++) {
+        counts[all.items[i].kind]++;
+    }
+    if (report) {
+        size_t printed[ISSUE_KINDS] = {0};
+        for (size_t i = 0; i < all.count; i++) {
+            Issue *issue = &all.items[i];
+            if (issue->kind != ISSUE_LOST && printed[issue->kind]++ < FSCK_MAX_REPORTED) {
+                print_issue(out, &check, issue);
+            }
+        }
+        for (int kind = 0; kind < ISSUE_KINDS; kind++) {
+            if (kind != ISSUE_LOST && counts[kind] > FSCK_MAX_REPORTED) {
+                fprintf(out, "... and %zu more like that.\n", counts[kind] - FSCK_MAX_REPORTED);
+            }
+        }
+        if (counts[ISSUE_LOST] > 0) {
+            fprintf(out, "%zu allocated clusters are not in any chain.\n", counts[ISSUE_LOST]);
+        }
+        unsigned int files = 0;
+        for (size_t e = 0; e < tree.count; e++) {
+            files += !(tree.items[e].attr & 0x10);
+        }
+        fprintf(out, "Checked %zu directories and %u files.\n", tree.count - files, files);
+        if (tree.truncated) {
+            fprintf(out, "Some directories are nested too deeply or can't be read and were not checked;\n"
+                    "clusters below them are counted as lost.\n");
+        }
+    }
+    *truncated = tree.truncated;
+    if (tree.truncated) {
+        repair = 0;
+    }
+
+    if (repair) {
+        int chainFixes = counts[ISSUE_BAD_FIRST] + counts[ISSUE_BAD_NEXT] + counts[ISSUE_LOOP] + counts[ISSUE_CROSS];
+        for (size_t i = 0; i < all.count; i++) {
+            Issue *issue = &all.items[i];
+            WalkEntry *entry = &tree.items[issue->entry];
+            switch (issue->kind) {
+            case ISSUE_BAD_FIRST:
+                if (entry->attr & 0x10) {
+                    remove_entry(fp, entry->entryPos);
+                } else {
+                    set_entry_chain(fp, entry->entryPos, 0, 0);
+                }
+                break;
+            case ISSUE_BAD_NEXT:
+                fat_set(issue->cluster, FAT_EOC);
+                break;
+            case ISSUE_LOOP:
+                break_loop(&check, entry->firstCluster);
+                break;
+            case ISSUE_CROSS:
+                // the earlier entry keeps the shared clusters. Below a
+                // cross-linked directory the same entries turn up twice;
+                // the copy of an entry is left alone
+                if (tree.items[issue->value].entryPos == entry->entryPos) {
+                    break;
+                }
+                if (issue->prev != 0) {
+                    fat_set(issue->prev, FAT_EOC);
+                } else if (entry->attr & 0x10) {
+                    remove_entry(fp, entry->entryPos);
+                } else {
+                    set_entry_chain(fp, entry->entryPos, 0, 0);
+                }
+                break;
+            case ISSUE_SIZE:
+                if (chainFixes == 0) {
+                    set_entry_chain(fp, entry->entryPos, entry->firstCluster, check.chainLen[issue->entry] * bytesPerCluster);
+                }
+                break;
+            case ISSUE_LOST:
+                if (chainFixes == 0) {
+                    alloc_free(issue->cluster);
+                }
+                break;
+            }
+        }
+    }
+
+    free(all.items);
+    free(check.refs);
+    free(check.owner);
+    free(check.chainLen);
+    walk_free(&tree);
+    return (int)all.count;
+}
+
+int fsck_run(FILE *fp, BPB *bpb, int threads, int repair, FILE *out) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+
+    int truncated = 0;
+    int problems = check_once(fp, bpb, threads, repair, 1, out, &truncated);
+    if (problems <= 0) {
+        if (problems == 0) {
+            fprintf(out, "No problems found.\n");
+        }
+        return problems;
+    }
+    if (!repair) {
+        fprintf(out, "%d problems found. Run 'fsck --repair' to fix them.\n", problems);
+        return problems;
+    }
+    if (truncated) {
+        fprintf(out, "%d problems found. Nothing was repaired.\n", problems);
+        return problems;
+    }
+
+    // later passes pick up what the chain fixes exposed
+    int remaining = problems;
+    for (int pass = 1; pass < FSCK_REPAIR_PASSES && remaining > 0; pass++) {
+        remaining = check_once(fp, bpb, threads, 1, 0, out, &truncated);
+    }
+    if (remaining > 0) {
+        remaining = check_once(fp, bpb, threads, 0, 0, out, &truncated);
+    }
+    fprintf(out, "%d problems found, %d remain after repair.\n", problems, remaining < 0 ? 0 : remaining);
+    return problems;
+}
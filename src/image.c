@@ -0,0 +1,491 @@
+#define _GNU_SOURCE  // copy_file_range()
+
+#include "image.h"
+#include "stats.h"
+#include "uring.h"
+#include "bufcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>  // posix_fadvise()
+#include <pthread.h>
+
+#define COPY_CHUNK (1024 * 1024)  // bounce buffer size for image_copy_out()/image_copy_in() without a mapping
+
+static unsigned char *mapBase = NULL;  // start of the mapping, NULL in stdio mode
+static size_t mapSize = 0;
+static unsigned char *ioPool = NULL;   // buffer registered with the ring, NULL if none
+static size_t ioPoolSize = 0;
+static int ioPoolBusy = 0;
+// serializes the stdio position, buffer cache, ring and pool between
+// --serve sessions; the mapped paths don't need it
+static pthread_mutex_t ioLock = PTHREAD_MUTEX_INITIALIZER;
+
+// map the whole image behind fp when useMmap is set; stdio stays the fallback
+int image_open(FILE *fp, int useMmap) {
+    image_close();
+    if (!useMmap) {
+        return 0;
+    }
+
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return -1;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    mapBase = (unsigned char *)base;
+    mapSize = (size_t)st.st_size;
+    return 0;
+}
+
+void image_close(void) {
+    if (mapBase != NULL) {
+        msync(mapBase, mapSize, MS_SYNC);
+        munmap(mapBase, mapSize);
+    }
+    mapBase = NULL;
+    mapSize = 0;
+    bcache_shutdown();
+    uring_close();
+    free(ioPool);
+    ioPool = NULL;
+    ioPoolSize = 0;
+    ioPoolBusy = 0;
+}
+
+int image_is_mapped(void) {
+    return mapBase != NULL;
+}
+
+static int in_map(long offset, size_t len) {
+    return offset >= 0 && (size_t)offset <= mapSize && len <= mapSize - (size_t)offset;
+}
+
+int image_read(FILE *fp, long offset, void *buf, size_t len) {
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return -1;
+        }
+        memcpy(buf, mapBase + offset, len);
+        STATS_ADD(reads, 1);
+        STATS_ADD(bytesRead, len);
+        return 0;
+    }
+
+    STATS_ADD(reads, 1);
+    STATS_ADD(bytesRead, len);
+    int result;
+    pthread_mutex_lock(&ioLock);
+    if (bcache_covers(offset, len)) {
+        result = bcache_read(offset, buf, len);
+    } else {
+        STATS_ADD(seeks, 1);
+        fseek(fp, offset, SEEK_SET);
+        result = fread(buf, 1, len, fp) == len ? 0 : -1;
+    }
+    pthread_mutex_unlock(&ioLock);
+    return result;
+}
+
+int image_write(FILE *fp, long offset, const void *buf, size_t len) {
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return -1;
+        }
+        memmove(mapBase + offset, buf, len);
+        STATS_ADD(writes, 1);
+        STATS_ADD(bytesWritten, len);
+        return 0;
+    }
+
+    STATS_ADD(writes, 1);
+    STATS_ADD(bytesWritten, len);
+    int result;
+    pthread_mutex_lock(&ioLock);
+    if (bcache_covers(offset, len)) {
+        result = bcache_write(offset, buf, len);
+    } else {
+        STATS_ADD(seeks, 1);
+        fseek(fp, offset, SEEK_SET);
+        result = fwrite(buf, 1, len, fp) == len ? 0 : -1;
+    }
+    pthread_mutex_unlock(&ioLock);
+    return result;
+}
+
+// pointer to len bytes at offset: into the mapping when mapped, otherwise
+// buf filled from the image. With buf NULL on the stdio backend a whole
+// cluster comes back pinned in the buffer cache; hand it to image_unmap()
+// when done. Returns NULL if the range can't be read.
+void *image_map(FILE *fp, long offset, size_t len, void *buf) {
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return NULL;
+        }
+        STATS_ADD(reads, 1);
+        STATS_ADD(bytesRead, len);
+        return mapBase + offset;
+    }
+    if (buf == NULL) {
+        STATS_ADD(reads, 1);
+        STATS_ADD(bytesRead, len);
+        pthread_mutex_lock(&ioLock);
+        void *data = bcache_pin(offset, len);
+        pthread_mutex_unlock(&ioLock);
+        return data;
+    }
+    return image_read(fp, offset, buf, len) == 0 ? buf : NULL;
+}
+
+// release a region obtained from image_map() without a buffer
+void image_unmap(const void *data) {
+    if (data != NULL && mapBase == NULL) {
+        pthread_mutex_lock(&ioLock);
+        bcache_unpin(data);
+        pthread_mutex_unlock(&ioLock);
+    }
+}
+
+// whether image_map() without a buffer can hand out whole clusters
+int image_can_map(void) {
+    return mapBase != NULL || bcache_enabled();
+}
+
+// read exactly len bytes at offset from fd; a short file is an error
+static int pread_all(int fd, unsigned char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// image_map() for worker threads: pread on the image's descriptor instead of
+// stdio, so no FILE position is shared. Flush the FILE before starting them
+void *image_map_pread(FILE *fp, long offset, size_t len, void *buf) {
+    STATS_ADD(reads, 1);
+    STATS_ADD(bytesRead, len);
+    if (mapBase != NULL) {
+        return in_map(offset, len) ? mapBase + offset : NULL;
+    }
+    return pread_all(fileno(fp), (unsigned char *)buf, len, offset) == 0 ? buf : NULL;
+}
+
+// write back a region obtained from image_map(); a no-op when the caller
+// already modified the mapping in place
+int image_commit(FILE *fp, long offset, const void *data, size_t len) {
+    int inPlace = mapBase != NULL && data == mapBase + offset;
+    if (mapBase == NULL) {
+        pthread_mutex_lock(&ioLock);
+        inPlace = bcache_mark_dirty(offset, data, len);
+        pthread_mutex_unlock(&ioLock);
+    }
+    if (inPlace) {
+        STATS_ADD(writes, 1);
+        STATS_ADD(bytesWritten, len);
+        return 0;
+    }
+    return image_write(fp, offset, data, len);
+}
+
+// write all of buf to fd, retrying short writes
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// copy len bytes at offset to a host descriptor unchanged: straight from the
+// mapping, or with pread into a large bounce buffer on the stdio backend
+int image_copy_out(FILE *fp, long offset, size_t len, int outFd) {
+    STATS_ADD(reads, 1);
+    STATS_ADD(bytesRead, len);
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return -1;
+        }
+        return write_all(outFd, mapBase + offset, len);
+    }
+
+    // pread bypasses stdio and the cache, so push out anything still sitting in them
+    pthread_mutex_lock(&ioLock);
+    int flushed = bcache_writeback_range(offset, len) == 0 && fflush(fp) == 0;
+    pthread_mutex_unlock(&ioLock);
+    if (!flushed) {
+        return -1;
+    }
+    size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+    unsigned char *buf = (unsigned char *)malloc(chunk);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int fd = fileno(fp);
+    int result = 0;
+    while (len > 0 && result == 0) {
+        size_t want = len < chunk ? len : chunk;
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = -1;
+            break;
+        }
+        result = write_all(outFd, buf, (size_t)n);
+        offset += n;
+        len -= (size_t)n;
+    }
+    free(buf);
+    return result;
+}
+
+// copy_file_range() from inFd into the image descriptor, or pread/pwrite
+// through a bounce buffer where the kernel can't copy between them
+static int copy_range_in(FILE *fp, long offset, size_t len, int inFd, long inOffset) {
+    int fd = fileno(fp);
+    off_t in = inOffset;
+    off_t out = offset;
+    while (len > 0) {
+        ssize_t n = copy_file_range(inFd, &in, fd, &out, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= (size_t)n;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+    unsigned char *buf = (unsigned char *)malloc(chunk);
+    if (buf == NULL) {
+        return -1;
+    }
+    int result = 0;
+    while (len > 0 && result == 0) {
+        size_t want = len < chunk ? len : chunk;
+        result = pread_all(inFd, buf, want, in);
+        for (size_t done = 0; result == 0 && done < want; ) {
+            ssize_t n = pwrite(fd, buf + done, want - done, out + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                result = -1;
+            } else {
+                done += (size_t)n;
+            }
+        }
+        in += want;
+        out += want;
+        len -= want;
+    }
+    free(buf);
+    return result;
+}
+
+// copy len bytes from a host descriptor at inOffset into the image at offset:
+// pread straight into the mapping, or copy_file_range() between the two
+// descriptors on the stdio backend, falling back to pread/pwrite through a
+// bounce buffer where the kernel can't copy between them
+int image_copy_in(FILE *fp, long offset, size_t len, int inFd, long inOffset) {
+    STATS_ADD(writes, 1);
+    STATS_ADD(bytesWritten, len);
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return -1;
+        }
+        return pread_all(inFd, mapBase + offset, len, inOffset);
+    }
+
+    // the descriptor is written behind stdio's back; cached copies of the
+    // range are written back now and dropped once the copy is done
+    pthread_mutex_lock(&ioLock);
+    int result = -1;
+    if (bcache_writeback_range(offset, len) == 0 && fflush(fp) == 0) {
+        result = copy_range_in(fp, offset, len, inFd, inOffset);
+        if (bcache_discard_range(offset, len) != 0) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&ioLock);
+    return result;
+}
+
+// hint that len bytes at offset will be read soon, so the kernel can start
+// fetching them; a mapped image gets the same hint for its pages
+void image_advise(FILE *fp, long offset, size_t len) {
+    if (mapBase != NULL) {
+        if (!in_map(offset, len)) {
+            return;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        long start = offset - offset % page;
+        madvise(mapBase + start, len + (size_t)(offset - start), MADV_WILLNEED);
+        return;
+    }
+    posix_fadvise(fileno(fp), offset, (off_t)len, POSIX_FADV_WILLNEED);
+}
+
+int image_sync(FILE *fp) {
+    STATS_ADD(syncs, 1);
+    if (mapBase != NULL) {
+        return msync(mapBase, mapSize, MS_SYNC);
+    }
+    return image_flush(fp);
+}
+
+// put everything buffered in this process on the image's descriptor, for
+// code that is about to read it directly
+int image_flush(FILE *fp) {
+    pthread_mutex_lock(&ioLock);
+    int result = bcache_flush();
+    if (fflush(fp) != 0) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&ioLock);
+    return result;
+}
+
+// keep up to bytes of data-region clusters in the buffer cache; dataStart
+// is the offset of cluster 2 and clusters the first cluster number past the
+// region. Only the stdio backend uses it, since a mapping is memory already
+int image_use_cache(FILE *fp, long dataStart, unsigned int clusterBytes, unsigned int clusters, size_t bytes) {
+    if (mapBase != NULL || clusterBytes == 0) {
+        return 0;
+    }
+    return bcache_init(fp, dataStart, clusterBytes, clusters, (unsigned int)(bytes / clusterBytes));
+}
+
+// send batches through an io_uring of the given depth; with fixedBytes > 0 a
+// buffer that size is registered and handed out by image_io_buffer(). Call
+// after image_open(). Returns -1 if the ring can't be set up, in which case
+// batches keep going through stdio
+int image_use_uring(unsigned int depth, size_t fixedBytes) {
+    if (uring_open(depth) != 0) {
+        return -1;
+    }
+    if (fixedBytes > 0) {
+        ioPool = (unsigned char *)malloc(fixedBytes);
+        if (ioPool != NULL && uring_register_buffer(ioPool, fixedBytes) == 0) {
+            ioPoolSize = fixedBytes;
+        } else {
+            free(ioPool);  // plain buffers still work, just without the pinning
+            ioPool = NULL;
+        }
+    }
+    return 0;
+}
+
+// batches go to the ring rather than one request at a time
+int image_is_async(void) {
+    return mapBase == NULL && uring_ready();
+}
+
+static int run_batch(FILE *fp, const ImageIo *ios, int count, int writing) {
+    for (int i = 0; i < count; i++) {
+        if (writing) {
+            STATS_ADD(writes, 1);
+            STATS_ADD(bytesWritten, ios[i].len);
+        } else {
+            STATS_ADD(reads, 1);
+            STATS_ADD(bytesRead, ios[i].len);
+        }
+    }
+    // the ring works on the descriptor: push out stdio's pending writes and
+    // drop its read buffer, which a write here would leave stale, and keep
+    // the buffer cache in step on either side
+    pthread_mutex_lock(&ioLock);
+    int result = 0;
+    for (int i = 0; !writing && i < count && result == 0; i++) {
+        result = bcache_writeback_range(ios[i].offset, ios[i].len);
+    }
+    if (result == 0) {
+        fflush(fp);
+        result = uring_transfer(fileno(fp), ios, count, writing);
+    }
+    for (int i = 0; writing && result == 0 && i < count; i++) {
+        bcache_update_range(ios[i].offset, ios[i].buf, ios[i].len);
+    }
+    pthread_mutex_unlock(&ioLock);
+    return result;
+}
+
+// read every request of a batch; -1 if any of them fails
+int image_read_batch(FILE *fp, const ImageIo *ios, int count) {
+    if (image_is_async()) {
+        return run_batch(fp, ios, count, 0);
+    }
+    for (int i = 0; i < count; i++) {
+        if (image_read(fp, ios[i].offset, ios[i].buf, ios[i].len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int image_write_batch(FILE *fp, const ImageIo *ios, int count) {
+    if (image_is_async()) {
+        return run_batch(fp, ios, count, 1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (image_write(fp, ios[i].offset, ios[i].buf, ios[i].len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// buffer for batched I/O: the registered one when it's free and big enough
+void *image_io_buffer(size_t len) {
+    pthread_mutex_lock(&ioLock);
+    int pooled = ioPool != NULL && !ioPoolBusy && len <= ioPoolSize;
+    if (pooled) {
+        ioPoolBusy = 1;
+    }
+    pthread_mutex_unlock(&ioLock);
+    return pooled ? ioPool : malloc(len);
+}
+
+void image_io_buffer_free(void *buf) {
+    if (buf != NULL && buf == ioPool) {
+        pthread_mutex_lock(&ioLock);
+        ioPoolBusy = 0;
+        pthread_mutex_unlock(&ioLock);
+    } else {
+        free(buf);
+    }
+}
@@ -0,0 +1,297 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "journal.h"
+#include "fatcache.h"
+#include "alloc.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define JOURNAL_MAGIC 0x4C41574A           // "JWAL"
+#define JOURNAL_WRITE  1                   // redo image bytes at offset
+#define JOURNAL_COMMIT 2                   // end of one command's records
+#define JOURNAL_UNDO   3                   // bytes at offset before an in-place write
+#define JOURNAL_CHECKPOINT_BYTES (4 * 1024 * 1024)  // log size that forces a checkpoint
+
+typedef struct __attribute__((packed)) JournalRecord {
+    unsigned int magic;
+    unsigned int type;
+    unsigned long long offset;   // image offset the data belongs at
+    unsigned int length;         // bytes of data following the header
+    unsigned int checksum;       // FNV-1a of the header (this field zeroed) and data
+} JournalRecord;
+
+static int walFd = -1;
+static unsigned char *pending = NULL;   // records not yet handed to the kernel
+static size_t pendingLen = 0, pendingCap = 0;
+static long walSize = 0;                // bytes in the log since the last checkpoint
+static unsigned int groupOps = 1;       // commands per fsync
+static unsigned int groupMs = 0;        // or this much time since the group's first command
+static unsigned int groupCount = 0;     // commands committed but not yet fsync'ed
+static struct timespec groupStart;
+static long crashAfter = -1;            // test hook: crash points left before exiting, -1 = off
+
+static unsigned int fnv1a(unsigned int hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned int record_checksum(JournalRecord *record, const void *data) {
+    JournalRecord header = *record;
+    header.checksum = 0;
+    return fnv1a(fnv1a(2166136261u, &header, sizeof(header)), data, record->length);
+}
+
+static int append_record(unsigned int type, long offset, const void *data, size_t len) {
+    if (pendingLen + sizeof(JournalRecord) + len > pendingCap) {
+        size_t cap = pendingCap ? pendingCap : 4096;
+        while (cap < pendingLen + sizeof(JournalRecord) + len) {
+            cap *= 2;
+        }
+        unsigned char *grown = (unsigned char *)realloc(pending, cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        pending = grown;
+        pendingCap = cap;
+    }
+
+    JournalRecord record = { JOURNAL_MAGIC, type, (unsigned long long)offset, (unsigned int)len, 0 };
+    record.checksum = record_checksum(&record, data);
+    memcpy(pending + pendingLen, &record, sizeof(record));
+    memcpy(pending + pendingLen + sizeof(record), data, len);
+    pendingLen += sizeof(record) + len;
+    return 0;
+}
+
+static int append_write(long offset, const void *data, size_t len) {
+    return append_record(JOURNAL_WRITE, offset, data, len);
+}
+
+// hand buffered records to the kernel; after this they survive a crash of
+// this process, and after the group's fsync a crash of the machine
+static int flush_pending(void) {
+    size_t done = 0;
+    while (done < pendingLen) {
+        ssize_t n = write(walFd, pending + done, pendingLen - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    walSize += (long)pendingLen;
+    pendingLen = 0;
+    return 0;
+}
+
+static long elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// fdatasync the log once the open commit group is full or older than
+// groupMs; force syncs whatever is there
+static int sync_group(int force) {
+    if (groupCount == 0) {
+        return 0;
+    }
+    if (force || groupCount >= groupOps || (groupMs > 0 && elapsed_ms(&groupStart) >= groupMs)) {
+        if (fdatasync(walFd) != 0) {
+            return -1;
+        }
+        groupCount = 0;
+    }
+    return 0;
+}
+
+// bring the image to the state of the last commit in the log at walPath,
+// then empty the log. Writes of committed commands are replayed (they are
+// idempotent byte writes, so replaying ones already in place is harmless);
+// in-place writes of a command that never committed are rolled back from
+// their undo records, newest first. Returns the number of records applied, or -1
+int journal_recover(FILE *fp, const char *walPath) {
+    int fd = open(walPath, O_RDWR);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *log = (unsigned char *)malloc((size_t)size);
+    size_t *starts = (size_t *)malloc(((size_t)size / sizeof(JournalRecord) + 1) * sizeof(size_t));
+    if (log == NULL || starts == NULL || pread(fd, log, (size_t)size, 0) != size) {
+        free(log);
+        free(starts);
+        close(fd);
+        return -1;
+    }
+
+    // find the intact records; a torn or garbled one ends the log
+    size_t count = 0, committed = 0;
+    size_t at = 0;
+    while (at + sizeof(JournalRecord) <= (size_t)size) {
+        JournalRecord record;
+        memcpy(&record, log + at, sizeof(record));
+        if (record.magic != JOURNAL_MAGIC || record.length > (size_t)size - at - sizeof(record) ||
+            record_checksum(&record, log + at + sizeof(record)) != record.checksum) {
+            break;
+        }
+        starts[count++] = at;
+        if (record.type == JOURNAL_COMMIT) {
+            committed = count;
+        }
+        at += sizeof(record) + record.length;
+    }
+
+    int imageFd = fileno(fp);
+    int applied = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t n = i < committed ? i : count - 1 - (i - committed);  // tail runs backwards
+        JournalRecord record;
+        memcpy(&record, log + starts[n], sizeof(record));
+        int wanted = n < committed ? JOURNAL_WRITE : JOURNAL_UNDO;
+        if (record.type != wanted) {
+            continue;
+        }
+        if (pwrite(imageFd, log + starts[n] + sizeof(record), record.length, (off_t)record.offset) != (ssize_t)record.length) {
+            applied = -1;
+            break;
+        }
+        applied++;
+    }
+    free(log);
+    free(starts);
+
+    // the image must hold the recovered state before the log can go
+    if (applied < 0 || fsync(imageFd) != 0 || ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return applied;
+}
+
+int journal_open(const char *walPath, unsigned int ops, unsigned int ms) {
+    walFd = open(walPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (walFd < 0) {
+        return -1;
+    }
+    groupOps = ops > 0 ? ops : 1;
+    groupMs = ms;
+    groupCount = 0;
+    walSize = 0;
+
+    const char *crash = getenv("FAT32_WAL_CRASH_AFTER");
+    crashAfter = crash != NULL ? atol(crash) : -1;
+    return 0;
+}
+
+int journal_enabled(void) {
+    return walFd >= 0;
+}
+
+// test hook: exit without cleanup once FAT32_WAL_CRASH_AFTER points have
+// passed, with whatever reached the image so far pushed out of stdio
+static void crash_point(FILE *fp) {
+    if (crashAfter >= 0 && --crashAfter < 0) {
+        image_sync(fp);
+        _exit(3);
+    }
+}
+
+// write metadata to the image; with the journal on, log the FAT changes made
+// so far, the bytes being replaced and the new ones before writing in place
+int journal_write(FILE *fp, long offset, const void *data, size_t len) {
+    if (walFd < 0) {
+        return image_commit(fp, offset, data, len);
+    }
+
+    unsigned char *old = (unsigned char *)malloc(len);
+    if (old == NULL || image_read(fp, offset, old, len) != 0 ||
+        fat_log_changes(append_write) != 0 || append_record(JOURNAL_UNDO, offset, old, len) != 0 ||
+        append_write(offset, data, len) != 0 || flush_pending() != 0) {
+        free(old);
+        return -1;
+    }
+    free(old);
+    // a long command mustn't hold back the fsync that earlier commands are waiting on
+    if (sync_group(0) != 0) {
+        return -1;
+    }
+    crash_point(fp);  // logged, but never written in place
+    int result = image_commit(fp, offset, data, len);
+    crash_point(fp);  // written in place, command not committed
+    return result;
+}
+
+// close one command's transaction; fsync the log when the group is full or
+// old enough, and checkpoint when it has grown large
+int journal_end_op(FILE *fp) {
+    if (walFd < 0) {
+        return 0;
+    }
+
+    if (fat_log_changes(append_write) != 0 || append_record(JOURNAL_COMMIT, 0, NULL, 0) != 0 || flush_pending() != 0) {
+        return -1;
+    }
+    if (groupCount++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &groupStart);
+    }
+    if (sync_group(0) != 0) {
+        return -1;
+    }
+    if (walSize >= JOURNAL_CHECKPOINT_BYTES) {
+        return journal_checkpoint(fp);
+    }
+    return 0;
+}
+
+// make the log durable, write the FAT and FSInfo in place, sync the image
+// and start a fresh log. FSInfo isn't logged: a crash before the log is
+// emptied replays the FAT, and the mount recounts FSInfo from it
+int journal_checkpoint(FILE *fp) {
+    if (walFd < 0) {
+        return fat_sync(fp) != 0 || alloc_sync(fp) != 0 ? -1 : 0;
+    }
+
+    if (fat_log_changes(append_write) != 0 || flush_pending() != 0 || fdatasync(walFd) != 0) {
+        return -1;
+    }
+    groupCount = 0;
+    if (fat_sync(fp) != 0 || alloc_sync(fp) != 0 || image_sync(fp) != 0 || fsync(fileno(fp)) != 0) {
+        return -1;
+    }
+    if (ftruncate(walFd, 0) != 0 || fsync(walFd) != 0) {
+        return -1;
+    }
+    walSize = 0;
+    return 0;
+}
+
+// stop journaling; run journal_checkpoint() first to keep the log's contents
+void journal_close(void) {
+    if (walFd < 0) {
+        return;
+    }
+    close(walFd);
+    walFd = -1;
+    free(pending);
+    pending = NULL;
+    pendingLen = 0;
+    pendingCap = 0;
+}
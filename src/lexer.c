@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "lexer.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,8 +9,10 @@ char *get_input(void) {
 	char *buffer = NULL;
 	int bufsize = 0;
 	char line[5];
+	int gotLine = 0;
 	while (fgets(line, 5, stdin) != NULL)
 	{
+		gotLine = 1;
 		int addby = 0;
 		char *newln = strchr(line, '\n');
 		if (newln != NULL)
@@ -21,6 +25,8 @@ char *get_input(void) {
 		if (newln != NULL)
 			break;
 	}
+	if (!gotLine)
+		return NULL; /* end of input */
 	buffer = (char *)realloc(buffer, bufsize + 1);
 	buffer[bufsize] = 0;
 	return buffer;
@@ -65,3 +71,97 @@ void free_tokens(tokenlist *tokens) {
 	free(tokens->items);
 	free(tokens);
 }
+
+void lexer_init(lexer_session *lex) {
+	lex->line = NULL;
+	lex->lineCapacity = 0;
+	lex->tokens.items = NULL;
+	lex->tokens.size = 0;
+	lex->tokenCapacity = 0;
+}
+
+void lexer_free(lexer_session *lex) {
+	free(lex->line);
+	free(lex->tokens.items);
+	lexer_init(lex);
+}
+
+/* read one line into the session buffer without its newline; NULL at end of input */
+char *lexer_read_line(lexer_session *lex, FILE *in) {
+	ssize_t length = getline(&lex->line, &lex->lineCapacity, in);
+	if (length < 0)
+		return NULL;
+	if (length > 0 && lex->line[length - 1] == '\n')
+		lex->line[--length] = 0;
+	if (length > 0 && lex->line[length - 1] == '\r')
+		lex->line[--length] = 0;
+	return lex->line;
+}
+
+static void reserve_tokens(lexer_session *lex, size_t count) {
+	if (count > lex->tokenCapacity) {
+		lex->tokenCapacity = lex->tokenCapacity ? lex->tokenCapacity * 2 : 16;
+		lex->tokens.items = (char **)realloc(lex->tokens.items, lex->tokenCapacity * sizeof(char *));
+	}
+}
+
+static void push_token(lexer_session *lex, char *item) {
+	reserve_tokens(lex, lex->tokens.size + 2);
+	lex->tokens.items[lex->tokens.size++] = item;
+	lex->tokens.items[lex->tokens.size] = NULL;
+}
+
+/* split one command out of text, in place. Words are separated by spaces or
+ * tabs; '...' and "..." quote spaces, ';' and '#', and a word may mix quoted
+ * and bare parts. An unquoted ';' ends the command and an unquoted '#' at the
+ * start of a word ends the line. Returns where the next command starts, or
+ * NULL when text is used up; *tokens points at the session's token list. */
+char *lexer_tokenize(lexer_session *lex, char *text, tokenlist **tokens) {
+	char *in = text;
+	char *rest = NULL;
+	reserve_tokens(lex, 1);
+	lex->tokens.size = 0;
+	lex->tokens.items[0] = NULL;
+	*tokens = &lex->tokens;
+
+	while (*in) {
+		while (*in == ' ' || *in == '\t')
+			in++;
+		if (*in == 0 || *in == '#')
+			break;
+		if (*in == ';') {
+			rest = in + 1;
+			break;
+		}
+
+		/* copy the word down over its own quotes */
+		char *word = in;
+		char *out = in;
+		char quote = 0;
+		while (*in) {
+			if (quote) {
+				if (*in == quote)
+					quote = 0;
+				else
+					*out++ = *in;
+				in++;
+			} else if (*in == '\'' || *in == '"') {
+				quote = *in++;
+			} else if (*in == ' ' || *in == '\t' || *in == ';') {
+				break;
+			} else {
+				*out++ = *in++;
+			}
+		}
+		int endsCommand = *in == ';';
+		if (*in)
+			in++;
+		*out = 0;
+		push_token(lex, word);
+		if (endsCommand) {
+			rest = in;
+			break;
+		}
+	}
+	return rest;
+}
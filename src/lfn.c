@@ -0,0 +1,337 @@
+#include "lfn.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+// characters a short name may hold besides upper-case letters and digits
+static const char shortExtras[] = "$%'-_@~`!(){}^#&";
+
+// checksum of an 11-byte short name, stored in each of its long name entries
+unsigned char lfn_checksum(const unsigned char *shortName) {
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+    }
+    return sum;
+}
+
+void lfn_reset(LfnState *state) {
+    state->next = 0;
+    state->parts = 0;
+    state->start = -1;
+}
+
+// UTF-8 name to UTF-16 units; -1 if it isn't valid UTF-8, holds a character
+// FAT forbids, or is longer than LFN_MAX_CHARS units
+static int utf8_to_utf16(const char *name, unsigned short *units) {
+    const unsigned char *p = (const unsigned char *)name;
+    int count = 0;
+    while (*p) {
+        unsigned int cp;
+        int extra;
+        if (*p < 0x80) {
+            cp = *p;
+            extra = 0;
+            if (cp < 0x20 || strchr("\"*/:<>?\\|", (int)cp) != NULL) {
+                return -1;
+            }
+        } else if ((*p & 0xE0) == 0xC0) {
+            cp = *p & 0x1F;
+            extra = 1;
+        } else if ((*p & 0xF0) == 0xE0) {
+            cp = *p & 0x0F;
+            extra = 2;
+        } else if ((*p & 0xF8) == 0xF0) {
+            cp = *p & 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+        p++;
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) {
+                return -1;
+            }
+            cp = (cp << 6) | (*p & 0x3F);
+        }
+        // overlong forms, surrogates and values past U+10FFFF aren't characters
+        if ((extra == 1 && cp < 0x80) || (extra == 2 && cp < 0x800) || (extra == 3 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+            (cp >= 0xD800 && cp <= 0xDFFF)) {
+            return -1;
+        }
+
+        int need = cp >= 0x10000 ? 2 : 1;
+        if (count + need > LFN_MAX_CHARS) {
+            return -1;
+        }
+        if (need == 2) {
+            cp -= 0x10000;
+            units[count++] = 0xD800 | (cp >> 10);
+            units[count++] = 0xDC00 | (cp & 0x3FF);
+        } else {
+            units[count++] = cp;
+        }
+    }
+    return count;
+}
+
+// UTF-16 units up to the first 0 (or max) to UTF-8; unpaired surrogates
+// come out as '?'. Returns the length, 0 for an empty name
+static int utf16_to_utf8(const unsigned short *units, int max, char *name) {
+    unsigned char *out = (unsigned char *)name;
+    for (int i = 0; i < max && units[i] != 0; i++) {
+        unsigned int cp = units[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < max && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (units[++i] - 0xDC00);
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = '?';
+        }
+
+        if (cp < 0x80) {
+            *out++ = cp;
+        } else if (cp < 0x800) {
+            *out++ = 0xC0 | (cp >> 6);
+            *out++ = 0x80 | (cp & 0x3F);
+        } else if (cp < 0x10000) {
+            *out++ = 0xE0 | (cp >> 12);
+            *out++ = 0x80 | ((cp >> 6) & 0x3F);
+            *out++ = 0x80 | (cp & 0x3F);
+        } else {
+            *out++ = 0xF0 | (cp >> 18);
+            *out++ = 0x80 | ((cp >> 12) & 0x3F);
+            *out++ = 0x80 | ((cp >> 6) & 0x3F);
+            *out++ = 0x80 | (cp & 0x3F);
+        }
+    }
+    *out = '\0';
+    return (int)(out - (unsigned char *)name);
+}
+
+// "NAME.EXT" from an 11-byte short name. caseFlags is DIR_NTRes: 0x08 shows
+// the base and 0x10 the extension in lower case, as Windows records them.
+// Names written by older versions of this shell are NUL padded
+void short_name_format(const unsigned char *shortName, unsigned char caseFlags, char *name) {
+    int baseLen = 8;
+    while (baseLen > 0 && (shortName[baseLen - 1] == ' ' || shortName[baseLen - 1] == '\0')) {
+        baseLen--;
+    }
+    for (int i = 0; i < baseLen; i++) {
+        if (shortName[i] == '\0') {
+            baseLen = i;  // a NUL inside the base ends it
+            break;
+        }
+    }
+    int extLen = 3;
+    while (extLen > 0 && (shortName[8 + extLen - 1] == ' ' || shortName[8 + extLen - 1] == '\0')) {
+        extLen--;
+    }
+
+    int len = 0;
+    for (int i = 0; i < baseLen; i++) {
+        char c = shortName[i];
+        if (i == 0 && shortName[0] == 0x05) {
+            c = (char)0xE5;  // 0xE5 is stored as 0x05 so the entry doesn't read as deleted
+        }
+        name[len++] = (caseFlags & 0x08) && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    if (extLen > 0) {
+        name[len++] = '.';
+        for (int i = 0; i < extLen; i++) {
+            char c = shortName[8 + i];
+            name[len++] = (caseFlags & 0x10) && c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+    }
+    name[len] = '\0';
+}
+
+// feed the entries of a directory in order. Returns 0 for free, deleted and
+// long name entries. For any other entry returns the number of entries its
+// name takes (1 plus its long name parts) and writes the name: the long name
+// if a complete run with the right checksum came just before it, otherwise
+// the formatted short name. state->start is then the offset of the first
+// entry of the name
+int lfn_scan(LfnState *state, const DIR *entry, long offset, char *name) {
+    if (entry->DIR_Name[0] == 0x00 || entry->DIR_Name[0] == 0xE5) {
+        lfn_reset(state);
+        return 0;
+    }
+
+    if ((entry->DIR_Attr & 0x3F) == ATTR_LONG_NAME) {
+        const LDIR *part = (const LDIR *)entry;
+        int ord = part->LDIR_Ord & 0x3F;
+        if (part->LDIR_Ord & 0x40) {
+            // last part, stored first: a new run starts here
+            if (ord < 1 || ord > LFN_MAX_ENTRIES) {
+                lfn_reset(state);
+                return 0;
+            }
+            state->parts = ord;
+            state->checksum = part->LDIR_Chksum;
+            state->start = offset;
+        } else if (state->next == 0 || ord != state->next || part->LDIR_Chksum != state->checksum) {
+            lfn_reset(state);
+            return 0;
+        }
+
+        unsigned short *chars = &state->chars[(ord - 1) * LFN_CHARS_PER_ENTRY];
+        memcpy(chars, (const unsigned char *)part + offsetof(LDIR, LDIR_Name1), 10);
+        memcpy(chars + 5, (const unsigned char *)part + offsetof(LDIR, LDIR_Name2), 12);
+        memcpy(chars + 11, (const unsigned char *)part + offsetof(LDIR, LDIR_Name3), 4);
+        state->next = ord - 1;
+        return 0;
+    }
+
+    int span = 1;
+    if (state->parts > 0 && state->next == 0 && state->checksum == lfn_checksum(entry->DIR_Name) &&
+        utf16_to_utf8(state->chars, state->parts * LFN_CHARS_PER_ENTRY < LFN_MAX_CHARS ? state->parts * LFN_CHARS_PER_ENTRY : LFN_MAX_CHARS, name) > 0) {
+        span += state->parts;
+    } else {
+        short_name_format(entry->DIR_Name, entry->DIR_NTRes, name);
+        state->start = offset;
+    }
+    state->next = 0;
+    state->parts = 0;
+    return span;
+}
+
+// whether name can be given to a new entry: valid UTF-8 without characters
+// FAT forbids, not "." or "..", no trailing dot or space
+int lfn_name_valid(const char *name) {
+    unsigned short units[LFN_MAX_CHARS];
+    size_t len = strlen(name);
+    return utf8_to_utf16(name, units) > 0 && name[len - 1] != '.' && name[len - 1] != ' ';
+}
+
+// one short name character for the code point at *p, advancing past it;
+// 0 drops it. Clears *exact when the short name can't reproduce it
+static unsigned char short_char(const unsigned char **p, int *exact) {
+    unsigned char c = *(*p)++;
+    if (c >= 0x80) {
+        while ((**p & 0xC0) == 0x80) {
+            (*p)++;
+        }
+        *exact = 0;
+        return '_';
+    }
+    if (c >= 'a' && c <= 'z') {
+        *exact = 0;  // the case only survives in a long name
+        return c - 'a' + 'A';
+    }
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr(shortExtras, c) != NULL) {
+        return c;
+    }
+    *exact = 0;
+    if (c == ' ' || c == '.') {
+        return 0;
+    }
+    return '_';
+}
+
+// basis short name for name (FAT spec, section 7.2): upper case, spaces and
+// leading dots dropped, anything else a short name can't hold turned into
+// '_', base and extension truncated to 8 and 3. Returns 1 if the basis is
+// the name itself, so no long name entries are needed
+int lfn_basis(const char *name, unsigned char *shortName) {
+    memset(shortName, ' ', 11);
+    int exact = 1;
+
+    const unsigned char *p = (const unsigned char *)name;
+    while (*p == '.') {
+        p++;
+        exact = 0;
+    }
+    const unsigned char *dot = (const unsigned char *)strrchr((const char *)p, '.');
+
+    int len = 0;
+    while (*p && p != dot) {
+        unsigned char c = short_char(&p, &exact);
+        if (c != 0 && len < 8) {
+            shortName[len++] = c;
+        } else if (c != 0) {
+            exact = 0;
+        }
+    }
+    if (dot != NULL) {
+        p = dot + 1;
+        len = 0;
+        while (*p) {
+            unsigned char c = short_char(&p, &exact);
+            if (c != 0 && len < 3) {
+                shortName[8 + len++] = c;
+            } else if (c != 0) {
+                exact = 0;
+            }
+        }
+    }
+
+    if (shortName[0] == ' ') {
+        shortName[0] = '_';
+        exact = 0;
+    }
+    return exact;
+}
+
+// candidate n for a short name whose basis isn't the name itself:
+// "BASIS~n" for the first four, then two basis characters and a hash of the
+// long name ("BA1F3C~n"), so a big directory of similar names doesn't probe
+// through every number, then plain numbers again from ~5
+void lfn_tail(unsigned char *shortName, const unsigned char *basis, const char *name, unsigned int n) {
+    char tail[16];
+    int baseLen = 8;
+    while (baseLen > 0 && basis[baseLen - 1] == ' ') {
+        baseLen--;
+    }
+
+    int keep = baseLen;
+    if (n <= 4) {
+        snprintf(tail, sizeof(tail), "~%u", n);
+    } else if (n <= 13) {
+        unsigned int h = 2166136261u;
+        for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+            h = (h ^ *p) * 16777619u;
+        }
+        snprintf(tail, sizeof(tail), "%04X~%u", (h ^ (h >> 16)) & 0xFFFF, n - 4);
+        keep = baseLen < 2 ? baseLen : 2;
+    } else {
+        snprintf(tail, sizeof(tail), "~%u", n - 9);
+    }
+
+    int tailLen = (int)strlen(tail);
+    if (keep > 8 - tailLen) {
+        keep = 8 - tailLen;
+    }
+    memcpy(shortName, basis, 11);
+    memset(shortName + keep, ' ', 8 - keep);
+    memcpy(shortName + keep, tail, tailLen);
+}
+
+// long name entries for name, in the order they go on disk; the short entry
+// follows them. Returns how many were written, -1 if name can't be stored
+int lfn_encode(const char *name, const unsigned char *shortName, DIR *entries) {
+    unsigned short units[LFN_MAX_CHARS];
+    int count = utf8_to_utf16(name, units);
+    if (count <= 0) {
+        return -1;
+    }
+
+    int parts = (count + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    unsigned char sum = lfn_checksum(shortName);
+    for (int ord = parts; ord >= 1; ord--) {
+        // the name ends with a 0 unit when there's room, then 0xFFFF padding
+        unsigned short chars[LFN_CHARS_PER_ENTRY];
+        for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+            int at = (ord - 1) * LFN_CHARS_PER_ENTRY + i;
+            chars[i] = at < count ? units[at] : at == count ? 0x0000 : 0xFFFF;
+        }
+
+        LDIR *part = (LDIR *)&entries[parts - ord];
+        memset(part, 0, sizeof(LDIR));
+        part->LDIR_Ord = ord | (ord == parts ? 0x40 : 0);
+        part->LDIR_Attr = ATTR_LONG_NAME;
+        part->LDIR_Chksum = sum;
+        memcpy((unsigned char *)part + offsetof(LDIR, LDIR_Name1), chars, 10);
+        memcpy((unsigned char *)part + offsetof(LDIR, LDIR_Name2), chars + 5, 12);
+        memcpy((unsigned char *)part + offsetof(LDIR, LDIR_Name3), chars + 11, 4);
+    }
+    return parts;
+}
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "path.h"
+#include "dirindex.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#define PATH_CACHE_SIZE 256   // direct-mapped: a new prefix replaces whatever hashed to its slot
+
+typedef struct PathCacheEntry {
+    char path[PATH_MAX_LEN];  // canonical absolute directory path, "" if empty
+    unsigned int cluster;
+} PathCacheEntry;
+
+static PathCacheEntry pathCache[PATH_CACHE_SIZE];
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;  // --serve sessions resolve paths concurrently
+
+// names match without regard to ASCII case, so the cache does too
+static unsigned int hash_path(const char *path, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = path[i] >= 'a' && path[i] <= 'z' ? path[i] - 'a' + 'A' : path[i];
+        h = (h ^ c) * 16777619u;
+    }
+    return h % PATH_CACHE_SIZE;
+}
+
+static int cache_get(const char *path, size_t len, unsigned int *cluster) {
+    PathCacheEntry *entry = &pathCache[hash_path(path, len)];
+    pthread_mutex_lock(&cacheLock);
+    int found = strlen(entry->path) == len && strncasecmp(entry->path, path, len) == 0;
+    if (found) {
+        *cluster = entry->cluster;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
+
+static void cache_put(const char *path, size_t len, unsigned int cluster) {
+    PathCacheEntry *entry = &pathCache[hash_path(path, len)];
+    pthread_mutex_lock(&cacheLock);
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->cluster = cluster;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// join path onto cwd and fold "." and ".." into a canonical absolute path
+// ("/" or "/A/B"); returns -1 if the result doesn't fit in PATH_MAX_LEN
+int path_normalize(const char *cwd, const char *path, char *out) {
+    char buf[PATH_MAX_LEN * 2];
+    if (path[0] == '/') {
+        snprintf(buf, sizeof(buf), "%s", path);
+    } else {
+        snprintf(buf, sizeof(buf), "%s/%s", cwd, path);
+    }
+
+    size_t len = 0;
+    out[0] = '\0';
+    char *save = NULL;
+    for (char *part = strtok_r(buf, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            // don't go past the root
+            char *last = strrchr(out, '/');
+            if (last != NULL) {
+                *last = '\0';
+                len = last - out;
+            }
+            continue;
+        }
+        size_t partLen = strlen(part);
+        if (len + 1 + partLen >= PATH_MAX_LEN) {
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, part, partLen + 1);
+        len += partLen;
+    }
+
+    if (len == 0) {
+        strcpy(out, "/");
+    }
+    return 0;
+}
+
+// cluster of the directory at a canonical absolute path, starting from the
+// longest cached prefix
+int path_lookup_dir(FILE *fp, BPB *bpb, const char *absPath, unsigned int *cluster) {
+    size_t len = strlen(absPath);
+    if (len == 1) {
+        *cluster = bpb->BPB_RootClus;
+        return 1;
+    }
+
+    // find the longest prefix we already know
+    size_t known = len;
+    unsigned int dirCluster = bpb->BPB_RootClus;
+    while (known > 0 && !cache_get(absPath, known, &dirCluster)) {
+        while (known > 0 && absPath[--known] != '/') {
+        }
+    }
+    if (known == 0) {
+        dirCluster = bpb->BPB_RootClus;
+    }
+
+    // walk the remaining components, caching each prefix on the way
+    while (known < len) {
+        size_t start = known + 1;
+        size_t end = start;
+        while (end < len && absPath[end] != '/') {
+            end++;
+        }
+
+        char name[PATH_MAX_LEN];
+        memcpy(name, absPath + start, end - start);
+        name[end - start] = '\0';
+
+        DIR entry;
+        if (!dir_lookup(fp, bpb, dirCluster, name, &entry, NULL) || !(entry.DIR_Attr & 0x10)) {
+            return 0;
+        }
+        dirCluster = entry.DIR_FstClusLO | (entry.DIR_FstClusHI << 16);
+        if (dirCluster == 0) {
+            dirCluster = bpb->BPB_RootClus;
+        }
+        cache_put(absPath, end, dirCluster);
+        known = end;
+    }
+
+    *cluster = dirCluster;
+    return 1;
+}
+
+// resolve everything but the last component of path to a directory cluster;
+// the last component is copied to leaf (at least PATH_MAX_LEN bytes)
+int path_resolve_parent(FILE *fp, BPB *bpb, const char *cwd, const char *path, unsigned int *dirCluster, char *leaf) {
+    char absPath[PATH_MAX_LEN];
+    if (path_normalize(cwd, path, absPath) != 0 || strcmp(absPath, "/") == 0) {
+        return 0;
+    }
+
+    char *last = strrchr(absPath, '/');
+    strcpy(leaf, last + 1);
+
+    if (last == absPath) {
+        *dirCluster = bpb->BPB_RootClus;
+        return 1;
+    }
+    *last = '\0';
+    return path_lookup_dir(fp, bpb, absPath, dirCluster);
+}
+
+// forget absPath and everything below it (after rename or rmdir)
+void path_cache_invalidate(const char *absPath) {
+    size_t len = strlen(absPath);
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        char *cached = pathCache[i].path;
+        if (strncasecmp(cached, absPath, len) == 0 && (cached[len] == '\0' || cached[len] == '/' || len == 1)) {
+            cached[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void path_cache_clear(void) {
+    pthread_mutex_lock(&cacheLock);
+    memset(pathCache, 0, sizeof(pathCache));
+    pthread_mutex_unlock(&cacheLock);
+}
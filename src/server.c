@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define SERVER_BACKLOG      64
+#define SERVER_SEND_TIMEOUT 30   // seconds a client may leave its answer unread before writes fail
+
+typedef struct Client {
+    int fd;              // the connection, -1 once its session has returned
+    int running;         // thread started and not joined yet
+    pthread_t thread;
+    SessionFn session;
+    void *arg;
+} Client;
+
+static Client *clients = NULL;
+static int clientCount = 0;
+static pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;
+static int stopPipe[2] = { -1, -1 };  // the signal handler wakes poll() through it
+
+static void on_stop(int sig) {
+    char byte = (char)sig;
+    ssize_t n = write(stopPipe[1], &byte, 1);
+    (void)n;
+}
+
+static void *client_main(void *data) {
+    Client *client = (Client *)data;
+    client->session(client->fd, client->arg);
+    // stop the shutdown path from touching the descriptor before it goes
+    pthread_mutex_lock(&clientLock);
+    int fd = client->fd;
+    client->fd = -1;
+    pthread_mutex_unlock(&clientLock);
+    close(fd);
+    return NULL;
+}
+
+// a slot for a new connection, joining a finished session's thread to free
+// one up; NULL when every slot is busy
+static Client *free_slot(void) {
+    for (int i = 0; i < clientCount; i++) {
+        pthread_mutex_lock(&clientLock);
+        int done = clients[i].fd < 0;
+        pthread_mutex_unlock(&clientLock);
+        if (!done) {
+            continue;
+        }
+        if (clients[i].running) {
+            pthread_join(clients[i].thread, NULL);
+            clients[i].running = 0;
+        }
+        return &clients[i];
+    }
+    return NULL;
+}
+
+static int listen_on(const char *socketPath) {
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+
+    // a socket left behind by a server that didn't get to clean up
+    struct stat st;
+    if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketPath);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// accept connections on socketPath until SIGINT or SIGTERM; returns -1 if
+// the socket can't be set up
+int server_run(const char *socketPath, int maxSessions, SessionFn session, void *arg) {
+    if (maxSessions < 1) {
+        maxSessions = 1;
+    }
+    clients = (Client *)calloc(maxSessions, sizeof(Client));
+    if (clients == NULL || pipe(stopPipe) != 0) {
+        free(clients);
+        clients = NULL;
+        return -1;
+    }
+    clientCount = maxSessions;
+    for (int i = 0; i < clientCount; i++) {
+        clients[i].fd = -1;
+    }
+    fcntl(stopPipe[1], F_SETFL, O_NONBLOCK);
+
+    int listenFd = listen_on(socketPath);
+    if (listenFd < 0) {
+        int saved = errno;
+        close(stopPipe[0]);
+        close(stopPipe[1]);
+        free(clients);
+        clients = NULL;
+        errno = saved;
+        return -1;
+    }
+
+    // a client that hangs up mid-answer must not take the process with it
+    struct sigaction stop, ignore, oldInt, oldTerm, oldPipe;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = on_stop;
+    sigemptyset(&stop.sa_mask);
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &stop, &oldInt);
+    sigaction(SIGTERM, &stop, &oldTerm);
+    sigaction(SIGPIPE, &ignore, &oldPipe);
+
+    // session threads leave the stop signals to this one
+    sigset_t stopSignals, oldMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+
+    struct timeval sendTimeout = { SERVER_SEND_TIMEOUT, 0 };
+    while (1) {
+        struct pollfd fds[2] = { { listenFd, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        Client *client = free_slot();
+        if (client == NULL) {
+            const char *busy = "Error: Too many sessions, try again later.\n";
+            ssize_t n = write(fd, busy, strlen(busy));
+            (void)n;
+            close(fd);
+            continue;
+        }
+        // a session blocked on a client that stopped reading would hold up
+        // every command waiting for the image
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+        client->fd = fd;
+        client->session = session;
+        client->arg = arg;
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+        client->running = pthread_create(&client->thread, NULL, client_main, client) == 0;
+        pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+        if (!client->running) {
+            client->fd = -1;
+            close(fd);
+        }
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+
+    // sessions finish the command they're on and then see end of input
+    pthread_mutex_lock(&clientLock);
+    for (int i = 0; i < clientCount; i++) {
+        if (clients[i].fd >= 0) {
+            shutdown(clients[i].fd, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&clientLock);
+    for (int i = 0; i < clientCount; i++) {
+        if (clients[i].running) {
+            pthread_join(clients[i].thread, NULL);
+        }
+    }
+
+    sigaction(SIGINT, &oldInt, NULL);
+    sigaction(SIGTERM, &oldTerm, NULL);
+    sigaction(SIGPIPE, &oldPipe, NULL);
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    stopPipe[0] = stopPipe[1] = -1;
+    free(clients);
+    clients = NULL;
+    clientCount = 0;
+    return 0;
+}
@@ -1,118 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "lexer.h"
+#include "fat32.h"
+#include "fatcache.h"
+#include "alloc.h"
+#include "image.h"
+#include "dir.h"
+#include "dirindex.h"
+#include "path.h"
+#include "extent.h"
+#include "walk.h"
+#include "fsck.h"
+#include "journal.h"
+#include "lfn.h"
+#include "stats.h"
+#include "server.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>  // strcasecmp()
+#include <limits.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <libgen.h>  // For basename()
+#include <fnmatch.h>
+#include <pthread.h>
 
 /************************************************************************************************/
 
-// BPB structure
-typedef struct __attribute__((packed))
-{
-    unsigned char BS_jmpBoot[3];
-    unsigned char BS_OEMName[8];
-    unsigned short BPB_BytesPerSec;
-    unsigned char BPB_SecsPerClus;
-    unsigned short BPB_RsvdSecCnt;
-    unsigned char BPB_NumFATs;
-    unsigned short BPB_RootEntCnt;
-    unsigned short BPB_TotSec16;
-    unsigned char BPB_Media;
-    unsigned short BPB_FATSz16;
-    unsigned short BPB_SecPerTrk;
-    unsigned short BPB_NumHeads;
-    unsigned int BPB_HiddSec;
-    unsigned int BPB_TotSec32;
-    unsigned int BPB_FATSz32;
-    unsigned short BPB_ExtFlags;
-    unsigned short BPB_FSVer;
-    unsigned int BPB_RootClus;
-    unsigned short BPB_FSInfo;
-    unsigned short BPB_BkBootSe;
-    unsigned char BPB_Reserved[12];
-    unsigned char BS_DrvNum;
-    unsigned char BS_Reserved1;
-    unsigned char BS_BootSig;
-    unsigned int BS_VollD;
-    unsigned char BS_VolLab[11];
-    unsigned char BS_FilSysType[8];
-    unsigned char empty[420];
-    unsigned short Signature_word;
-} BPB;
-
-// directory entry structure
-typedef struct __attribute__((packed)) {
-    unsigned char DIR_Name[11];          
-    unsigned char DIR_Attr;              
-    unsigned char DIR_NTRes;             
-    unsigned char DIR_CrtTimeTenth;     
-    unsigned short DIR_CrtTime;          
-    unsigned short DIR_CrtDate;          
-    unsigned short DIR_LstAccDate;       
-    unsigned short DIR_FstClusHI;        
-    unsigned short DIR_WrtTime;          
-    unsigned short DIR_WrtDate;          
-    unsigned short DIR_FstClusLO;        
-    unsigned int DIR_FileSize;           
-} DIR;
-
 typedef struct OpenFile {
-    char name[12];       // 8.3 format for FAT32 filenames
+    char name[NAME_MAX_BYTES]; // name as given to open, long or 8.3
     unsigned int offset; // offset for read/write
     char mode[3];        // r, w, rw, wr
     char path[512];      // path to the file
+    unsigned int dirCluster; // directory holding the file
+    long entryPos;       // image offset of the file's directory entry
+    unsigned int fileSize;
+    ExtentMap extents;   // cluster chain as contiguous runs
+    unsigned char *writeBuf;  // small writes not yet on the image
+    unsigned int writeStart;  // file offset of writeBuf[0], cluster aligned
+    unsigned int writeLen;    // bytes of writeBuf holding data
+    unsigned char *readBuf;   // read-ahead window, NULL until the handle reads sequentially
+    unsigned int readStart;   // file offset of readBuf[0], cluster aligned
+    unsigned int readLen;     // bytes of readBuf holding data
+    unsigned int readWindow;  // clusters the next read-ahead covers, 0 after a seek
+    unsigned int readNext;    // offset where a sequential read would start
+    unsigned int readAdvised; // end of the range already hinted to the kernel
 } OpenFile;
 
-typedef unsigned int Cluster;  // FAT32 clusters are typically 32-bit values (unsigned int)
-
 
 /************************************************************************************************/
 
 // array to store open files
 #define MAX_OPEN_FILES 10
-OpenFile openFiles[MAX_OPEN_FILES];
-int openFileCount = 0;
-
-unsigned int currentCluster = 0;  // start at root directory (BPB_RootClus)
+#define MAX_IO_BYTES (1024 * 1024)  // largest single read through the stdio backend
+#define IO_BATCH_RUNS 64             // contiguous runs submitted together by file_io() and read_file()
+#define WRITE_BUFFER_BYTES (64 * 1024)  // per-handle write buffer, rounded up to whole clusters
+#define READAHEAD_BYTES MAX_IO_BYTES     // largest per-handle read-ahead window
+#define EXTEND_NO_MEMORY (-2)         // extend_chain() and preallocate(): the extent map could not grow
+
+int walkThreads = 0;    // threads for find/du/tree/fsck, 0 until main picks a default
+
+#define BATCH_OUTPUT_BYTES (64 * 1024)  // stdout buffer in -c/-f mode
+#define JOURNAL_GROUP_OPS 32   // default commands per journal fsync (--journal-ops)
+#define JOURNAL_GROUP_MS  50   // default age of a commit group before its fsync (--journal-ms)
+#define URING_DEPTH       64   // default io_uring queue depth (--uring-depth)
+#define CACHE_KB        4096   // default cluster buffer cache size (--cache)
+#define BULK_INIT_BYTES (1024 * 1024)  // most new directory clusters 'mkdir -p' writes at once
+#define SERVE_MAX_SESSIONS 64  // clients --serve takes at once
+
+// everything a command runs against; --serve keeps one per client
+typedef struct Shell {
+    FILE *fp;
+    BPB bpb;
+    unsigned int currentCluster;  // cwd's cluster
+    char cwd[PATH_MAX_LEN];       // cwd's canonical path
+    const char *imageName;
+    lexer_session lex;            // line buffer and token slices, reused per command
+    FILE *out;                    // command output: stdout, or the client's socket
+    OpenFile openFiles[MAX_OPEN_FILES];
+    int openFileCount;
+    int debugOutput;              // per-cluster and allocation chatter, toggled with 'debug on|off'
+    int commandFailed;            // set when the running command reports an error
+} Shell;
+
+static __thread Shell *session;  // the shell this thread is running a command for
+
+// With --serve, commands that only read the image hold the tree lock shared
+// and run side by side; the rest hold it exclusively, so every change to the
+// FAT, the allocator and the directories happens one command at a time
+static pthread_rwlock_t treeLock = PTHREAD_RWLOCK_INITIALIZER;
+static int serving = 0;
+static Shell *sessions[SERVE_MAX_SESSIONS];  // connected clients; changed under the exclusive lock
 
 /************************************************************************************************/
 
+// printf for error messages; also marks the running command as failed
+void print_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(session->out, format, args);
+    va_end(args);
+    session->commandFailed = 1;
+}
+
 // Function to print BPB information
 void print_bpb_info(BPB *bpb, FILE *fp) {
     // total clusters in data region
     unsigned int totalClusters = bpb->BPB_TotSec32 - bpb->BPB_RsvdSecCnt - (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
 
     // print info
-    printf("Root cluster position (in cluster #): %u\n", bpb->BPB_RootClus);
-    printf("Bytes per sector: %u\n", bpb->BPB_BytesPerSec);
-    printf("Sectors per cluster: %u\n", bpb->BPB_SecsPerClus);
-    printf("Total clusters in data region: %u\n", totalClusters);
-    printf("Number of entries in one FAT: %u\n", ((bpb->BPB_FATSz32 * bpb->BPB_BytesPerSec) / 4));
-    printf("Size of image (in bytes): %u\n", (bpb->BPB_TotSec32 * bpb->BPB_BytesPerSec));
+    fprintf(session->out, "Root cluster position (in cluster #): %u\n", bpb->BPB_RootClus);
+    fprintf(session->out, "Bytes per sector: %u\n", bpb->BPB_BytesPerSec);
+    fprintf(session->out, "Sectors per cluster: %u\n", bpb->BPB_SecsPerClus);
+    fprintf(session->out, "Total clusters in data region: %u\n", totalClusters);
+    fprintf(session->out, "Number of entries in one FAT: %u\n", ((bpb->BPB_FATSz32 * bpb->BPB_BytesPerSec) / 4));
+    fprintf(session->out, "Size of image (in bytes): %u\n", (bpb->BPB_TotSec32 * bpb->BPB_BytesPerSec));
 }
 
 // function to manage and update the cwd path as we move between them
 void update_cwd(char *path, const char *dirName) {
-    // if we are to move up a directory
-    if (strcmp(dirName, "..") == 0) {
-        // find the last occurence of '/' in path
-        // if a '/' is found and it's not the root '/', modify the path
-        char *last = strrchr(path, '/');       
-        if (last != NULL && last != path) {
-            *last = '\0';  // remove everything after '/'
-        } else {
-            // don't go past the root
-            strcpy(path, "/");
-        }
-    } else {    // we are going into a valid directory
-        if (strcmp(path, "/") != 0) { // if not at root
-            strcat(path, "/"); // add a '/' to separate directories
-        }
-        strcat(path, dirName); // add the directory name to the current path
+    // fold the (possibly multi-component) dirName into the canonical path;
+    // ".." never goes past the root
+    char newPath[PATH_MAX_LEN];
+    if (path_normalize(path, dirName, newPath) == 0) {
+        strcpy(path, newPath);
     }
 }
 
@@ -120,45 +135,23 @@ void update_cwd(char *path, const char *dirName) {
 void cd_parent(FILE *fp, BPB *bpb, unsigned int *currentCluster, char *path) {
     if (*currentCluster == 0 || strcmp(path, "/") == 0) {
         // if the current cluster is 0 or the path is root "/", we are already at root
-        printf("Already at root directory.\n");
+        fprintf(session->out, "Already at root directory.\n");
         return;
     }
 
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (*currentCluster - 2) * bytesPerCluster;
-
-    // move file pointer to start of current cluster.
-    fseek(fp, clusterOffset, SEEK_SET);
-    DIR dirEntry;
-    int found = 0; // track if '..' found
-
-    // search for ".." entry
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        // check if the directory entry is '..' by comparing first two characters.
-        if (dirEntry.DIR_Name[0] == 0x2E && dirEntry.DIR_Name[1] == 0x2E) {  // ".."
-            unsigned int parentCluster = dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16);
-
-            if (parentCluster == 0) {
-                // we are at root directory
-                *currentCluster = bpb->BPB_RootClus;
-            } else {
-                *currentCluster = parentCluster;
-            }
-            found = 1;
-            break;
-        }
+    // the parent's cluster comes from the path resolver (and its cache)
+    char parentPath[PATH_MAX_LEN];
+    unsigned int parentCluster;
+    if (path_normalize(path, "..", parentPath) != 0 || !path_lookup_dir(fp, bpb, parentPath, &parentCluster)) {
+        print_error("Error: Unable to find parent directory.\n");
+        return;
     }
 
-    if (found) {
-        update_cwd(path, "..");
-    } else {
-        printf("Error: Unable to find parent directory.\n");
-    }
+    *currentCluster = parentCluster;
+    update_cwd(path, "..");
 }
 
-// function to update cwd for cd command
+// function to update cwd for cd command; dirName may be any absolute or relative path
 void change_directory(FILE *fp, BPB *bpb, char *path, char *dirName, unsigned int *currentCluster) {
     if (strcmp(dirName, ".") == 0) {
         // do nothing for "cd ."
@@ -169,245 +162,505 @@ void change_directory(FILE *fp, BPB *bpb, char *path, char *dirName, unsigned in
         return;
     }
 
+    char newPath[PATH_MAX_LEN];
+    if (path_normalize(path, dirName, newPath) != 0) {
+        print_error("Error: Path '%s' is too long.\n", dirName);
+        return;
+    }
+    if (strcmp(newPath, "/") == 0) {
+        *currentCluster = bpb->BPB_RootClus;
+        strcpy(path, "/");
+        return;
+    }
+
+    // resolve the parent directory, then look at the last component itself
+    unsigned int parentCluster;
+    char leaf[NAME_MAX_BYTES];
     DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (*currentCluster - 2) * bytesPerCluster;
+    if (!path_resolve_parent(fp, bpb, path, dirName, &parentCluster, leaf) ||
+        !dir_lookup(fp, bpb, parentCluster, leaf, &dirEntry, NULL)) {
+        print_error("Error: Directory '%s' not found.\n", dirName);
+        return;
+    }
 
-    int found = 0;  // directory found?
+    // check that the entry is actually a directory
+    if (!(dirEntry.DIR_Attr & 0x10)) {
+        print_error("Error: '%s' is not a directory.\n", dirName);
+        return;
+    }
+
+    *currentCluster = dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16);
+    if (*currentCluster == 0) {
+        *currentCluster = bpb->BPB_RootClus;
+    }
+    update_cwd(path, dirName);
+}
 
-    while (*currentCluster < 0xFFFFFF8) {   // loop through all clusters
-        fseek(fp, clusterOffset, SEEK_SET);
+// function to list directory entries in the current working directory
+void list_directory(FILE *fp, BPB *bpb, unsigned int currentCluster) {
+    DirCursor cursor;
+    DIR *dirEntry;
+
+    // loop through each entry of each cluster in the chain, assembling long names
+    LfnState lfn;
+    char entryName[NAME_MAX_BYTES];
+    lfn_reset(&lfn);
+    dir_open(bpb, &cursor, currentCluster);
+    while ((dirEntry = dir_next(fp, bpb, &cursor)) != NULL) {
+        // a never-used entry marks the end of the directory
+        if (dirEntry->DIR_Name[0] == 0x00) {
+            break;
+        }
+        // skip deleted and long name entries
+        if (lfn_scan(&lfn, dirEntry, cursor.offset, entryName) == 0) {
+            continue;
+        }
 
-        // go through each directory entry in the cluster
-        for (unsigned int offset = 0; offset < bytesPerCluster; offset += sizeof(DIR)) {
-            fread(&dirEntry, sizeof(DIR), 1, fp);
+        // check if file or directory
+        if ((dirEntry->DIR_Attr & 0x10) == 0 && (dirEntry->DIR_Attr & 0x20) == 0) {
+            continue;
+        }
+        fprintf(session->out, "%s\n", entryName);  // print
+    }
+    dir_close(&cursor);
+}
 
-            // skip unused or deleted directories
-            if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-                continue;
-            }
+// this session's handle on the file whose entry is at entryPos, or NULL
+OpenFile *open_handle(long entryPos) {
+    for (int i = 0; i < session->openFileCount; i++) {
+        if (session->openFiles[i].entryPos == entryPos) {
+            return &session->openFiles[i];
+        }
+    }
+    return NULL;
+}
 
-            //
-            for (int i = 0; i < 11; ++i) {
-                if (dirEntry.DIR_Name[i] == ' ') {
-                    dirEntry.DIR_Name[i] = '\0';
-                    break;
-                }
-            }
+// open-file entry for filename in the directory at currentCluster, or NULL;
+// matched by directory entry, so either the long or the short name finds it
+OpenFile *find_open_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+    long entryPos;
+    if (!dir_lookup(fp, bpb, currentCluster, filename, NULL, &entryPos)) {
+        return NULL;
+    }
+    return open_handle(entryPos);
+}
 
-            // check if we found the right directory and it is actually a directory
-            if (strcmp((char *)dirEntry.DIR_Name, dirName) == 0) {
-                // Check if the entry is a directory
-                if (dirEntry.DIR_Attr & 0x10) {
-                    *currentCluster = dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16);
-                    found = 1;
-                    break;
-                } else {
-                    printf("Error: '%s' is not a directory.\n", dirName);
-                    return;
-                }
+// another --serve session holding a handle on the file whose entry is at entryPos
+int open_elsewhere(long entryPos) {
+    for (int s = 0; s < SERVE_MAX_SESSIONS; s++) {
+        Shell *other = sessions[s];
+        for (int i = 0; other != NULL && other != session && i < other->openFileCount; i++) {
+            if (other->openFiles[i].entryPos == entryPos) {
+                return 1;
             }
         }
+    }
+    return 0;
+}
 
-        if (found) {
-            update_cwd(path, dirName);
-            return;
+// another --serve session with any file open
+int files_open_elsewhere(void) {
+    for (int s = 0; s < SERVE_MAX_SESSIONS; s++) {
+        if (sessions[s] != NULL && sessions[s] != session && sessions[s]->openFileCount > 0) {
+            return 1;
         }
-
-        unsigned int fatOffset = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec + (*currentCluster * 4);
-        fseek(fp, fatOffset, SEEK_SET);
-        fread(currentCluster, sizeof(unsigned int), 1, fp);
-        *currentCluster &= 0x0FFFFFFF;
-        clusterOffset = dataRegionStart + (*currentCluster - 2) * bytesPerCluster;
     }
+    return 0;
+}
 
-    printf("Error: Directory '%s' not found.\n", dirName);
+// another --serve session whose cwd is the directory at cluster
+int cwd_elsewhere(unsigned int cluster) {
+    for (int s = 0; s < SERVE_MAX_SESSIONS; s++) {
+        if (sessions[s] != NULL && sessions[s] != session && sessions[s]->currentCluster == cluster) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-// function to list directory entries in the current working directory
-void list_directory(FILE *fp, BPB *bpb, unsigned int currentCluster) {
-    DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset;
-
-    // if we are at the root directory (currentCluster == 0)
-    if (currentCluster == 0) {
-        clusterOffset = dataRegionStart;
-    } else {
-        // for normal directories, calculate the offset from the cluster number
-        clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+// the part of cwd below the directory at absPath: "" for absPath itself,
+// "/REST" for a directory under it, NULL if cwd is elsewhere
+static const char *cwd_below(const char *cwd, const char *absPath) {
+    size_t len = strlen(absPath);
+    if (strncasecmp(cwd, absPath, len) != 0 || (cwd[len] != '\0' && cwd[len] != '/')) {
+        return NULL;
     }
+    return cwd + len;
+}
 
-    // loop through each cluster
-    while (currentCluster < 0xFFFFFF8) { // 0xFFFFFF8 is an invalid cluster (end of chain)
-        fseek(fp, clusterOffset, SEEK_SET);
+// a session whose cwd would no longer fit once oldPath is called newPath
+int cwd_rename_too_long(const char *oldPath, const char *newPath) {
+    for (int s = -1; s < SERVE_MAX_SESSIONS; s++) {
+        Shell *sh = s < 0 ? session : sessions[s];
+        const char *rest = sh != NULL ? cwd_below(sh->cwd, oldPath) : NULL;
+        if (rest != NULL && strlen(newPath) + strlen(rest) >= PATH_MAX_LEN) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        // check each directory
-        for (unsigned int offset = 0; offset < bytesPerCluster; offset += sizeof(DIR)) {
-            fread(&dirEntry, sizeof(DIR), 1, fp);
+// the directory at oldPath is now called newPath: every session inside it
+// keeps its cwd cluster and gets the path rewritten to match
+void cwd_rename(const char *oldPath, const char *newPath) {
+    for (int s = -1; s < SERVE_MAX_SESSIONS; s++) {
+        Shell *sh = s < 0 ? session : sessions[s];
+        if (sh == NULL || (s >= 0 && sh == session)) {
+            continue;
+        }
+        const char *rest = cwd_below(sh->cwd, oldPath);
+        if (rest != NULL) {
+            char cwd[PATH_MAX_LEN];
+            snprintf(cwd, sizeof(cwd), "%s%s", newPath, rest);
+            strcpy(sh->cwd, cwd);
+        }
+    }
+}
 
-            // skip empty or deleted entries
-            if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
+// write len bytes to a host descriptor, retrying short writes
+int write_host(int fd, const unsigned char *data, unsigned int len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
                 continue;
             }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-            // Null-terminate DIR_Name for proper printing
-            for (int i = 0; i < 11; ++i) {
-                if (dirEntry.DIR_Name[i] == ' ') {
-                    dirEntry.DIR_Name[i] = '\0';
-                    break;
-                }
-            }
-
-            // check if file or directory
-            if ((dirEntry.DIR_Attr & 0x10) == 0 && (dirEntry.DIR_Attr & 0x20) == 0) {
-                continue;
-            }
-            printf("%s\n", dirEntry.DIR_Name);  // print
+// add the chain starting at first to the end of extents; on failure the
+// map is left as it was and the chain is freed
+static int map_new_chain(ExtentMap *extents, unsigned int first) {
+    unsigned int clusters = extents->clusters;
+    for (unsigned int c = first; c >= 2 && c < FAT_EOC_MIN; c = fat_get(c)) {
+        if (extent_append(extents, c) != 0) {
+            extent_truncate(extents, clusters);
+            alloc_free_chain(first);
+            return -1;
         }
+    }
+    return 0;
+}
 
-        // Move to the next cluster in the chain
-        unsigned int fatOffset = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec + (currentCluster * 4);
-        fseek(fp, fatOffset, SEEK_SET);
-        fread(&currentCluster, sizeof(unsigned int), 1, fp);
-        currentCluster &= 0x0FFFFFFF; // reset first high bits
-        clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster; // update offset for new cluster
+// make sure the file's chain covers its first end bytes, allocating the
+// missing clusters as one run; returns 0, -1 when the image is full or
+// EXTEND_NO_MEMORY when the extent map can't grow
+int extend_chain(BPB *bpb, OpenFile *file, unsigned int end) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    ExtentMap *extents = &file->extents;
+
+    unsigned int clustersNeeded = (end + bytesPerCluster - 1) / bytesPerCluster;
+    if (clustersNeeded <= extents->clusters) {
+        return 0;
+    }
+    unsigned int lastCluster = extent_last(extents);
+    unsigned int newCluster = alloc_run(clustersNeeded - extents->clusters);
+    if (newCluster == 0) {
+        return -1;
+    }
+    if (map_new_chain(extents, newCluster) != 0) {
+        return EXTEND_NO_MEMORY;
+    }
+    if (lastCluster != 0) {
+        fat_set(lastCluster, newCluster);
     }
+    return 0;
 }
 
-// function for open file
-void open_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, const char *flags, const char *fatImagePath) {
-    // check valid flag
-    if (strcmp(flags, "-r") != 0 && strcmp(flags, "-w") != 0 &&
-        strcmp(flags, "-rw") != 0 && strcmp(flags, "-wr") != 0) {
-        printf("Error: Invalid mode '%s'.\n", flags);
-        return;
+// reserve clusters so the chain in extents covers bytes, taking them as one
+// best-fit contiguous run when free space allows. The file size is left
+// alone; the chain past it is the reservation, and later writes fill it
+// without allocating. Returns 0, -1 when the image is full or
+// EXTEND_NO_MEMORY when the extent map can't grow
+int preallocate(FILE *fp, BPB *bpb, ExtentMap *extents, long entryPos, unsigned int bytes) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int clustersNeeded = (bytes + bytesPerCluster - 1) / bytesPerCluster;
+    if (clustersNeeded <= extents->clusters) {
+        return 0;
     }
 
-    // check if the file is already open
-    for (int i = 0; i < openFileCount; i++) {
-        if (strcmp(openFiles[i].name, filename) == 0) {
-            printf("Error: File '%s' is already open.\n", filename);
-            return;
+    unsigned int count = clustersNeeded - extents->clusters;
+    unsigned int first = alloc_contiguous(count);
+    if (first == 0) {
+        first = alloc_run(count);
+        if (first == 0) {
+            return -1;
+        }
+        if (session->debugOutput) {
+            fprintf(session->out, "No free run of %u clusters; the reservation is fragmented.\n", count);
         }
     }
 
-    // check maximum open file limit
-    if (openFileCount >= MAX_OPEN_FILES) {
-        printf("Error: Maximum number of open files reached.\n");
-        return;
+    unsigned int lastCluster = extent_last(extents);
+    if (map_new_chain(extents, first) != 0) {
+        return EXTEND_NO_MEMORY;
+    }
+    if (lastCluster != 0) {
+        fat_set(lastCluster, first);
+    } else {
+        // empty file: the reservation becomes its first cluster
+        DIR dirEntry;
+        if (image_read(fp, entryPos, &dirEntry, sizeof(DIR)) == 0) {
+            dirEntry.DIR_FstClusLO = first & 0xFFFF;
+            dirEntry.DIR_FstClusHI = first >> 16;
+            journal_write(fp, entryPos, &dirEntry, sizeof(DIR));
+        }
     }
+    return 0;
+}
 
-    // search for the file in the current directory
+// function for fallocate: reserve space for a file without changing its size
+void fallocate_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, unsigned int bytes) {
     DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset;
-
-    // handle root directory differently
-    if (currentCluster == 0) {
-        clusterOffset = dataRegionStart;
+    long entryPos;
+    if (!dir_lookup(fp, bpb, currentCluster, filename, &dirEntry, &entryPos)) {
+        print_error("Error: File '%s' not found in the current directory.\n", filename);
+        return;
+    }
+    if (dirEntry.DIR_Attr & 0x10) {
+        print_error("Error: '%s' is a directory, not a file.\n", filename);
+        return;
+    }
+
+    // an open handle's extent map has to see the new clusters too
+    OpenFile *file = open_handle(entryPos);
+    ExtentMap local;
+    ExtentMap *extents = &local;
+    if (file != NULL) {
+        extents = &file->extents;
     } else {
-        clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+        extent_init(&local);
+        if (extent_build(&local, dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16)) != 0) {
+            extent_free(&local);
+            print_error("Error: Cluster chain of '%s' is damaged.\n", filename);
+            return;
+        }
     }
 
-    fseek(fp, clusterOffset, SEEK_SET);
+    int result = preallocate(fp, bpb, extents, entryPos, bytes);
+    if (result == EXTEND_NO_MEMORY) {
+        print_error("Error: Out of memory.\n");
+    } else if (result != 0) {
+        print_error("Error: No free clusters available.\n");
+    } else {
+        fprintf(session->out, "Reserved %u clusters in %u run(s) for '%s'.\n", extents->clusters, extents->count, filename);
+    }
 
-    for (unsigned int offset = 0; offset < bytesPerCluster; offset += sizeof(DIR)) {
-        fread(&dirEntry, sizeof(DIR), 1, fp);
+    if (file == NULL) {
+        extent_free(&local);
+    }
+}
 
-        // skip unused, deleted, or long name entries
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5 || (dirEntry.DIR_Attr & 0x0F) == 0x0F) {
-            continue;
+// split up to limit bytes of the file at position into one request per
+// contiguous run, reading into or writing from data; returns the number of
+// requests, at most IO_BATCH_RUNS, with the first cluster of each in clusters
+static int file_runs(BPB *bpb, OpenFile *file, unsigned int position, unsigned char *data, unsigned int limit,
+                     ImageIo *ios, unsigned int *clusters) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int done = 0;
+    int count = 0;
+
+    while (done < limit && count < IO_BATCH_RUNS) {
+        unsigned int clusterNumber;
+        unsigned int runLeft;
+        if (!extent_lookup(&file->extents, (position + done) / bytesPerCluster, &clusterNumber, &runLeft)) {
+            break;
         }
+        unsigned int clusterOffset = (position + done) % bytesPerCluster;
 
-        // Null-terminate and compare filename
-        char entryName[12] = {0};
-        strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-
-        // Remove trailing spaces
-        for (int i = 10; i >= 0; --i) {
-            if (entryName[i] == ' ') {
-                entryName[i] = '\0';
-            } else {
-                break;
-            }
+        unsigned long runBytes = (unsigned long)runLeft * bytesPerCluster - clusterOffset;
+        unsigned int chunk = limit - done;
+        if (chunk > runBytes) {
+            chunk = runBytes;
         }
 
-        // printf("entryName='%s' vs filename='%s'\n", entryName, filename);
+        ios[count].offset = cluster_offset(bpb, clusterNumber) + clusterOffset;
+        ios[count].buf = data + done;
+        ios[count].len = chunk;
+        clusters[count++] = clusterNumber;
+        done += chunk;
+    }
+    return count;
+}
 
-        if (strcmp(entryName, filename) == 0) {
-            if (dirEntry.DIR_Attr & 0x10) {
-                printf("Error: '%s' is a directory, not a file.\n", filename);
-                return;
-            }
+// move len bytes between data and the file at position, one I/O per
+// contiguous run, submitted in batches; returns the number of bytes transferred
+unsigned int file_io(FILE *fp, BPB *bpb, OpenFile *file, unsigned int position, void *data, unsigned int len, int writing) {
+    ImageIo ios[IO_BATCH_RUNS];
+    unsigned int clusters[IO_BATCH_RUNS];
+    unsigned int done = 0;
 
-            snprintf(openFiles[openFileCount].path, sizeof(openFiles[openFileCount].path), "./%s", fatImagePath);
+    while (done < len) {
+        int count = file_runs(bpb, file, position + done, (unsigned char *)data + done, len - done, ios, clusters);
+        if (count == 0) {
+            break;
+        }
+        int result = writing ? image_write_batch(fp, ios, count) : image_read_batch(fp, ios, count);
+        if (result != 0) {
+            print_error("Error: Failed to %s cluster %u.\n", writing ? "write" : "read", clusters[0]);
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            done += ios[i].len;
+        }
+    }
+    return done;
+}
 
-            // Add the file to the open file list
-            strcpy(openFiles[openFileCount].name, filename);
-            strcpy(openFiles[openFileCount].mode, flags + 1);  // Skip leading '-'
-            openFiles[openFileCount].offset = 0;
-            openFileCount++;
+// store the handle's size and first cluster in its directory entry
+void update_dir_entry(FILE *fp, OpenFile *file) {
+    DIR dirEntry;
+    if (image_read(fp, file->entryPos, &dirEntry, sizeof(DIR)) == 0) {
+        unsigned int firstCluster = file->extents.count ? file->extents.items[0].start : 0;
+        dirEntry.DIR_FileSize = file->fileSize;
+        dirEntry.DIR_FstClusLO = firstCluster & 0xFFFF;
+        dirEntry.DIR_FstClusHI = firstCluster >> 16;
+
+        // Write updated directory entry back to disk
+        journal_write(fp, file->entryPos, &dirEntry, sizeof(DIR));
+    }
+}
 
-            printf("File '%s' opened in mode '%s'.\n", filename, flags);
-            return;
-        }
+// write out whatever the handle has buffered, then the directory entry
+void flush_write_buffer(FILE *fp, BPB *bpb, OpenFile *file) {
+    if (file->writeLen == 0) {
+        return;
     }
-    printf("Error: File '%s' not found in the current directory.\n", filename);
+    file_io(fp, bpb, file, file->writeStart, file->writeBuf, file->writeLen, 1);
+    file->writeLen = 0;
+    file->readLen = 0;  // the window may hold what these bytes replaced
+    update_dir_entry(fp, file);
 }
 
-// function for close file
-void close_file(const char *filename) {
-    int found = 0;
+// function for open file; reserveBytes > 0 preallocates a write-mode file
+void open_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, const char *flags, const char *fatImagePath, unsigned int reserveBytes) {
+    // check valid flag
+    if (strcmp(flags, "-r") != 0 && strcmp(flags, "-w") != 0 &&
+        strcmp(flags, "-rw") != 0 && strcmp(flags, "-wr") != 0) {
+        print_error("Error: Invalid mode '%s'.\n", flags);
+        return;
+    }
 
-    // Search for the file in the open file list
-    for (int i = 0; i < openFileCount; i++) {
-        if (strcmp(openFiles[i].name, filename) == 0) {
-            found = 1;
+    if (reserveBytes > 0 && strchr(flags, 'w') == NULL) {
+        print_error("Error: Space can only be reserved for a file opened for writing.\n");
+        return;
+    }
 
-            // Shift the remaining files in the array to remove the entry
-            for (int j = i; j < openFileCount - 1; j++) {
-                openFiles[j] = openFiles[j + 1];
-            }
+    // check maximum open file limit
+    if (session->openFileCount >= MAX_OPEN_FILES) {
+        print_error("Error: Maximum number of open files reached.\n");
+        return;
+    }
+
+    // search for the file in the current directory
+    DIR dirEntry;
+    long entryPos;
+    if (!dir_lookup(fp, bpb, currentCluster, filename, &dirEntry, &entryPos)) {
+        print_error("Error: File '%s' not found in the current directory.\n", filename);
+        return;
+    }
+    if (dirEntry.DIR_Attr & 0x10) {
+        print_error("Error: '%s' is a directory, not a file.\n", filename);
+        return;
+    }
+    if (open_handle(entryPos) != NULL) {
+        print_error("Error: File '%s' is already open.\n", filename);
+        return;
+    }
+    // handles keep their own size, chain and buffers, so a file has one at a time
+    if (open_elsewhere(entryPos)) {
+        print_error("Error: File '%s' is open in another session.\n", filename);
+        return;
+    }
 
-            // Decrease the count of open files
-            openFileCount--;
+    OpenFile *file = &session->openFiles[session->openFileCount];
+    snprintf(file->path, sizeof(file->path), "./%s", fatImagePath);
 
-            printf("File '%s' closed successfully.\n", filename);
-            break;
-        }
+    // map the cluster chain once so reads, writes and seeks never walk the FAT again
+    extent_init(&file->extents);
+    if (extent_build(&file->extents, dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16)) != 0) {
+        extent_free(&file->extents);
+        print_error("Error: Cluster chain of '%s' is damaged.\n", filename);
+        return;
     }
 
+    // Add the file to the open file list
+    strcpy(file->name, filename);
+    strcpy(file->mode, flags + 1);  // Skip leading '-'
+    file->offset = 0;
+    file->dirCluster = currentCluster;
+    file->entryPos = entryPos;
+    file->fileSize = dirEntry.DIR_FileSize;
+    file->writeBuf = NULL;
+    file->writeStart = 0;
+    file->writeLen = 0;
+    file->readBuf = NULL;
+    file->readStart = 0;
+    file->readLen = 0;
+    file->readWindow = 0;
+    file->readNext = 0;
+    file->readAdvised = 0;
+    session->openFileCount++;
+
+    fprintf(session->out, "File '%s' opened in mode '%s'.\n", filename, flags);
+    int result = reserveBytes > 0 ? preallocate(fp, bpb, &file->extents, entryPos, reserveBytes) : 0;
+    if (result == EXTEND_NO_MEMORY) {
+        print_error("Error: Out of memory.\n");
+    } else if (result != 0) {
+        print_error("Error: No free clusters available.\n");
+    }
+}
+
+// function for close file
+void close_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+    // Search for the file in the open file list
+    OpenFile *file = find_open_file(fp, bpb, currentCluster, filename);
+
     // If file was not found, print an error
-    if (!found) {
-        printf("Error: File '%s' is not open or does not exist.\n", filename);
+    if (file == NULL) {
+        print_error("Error: File '%s' is not open or does not exist.\n", filename);
+        return;
+    }
+
+    flush_write_buffer(fp, bpb, file);
+    free(file->writeBuf);
+    free(file->readBuf);
+    extent_free(&file->extents);
+
+    // Shift the remaining files in the array to remove the entry
+    for (int j = file - session->openFiles; j < session->openFileCount - 1; j++) {
+        session->openFiles[j] = session->openFiles[j + 1];
     }
+
+    // Decrease the count of open files
+    session->openFileCount--;
+
+    fprintf(session->out, "File '%s' closed successfully.\n", filename);
 }
 
 // function for lsof
 void lsof() {
-    if (openFileCount == 0) {
-        printf("No files are currently opened.\n");
+    if (session->openFileCount == 0) {
+        fprintf(session->out, "No files are currently opened.\n");
         return;
     }
 
     // Print header for the open files list
-    printf("%-5s %-12s %-5s %-10s %-50s\n", "Index", "Filename", "Mode", "Offset", "Path");
+    fprintf(session->out, "%-5s %-12s %-5s %-10s %-50s\n", "Index", "Filename", "Mode", "Offset", "Path");
 
     // Loop through all open files and print their details
-    for (int i = 0; i < openFileCount; i++) {
-        printf("%-5d %-12s %-5s %-10u %-50s\n", 
+    for (int i = 0; i < session->openFileCount; i++) {
+        fprintf(session->out, "%-5d %-12s %-5s %-10u %-50s\n", 
                i,                           // Index of the open file
-               openFiles[i].name,           // Filename
-               openFiles[i].mode,           // Mode
-               openFiles[i].offset,         // Offset
-               openFiles[i].path
+               session->openFiles[i].name,           // Filename
+               session->openFiles[i].mode,           // Mode
+               session->openFiles[i].offset,         // Offset
+               session->openFiles[i].path
                );
     }
 }
@@ -415,833 +668,1847 @@ void lsof() {
 // Function to handle lseek [FILENAME] [OFFSET] in a single function
 void lseek_file(const char *filename, unsigned int offset, FILE *fp, BPB *bpb, unsigned int currentCluster) {
     // Search for the file in the open files list
-    int found = 0;
-    unsigned int fileSize = 0;
+    OpenFile *file = find_open_file(fp, bpb, currentCluster, filename);
+
+    // If file was not found in the open files list
+    if (file == NULL) {
+        print_error("Error: File '%s' is not open or does not exist.\n", filename);
+        return;
+    }
+
+    // Check if the offset exceeds the file size
+    if (offset > file->fileSize) {
+        print_error("Error: Offset exceeds the size of the file '%s'.\n", filename);
+        return;
+    }
 
-    for (int i = 0; i < openFileCount; i++) {
-        if (strcmp(openFiles[i].name, filename) == 0) {
-            found = 1;
+    // seeking away from the buffered range ends the run of small writes
+    if (offset < file->writeStart || offset > file->writeStart + file->writeLen) {
+        flush_write_buffer(fp, bpb, file);
+    }
 
-            // Get the file size from the directory entry
-            unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-            unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-            unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-            unsigned int clusterOffset = (currentCluster == 0) ? dataRegionStart : dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+    // Update the offset for the file in the open files list
+    file->offset = offset;
+    fprintf(session->out, "Offset of file '%s' set to %u bytes.\n", filename, offset);
+}
 
-            // Read the directory entry for the given filename
-            DIR dirEntry;
-            fseek(fp, clusterOffset, SEEK_SET);
+// explain why a read or write can't find an open handle for filename
+void report_not_open(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+    DIR dirEntry;
+    if (!dir_lookup(fp, bpb, currentCluster, filename, &dirEntry, NULL)) {
+        print_error("Error: File '%s' not found in the current directory.\n", filename);
+    } else if (dirEntry.DIR_Attr & 0x10) {
+        print_error("Error: '%s' is a directory, not a file.\n", filename);
+    } else {
+        print_error("Error: File '%s' not found in the open files list.\n", filename);
+    }
+}
 
-            for (unsigned int entryOffset = 0; entryOffset < bytesPerCluster; entryOffset += sizeof(DIR)) {
-                fread(&dirEntry, sizeof(DIR), 1, fp);
+// widen the handle's read-ahead window for another sequential fetch: one
+// cluster at first, doubling up to READAHEAD_BYTES; returns its size in bytes
+static unsigned int readahead_grow(BPB *bpb, OpenFile *file) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int limit = READAHEAD_BYTES > bytesPerCluster ? READAHEAD_BYTES / bytesPerCluster : 1;
+    file->readWindow = file->readWindow == 0 ? 1 : file->readWindow * 2;
+    if (file->readWindow > limit) {
+        file->readWindow = limit;
+    }
+    return file->readWindow * bytesPerCluster;
+}
 
-                // Skip unused, deleted, or long name entries
-                if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5 || (dirEntry.DIR_Attr & 0x0F) == 0x0F) {
-                    continue;
-                }
+// load the window with the clusters from position's cluster on, as one
+// batch, stopping at the end of the file or the buffered writes; returns 0
+// once the window holds position
+static int readahead_fill(FILE *fp, BPB *bpb, OpenFile *file, unsigned int position, ImageIo *ios, unsigned int *clusters) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int start = position - position % bytesPerCluster;
+    unsigned int len = readahead_grow(bpb, file);
+    if (len > file->fileSize - start) {
+        len = file->fileSize - start;
+    }
+    if (file->writeLen > 0 && file->writeStart > start && len > file->writeStart - start) {
+        len = file->writeStart - start;
+    }
 
-                // Null-terminate and compare filename
-                char entryName[12] = {0};
-                strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-
-                // Remove trailing spaces
-                for (int i = 10; i >= 0; --i) {
-                    if (entryName[i] == ' ') {
-                        entryName[i] = '\0';
-                    } else {
-                        break;
-                    }
-                }
+    file->readLen = 0;
+    if (file->readBuf == NULL) {
+        unsigned int size = READAHEAD_BYTES > bytesPerCluster ? READAHEAD_BYTES / bytesPerCluster * bytesPerCluster : bytesPerCluster;
+        file->readBuf = (unsigned char *)malloc(size);
+        if (file->readBuf == NULL) {
+            return -1;
+        }
+    }
+    int count = file_runs(bpb, file, start, file->readBuf, len, ios, clusters);
+    if (count == 0 || image_read_batch(fp, ios, count) != 0) {
+        return -1;
+    }
+    file->readStart = start;
+    for (int i = 0; i < count; i++) {
+        file->readLen += ios[i].len;
+    }
+    return position - start < file->readLen ? 0 : -1;
+}
 
-                if (strcmp(entryName, filename) == 0) {
-                    // File found, retrieve the file size from the directory entry
-                    fileSize = dirEntry.DIR_FileSize;
-                    break;
-                }
-            }
+// where reads are served without a copy (a mapped image, or raw output),
+// ask the kernel to start fetching the runs after position instead; a new
+// hint goes out once reading gets halfway into the last one
+static void readahead_advise(FILE *fp, BPB *bpb, OpenFile *file, unsigned int position) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    if (position >= file->fileSize ||
+        (position < file->readAdvised && file->readAdvised - position > file->readWindow * bytesPerCluster / 2)) {
+        return;
+    }
+    unsigned int end = position + readahead_grow(bpb, file);
+    if (end > file->fileSize || end < position) {
+        end = file->fileSize;
+    }
+    for (unsigned int at = position; at < end; ) {
+        unsigned int clusterNumber;
+        unsigned int runLeft;
+        if (!extent_lookup(&file->extents, at / bytesPerCluster, &clusterNumber, &runLeft)) {
             break;
         }
+        unsigned int clusterOffset = at % bytesPerCluster;
+        unsigned long runBytes = (unsigned long)runLeft * bytesPerCluster - clusterOffset;
+        unsigned int chunk = end - at < runBytes ? end - at : (unsigned int)runBytes;
+        image_advise(fp, cluster_offset(bpb, clusterNumber) + clusterOffset, chunk);
+        at += chunk;
     }
+    file->readAdvised = end;
+}
 
-    // If file was not found in the open files list
-    if (!found) {
-        printf("Error: File '%s' is not open or does not exist.\n", filename);
+// function to read file; with outFd >= 0 the bytes go to that host descriptor
+// unchanged (raw mode), otherwise they're printed with the debug lines
+void read_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, unsigned int size, int outFd) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+
+    // Validate the file is open
+    OpenFile *fileEntry = find_open_file(fp, bpb, currentCluster, filename);
+    if (fileEntry == NULL) {
+        report_not_open(fp, bpb, currentCluster, filename);
         return;
     }
-
-    // Check if the offset exceeds the file size
-    if (offset > fileSize) {
-        printf("Error: Offset exceeds the size of the file '%s'.\n", filename);
+    if (strcmp(fileEntry->mode, "r") != 0 && strcmp(fileEntry->mode, "wr") != 0 && strcmp(fileEntry->mode, "rw") != 0) {
+        print_error("Error: '%s' is not open in a valid read mode. Current mode: '%s'.\n", filename, fileEntry->mode);
         return;
     }
 
-    // Update the offset for the file in the open files list
-    for (int i = 0; i < openFileCount; i++) {
-        if (strcmp(openFiles[i].name, filename) == 0) {
-            openFiles[i].offset = offset;
-            printf("Offset of file '%s' set to %u bytes.\n", filename, offset);
-            return;
-        }
+    unsigned int storedOffset = fileEntry->offset;
+    unsigned int fileCluster = fileEntry->extents.count ? fileEntry->extents.items[0].start : 0;
+    if (outFd < 0 && session->debugOutput) {
+        fprintf(session->out, "File '%s' starts at cluster %u, offset %u\n", filename, fileCluster, storedOffset);
     }
-}
 
-// function to read file
-void read_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, unsigned int size) {
-    DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-
-    // Locate the file in the directory
-    fseek(fp, dataRegionStart + (currentCluster - 2) * bytesPerCluster, SEEK_SET);
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            continue; // Skip empty or deleted entries
-        }
-
-        char entryName[12] = {0};
-        strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-        for (int i = 10; i >= 0; --i) {
-            if (entryName[i] == ' ') {
-                entryName[i] = '\0';
+    // never read past the end of the file
+    if (size > fileEntry->fileSize - storedOffset) {
+        size = fileEntry->fileSize - storedOffset;
+    }
+
+    // raw output bypasses the output stream's buffer, so flush what's already in it
+    if (outFd >= 0) {
+        fflush(session->out);
+    }
+
+    // reads that pick up where the last one stopped are streaming through the
+    // file: serve them from the read-ahead window, or hint the kernel ahead
+    int sequential = storedOffset == fileEntry->readNext;
+    if (!sequential) {
+        fileEntry->readWindow = 0;
+        fileEntry->readAdvised = 0;
+    }
+    int direct = outFd >= 0 || image_is_mapped();
+    unsigned char *buffer = NULL;  // for reads outside the window, allocated when first needed
+    ImageIo ios[IO_BATCH_RUNS];
+    unsigned int clusters[IO_BATCH_RUNS];
+    unsigned int bytesRead = 0;
+    unsigned int writeEnd = fileEntry->writeStart + fileEntry->writeLen;
+
+    while (bytesRead < size) {
+        unsigned int position = storedOffset + bytesRead;
+        unsigned int bytesToRead = size - bytesRead;
+
+        // bytes still sitting in the write buffer are newer than the image
+        if (fileEntry->writeLen > 0 && position >= fileEntry->writeStart && position < writeEnd) {
+            if (bytesToRead > writeEnd - position) {
+                bytesToRead = writeEnd - position;
+            }
+            const unsigned char *data = fileEntry->writeBuf + (position - fileEntry->writeStart);
+            if (outFd >= 0) {
+                if (write_host(outFd, data, bytesToRead) != 0) {
+                    fprintf(stderr, "Error: Failed to write buffered data: %s\n", strerror(errno));
+                    session->commandFailed = 1;
+                    break;
+                }
             } else {
-                break;
+                if (session->debugOutput) {
+                    fprintf(session->out, "Read %u bytes from the write buffer\n", bytesToRead);
+                }
+                fwrite(data, 1, bytesToRead, session->out);
             }
+            bytesRead += bytesToRead;
+            continue;
+        }
+        if (fileEntry->writeLen > 0 && position < fileEntry->writeStart && bytesToRead > fileEntry->writeStart - position) {
+            bytesToRead = fileEntry->writeStart - position;
         }
 
-        if (strcmp(entryName, filename) == 0) {
-            if (dirEntry.DIR_Attr & 0x10) {
-                printf("Error: '%s' is a directory, not a file.\n", filename);
-                return;
-            }
+        // find the cluster holding the offset and how far the contiguous run goes
+        unsigned int clusterNumber;
+        unsigned int runLeft;
+        if (!extent_lookup(&fileEntry->extents, position / bytesPerCluster, &clusterNumber, &runLeft)) {
+            break;
+        }
+        unsigned int clusterOffset = position % bytesPerCluster;
+        unsigned int wanted = bytesToRead;
+
+        // read the whole run (or what's left of the request) with one I/O
+        unsigned long runBytes = (unsigned long)runLeft * bytesPerCluster - clusterOffset;
+        if (bytesToRead > runBytes) {
+            bytesToRead = runBytes;
+        }
+        long dataOffset = cluster_offset(bpb, clusterNumber) + clusterOffset;
 
-            // Validate the file is open
-            int fileFound = 0;
-            OpenFile *fileEntry = NULL;
-            for (int i = 0; i < MAX_OPEN_FILES; i++) {
-                if (strcmp(openFiles[i].name, filename) == 0) {
-                    fileFound = 1;
-                    fileEntry = &openFiles[i];
-                    if (strcmp(fileEntry->mode, "r") != 0 && strcmp(fileEntry->mode, "wr") != 0 && strcmp(fileEntry->mode, "rw") != 0) {
-                        printf("Error: '%s' is not open in a valid read mode. Current mode: '%s'.\n", filename, fileEntry->mode);
-                        return;
-                    }
+        if (outFd >= 0) {
+            if (image_copy_out(fp, dataOffset, bytesToRead, outFd) != 0) {
+                fprintf(stderr, "Error: Failed to copy cluster %u: %s\n", clusterNumber, strerror(errno));
+                session->commandFailed = 1;
+                break;
+            }
+        } else if (direct) {
+            unsigned char *data = (unsigned char *)image_map(fp, dataOffset, bytesToRead, NULL);
+            if (data == NULL) {
+                print_error("Error: Failed to read cluster %u.\n", clusterNumber);
+                break;
+            }
+            if (session->debugOutput) {
+                fprintf(session->out, "Read %u bytes from cluster %u\n", bytesToRead, clusterNumber);
+            }
+            fwrite(data, 1, bytesToRead, session->out);
+        } else if ((position >= fileEntry->readStart && position - fileEntry->readStart < fileEntry->readLen) ||
+                   (sequential && readahead_fill(fp, bpb, fileEntry, position, ios, clusters) == 0)) {
+            unsigned int windowLeft = fileEntry->readStart + fileEntry->readLen - position;
+            if (bytesToRead > windowLeft) {
+                bytesToRead = windowLeft;
+            }
+            if (session->debugOutput) {
+                fprintf(session->out, "Read %u bytes from cluster %u\n", bytesToRead, clusterNumber);
+            }
+            fwrite(fileEntry->readBuf + (position - fileEntry->readStart), 1, bytesToRead, session->out);
+        } else {
+            // through stdio, fetch up to a buffer's worth of runs as one batch
+            if (buffer == NULL) {
+                buffer = (unsigned char *)image_io_buffer(MAX_IO_BYTES);
+                if (buffer == NULL) {
+                    print_error("Error: Out of memory.\n");
                     break;
                 }
             }
-            if (!fileFound || fileEntry == NULL) {
-                printf("Error: File '%s' not found in the open files list.\n", filename);
-                return;
+            int count = file_runs(bpb, fileEntry, position, buffer, wanted < MAX_IO_BYTES ? wanted : MAX_IO_BYTES, ios, clusters);
+            if (image_read_batch(fp, ios, count) != 0) {
+                print_error("Error: Failed to read cluster %u.\n", clusterNumber);
+                break;
             }
-
-            unsigned int fileCluster = dirEntry.DIR_FstClusLO;
-            unsigned int storedOffset = fileEntry->offset;
-            printf("File '%s' starts at cluster %u, offset %u\n", filename, fileCluster, storedOffset);
-
-            // Adjust starting cluster and offset
-            unsigned int clusterNumber = fileCluster;
-            unsigned int clusterOffset = storedOffset % bytesPerCluster;
-            unsigned int clustersToSkip = storedOffset / bytesPerCluster;
-
-            // Skip clusters based on storedOffset
-            for (unsigned int i = 0; i < clustersToSkip; i++) {
-                unsigned int fatOffset = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec + (clusterNumber * 4);
-                fseek(fp, fatOffset, SEEK_SET);
-                fread(&clusterNumber, sizeof(unsigned int), 1, fp);
-                clusterNumber &= 0x0FFFFFFF;
-                if (clusterNumber == 0x0FFFFFF8 || clusterNumber == 0x0FFFFFFF) {
-                    printf("Error: Offset exceeds file size.\n");
-                    return;
+            bytesToRead = 0;
+            for (int i = 0; i < count; i++) {
+                if (session->debugOutput) {
+                    fprintf(session->out, "Read %zu bytes from cluster %u\n", ios[i].len, clusters[i]);
                 }
+                fwrite(ios[i].buf, 1, ios[i].len, session->out);
+                bytesToRead += ios[i].len;
             }
+        }
 
-            unsigned char buffer[bytesPerCluster];
-            unsigned int bytesRead = 0;
+        bytesRead += bytesToRead;
+    }
+    image_io_buffer_free(buffer);
 
-            while (bytesRead < size) {
-                unsigned int clusterDataOffset = dataRegionStart + (clusterNumber - 2) * bytesPerCluster + clusterOffset;
-                fseek(fp, clusterDataOffset, SEEK_SET);
+    // Update the offset in the file entry
+    fileEntry->offset += bytesRead;
+    fileEntry->readNext = fileEntry->offset;
+    if (direct && sequential) {
+        readahead_advise(fp, bpb, fileEntry, fileEntry->offset);
+    }
+    if (outFd < 0) {
+        fprintf(session->out, "\n");
+    }
+}
 
-                unsigned int bytesToRead = (size - bytesRead < bytesPerCluster - clusterOffset) 
-                                           ? size - bytesRead 
-                                           : bytesPerCluster - clusterOffset;
-                fread(buffer, 1, bytesToRead, fp);
+// function for write file; small writes collect in the handle's buffer and
+// reach the image a cluster at a time when it fills or gets flushed
+void update_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, const char *string) {
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int bufferSize = (WRITE_BUFFER_BYTES + bytesPerCluster - 1) / bytesPerCluster * bytesPerCluster;
 
-                printf("Read %u bytes from cluster %u\n", bytesToRead, clusterNumber);
-                for (unsigned int i = 0; i < bytesToRead; i++) {
-                    printf("%c", buffer[i]);
-                }
+    // Validate the file is open for writing
+    OpenFile *fileEntry = find_open_file(fp, bpb, currentCluster, filename);
+    if (fileEntry == NULL) {
+        report_not_open(fp, bpb, currentCluster, filename);
+        return;
+    }
+    if (strcmp(fileEntry->mode, "w") != 0 && strcmp(fileEntry->mode, "wr") != 0 && strcmp(fileEntry->mode, "rw") != 0) {
+        print_error("Error: '%s' is not open in a valid write mode. Current mode: '%s'.\n", filename, fileEntry->mode);
+        return;
+    }
 
-                bytesRead += bytesToRead;
-                clusterOffset = 0; // Reset for subsequent clusters
+    unsigned int storedOffset = fileEntry->offset;
+    unsigned int stringLen = strlen(string);
+    unsigned int bytesWritten = 0;
+    fileEntry->readLen = 0;
 
-                // Move to the next cluster
-                unsigned int fatOffset = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec + (clusterNumber * 4);
-                fseek(fp, fatOffset, SEEK_SET);
-                fread(&clusterNumber, sizeof(unsigned int), 1, fp);
-                clusterNumber &= 0x0FFFFFFF;
+    // clusters are claimed now so a full image is reported by this write,
+    // not by whichever later command happens to flush
+    int result = extend_chain(bpb, fileEntry, storedOffset + stringLen);
+    if (result == EXTEND_NO_MEMORY) {
+        print_error("Error: Out of memory.\n");
+        return;
+    } else if (result != 0) {
+        print_error("Error: No free clusters available.\n");
+        return;
+    }
 
-                if (clusterNumber == 0x0FFFFFF8 || clusterNumber == 0x0FFFFFFF) {
-                    break; // End of file
-                }
+    // a write that doesn't continue or overlap the buffered range flushes it
+    if (fileEntry->writeLen > 0 &&
+        (storedOffset < fileEntry->writeStart || storedOffset > fileEntry->writeStart + fileEntry->writeLen ||
+         storedOffset + stringLen > fileEntry->writeStart + bufferSize)) {
+        flush_write_buffer(fp, bpb, fileEntry);
+    }
+
+    if (fileEntry->writeLen == 0 && storedOffset % bytesPerCluster + stringLen > bufferSize) {
+        // too big to buffer: straight to the clusters
+        bytesWritten = file_io(fp, bpb, fileEntry, storedOffset, (char *)string, stringLen, 1);
+        if (storedOffset + bytesWritten > fileEntry->fileSize) {
+            fileEntry->fileSize = storedOffset + bytesWritten;
+        }
+        update_dir_entry(fp, fileEntry);
+    } else {
+        if (fileEntry->writeBuf == NULL) {
+            fileEntry->writeBuf = (unsigned char *)malloc(bufferSize);
+            if (fileEntry->writeBuf == NULL) {
+                // the clusters claimed above stay with the file as a reservation
+                print_error("Error: Out of memory.\n");
+                return;
+            }
+        }
+        if (fileEntry->writeLen == 0) {
+            // start the buffer on a cluster boundary so flushes cover whole
+            // clusters; the bytes before the offset come from the image
+            fileEntry->writeStart = storedOffset - storedOffset % bytesPerCluster;
+            fileEntry->writeLen = storedOffset - fileEntry->writeStart;
+            if (fileEntry->writeLen > 0) {
+                file_io(fp, bpb, fileEntry, fileEntry->writeStart, fileEntry->writeBuf, fileEntry->writeLen, 0);
             }
+        }
+        memcpy(fileEntry->writeBuf + (storedOffset - fileEntry->writeStart), string, stringLen);
+        if (storedOffset + stringLen - fileEntry->writeStart > fileEntry->writeLen) {
+            fileEntry->writeLen = storedOffset + stringLen - fileEntry->writeStart;
+        }
+        bytesWritten = stringLen;
+        if (storedOffset + bytesWritten > fileEntry->fileSize) {
+            fileEntry->fileSize = storedOffset + bytesWritten;
+        }
+        if (fileEntry->writeLen == bufferSize) {
+            flush_write_buffer(fp, bpb, fileEntry);
+        }
+    }
+    storedOffset += bytesWritten;
 
-            // Update the offset in the file entry
-            fileEntry->offset += bytesRead;
-            printf("\n");
-            //printf("\nFinished reading '%s'. Total bytes read: %u. Updated offset: %u.\n", filename, bytesRead, fileEntry->offset);
-            return;
+    // Update the file's offset
+    fileEntry->offset = storedOffset;
+
+    fprintf(session->out, "Finished writing to '%s'. Total bytes written: %u. Updated offset: %u.\n", filename, bytesWritten, storedOffset);
+}
+ 
+int file_exists(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+    return dir_lookup(fp, bpb, currentCluster, filename, NULL, NULL);
+}
+
+void rename_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *oldName, const char *newName) {
+    fprintf(session->out, "Renaming file '%s' to '%s'.\n", oldName, newName);
+    long entryPos;
+    if (!dir_lookup(fp, bpb, currentCluster, oldName, NULL, &entryPos)) {
+        print_error("Error: File '%s' not found.\n", oldName);
+        return;
+    }
+    // a handle elsewhere would be left holding a name that no longer exists
+    if (open_elsewhere(entryPos)) {
+        print_error("Error: File '%s' is open in another session.\n", oldName);
+        return;
+    }
+
+    if (file_exists(fp, bpb, currentCluster, newName)) {
+        print_error("Error: File '%s' already exists.\n", newName);
+        return;
+    }
+
+    if (!lfn_name_valid(newName)) {
+        print_error("Error: '%s' is not a valid file name.\n", newName);
+        return;
+    }
+
+    // Found the file to rename; a long name may need a new run of entries
+    if (dir_rename_entry(fp, bpb, currentCluster, oldName, newName) != 0) {
+        print_error("Error: No space in the directory to rename '%s'.\n", oldName);
+        return;
+    }
+
+    // our own handle follows the file to its new name and, if it moved, its new entry
+    long newPos = entryPos;
+    dir_lookup(fp, bpb, currentCluster, newName, NULL, &newPos);
+    for (int i = 0; i < session->openFileCount; i++) {
+        OpenFile *file = &session->openFiles[i];
+        if (file->entryPos == entryPos) {
+            file->entryPos = newPos;
+            snprintf(file->name, sizeof(file->name), "%s", newName);
         }
     }
 
-    printf("Error: File '%s' not found in the current directory.\n", filename);
+    fprintf(session->out, "File '%s' renamed to '%s' successfully.\n", oldName, newName);
 }
 
-// function for write file
-void update_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, const char *string) {
+void delete_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
     DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int fatStart = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec;
-
-    // Locate the file in the directory
-    fseek(fp, dataRegionStart + (currentCluster - 2) * bytesPerCluster, SEEK_SET);
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            continue; // Skip empty or deleted entries
-        }
-
-        char entryName[12] = {0};
-        strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-        for (int i = 10; i >= 0; --i) {
-            if (entryName[i] == ' ') {
-                entryName[i] = '\0';
-            } else {
-                break;
-            }
-        }
+    long entryPos;
+    if (!dir_lookup(fp, bpb, currentCluster, filename, &dirEntry, &entryPos)) {
+        print_error("Error: File '%s' not found.\n", filename);
+        return;
+    }
+    // a handle's buffered writes would land in the freed clusters on close
+    if (open_handle(entryPos) != NULL) {
+        print_error("Error: File '%s' is open; close it first.\n", filename);
+        return;
+    }
+    if (open_elsewhere(entryPos)) {
+        print_error("Error: File '%s' is open in another session.\n", filename);
+        return;
+    }
 
-        if (strcmp(entryName, filename) == 0) {
-            if (dirEntry.DIR_Attr & 0x10) {
-                printf("Error: '%s' is a directory, not a file.\n", filename);
-                return;
-            }
+    // Mark directory entry (and any long name entries) as deleted
+    unsigned int firstCluster = (dirEntry.DIR_FstClusHI << 16) | dirEntry.DIR_FstClusLO;
+    dir_remove_entry(fp, bpb, currentCluster, filename);
 
-            // Validate the file is open for writing
-            int fileFound = 0;
-            OpenFile *fileEntry = NULL;
-            for (int i = 0; i < MAX_OPEN_FILES; i++) {
-                if (strcmp(openFiles[i].name, filename) == 0) {
-                    fileFound = 1;
-                    fileEntry = &openFiles[i];
-                    if (strcmp(fileEntry->mode, "w") != 0 && strcmp(fileEntry->mode, "wr") != 0 && strcmp(fileEntry->mode, "rw") != 0) {
-                        printf("Error: '%s' is not open in a valid write mode. Current mode: '%s'.\n", filename, fileEntry->mode);
-                        return;
-                    }
-                    break;
-                }
-            }
-            if (!fileFound || fileEntry == NULL) {
-                printf("Error: File '%s' not found in the open files list.\n", filename);
-                return;
-            }
+    // Deallocate clusters
+    alloc_free_chain(firstCluster);
 
-            unsigned int fileCluster = dirEntry.DIR_FstClusLO;
-            unsigned int storedOffset = fileEntry->offset;
-            unsigned int stringLen = strlen(string);
-            unsigned int bytesToWrite = stringLen;
-            unsigned int bytesWritten = 0;
-
-            while (bytesToWrite > 0) {
-                unsigned int clusterNumber = fileCluster;
-                unsigned int clusterOffset = storedOffset % bytesPerCluster;
-
-                // Find or allocate a cluster
-                if (storedOffset >= dirEntry.DIR_FileSize) {
-                    // Extend the file with a new cluster if needed
-                    unsigned int newCluster = 0;
-                    for (unsigned int i = 2; i < bpb->BPB_TotSec32 / bpb->BPB_SecsPerClus; i++) {
-                        unsigned int fatOffset = fatStart + (i * 4);
-                        fseek(fp, fatOffset, SEEK_SET);
-                        fread(&newCluster, sizeof(unsigned int), 1, fp);
-                        newCluster &= 0x0FFFFFFF; // Mask out reserved bits
-
-                        if (newCluster == 0x00000000) { // Free cluster
-                            newCluster = i;
-                            fseek(fp, fatOffset, SEEK_SET);
-                            unsigned int eofMarker = 0x0FFFFFFF;
-                            fwrite(&eofMarker, sizeof(unsigned int), 1, fp);
-
-                            // Update FAT entry for the current cluster
-                            unsigned int lastClusterFatOffset = fatStart + (fileCluster * 4);
-                            fseek(fp, lastClusterFatOffset, SEEK_SET);
-                            fwrite(&newCluster, sizeof(unsigned int), 1, fp);
-
-                            fileCluster = newCluster;
-                            break;
-                        }
-                    }
-
-                    if (newCluster == 0) {
-                        printf("Error: No free clusters available.\n");
-                        return;
-                    }
-                }
+    fprintf(session->out, "File '%s' deleted successfully.\n", filename);
+}
 
-                unsigned int clusterDataOffset = dataRegionStart + (clusterNumber - 2) * bytesPerCluster + clusterOffset;
-                fseek(fp, clusterDataOffset, SEEK_SET);
+// the '.' and '..' entries at the start of a new directory's zeroed cluster
+void fill_dot_entries(DIR *dotEntries, unsigned int cluster, unsigned int parentCluster) {
+    memset(dotEntries[0].DIR_Name, ' ', 11);
+    memset(dotEntries[1].DIR_Name, ' ', 11);
+    memcpy(dotEntries[0].DIR_Name, ".", 1);
+    dotEntries[0].DIR_Attr = 0x10;  // Directory attribute
+    dotEntries[0].DIR_FstClusLO = cluster & 0xFFFF;  // Point to the new directory itself
+    dotEntries[0].DIR_FstClusHI = cluster >> 16;
+
+    memcpy(dotEntries[1].DIR_Name, "..", 2);
+    dotEntries[1].DIR_Attr = 0x10;  // Directory attribute
+    dotEntries[1].DIR_FstClusLO = parentCluster & 0xFFFF;  // Point to the parent directory
+    dotEntries[1].DIR_FstClusHI = parentCluster >> 16;
+}
 
-                unsigned int writeSize = (bytesToWrite < bytesPerCluster - clusterOffset) 
-                                         ? bytesToWrite 
-                                         : bytesPerCluster - clusterOffset;
+void mkdir_command(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
+    // Check if the directory already exists
+    if (file_exists(fp, bpb, currentCluster, dirname)) {
+        print_error("Error: Directory '%s' already exists.\n", dirname);
+        return;
+    }
+    if (!lfn_name_valid(dirname)) {
+        print_error("Error: '%s' is not a valid file name.\n", dirname);
+        return;
+    }
+
+    // the new directory's first cluster, zeroed apart from '.' and '..' so
+    // stale data from a freed cluster can't show up as entries. Allocated
+    // first: there is nothing to undo if it fails
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    DIR *dotEntries = (DIR *)calloc(1, bytesPerCluster);
+    if (dotEntries == NULL) {
+        print_error("Error: Out of memory.\n");
+        return;
+    }
 
-                fwrite(string + bytesWritten, 1, writeSize, fp);
+    // Find a free cluster for the new directory
+    unsigned int freeCluster = alloc_cluster();
+    if (freeCluster == 0) {
+        free(dotEntries);
+        print_error("Error: No free clusters found for directory creation.\n");
+        return;
+    }
 
-                bytesWritten += writeSize;
-                bytesToWrite -= writeSize;
-                clusterOffset = 0; // Reset for the next cluster
-                storedOffset += writeSize;
+    // Any index left over from a directory that used this cluster is stale
+    dir_index_drop(freeCluster);
 
-                // Update file size in the directory entry
-                if (storedOffset > dirEntry.DIR_FileSize) {
-                    dirEntry.DIR_FileSize = storedOffset;
-                }
+    // Write the directory entry for the new directory in the parent directory
+    DIR dirEntry;
+    memset(&dirEntry, 0, sizeof(DIR));
+    dirEntry.DIR_Attr = 0x10;  // Directory attribute (0x10)
+    dirEntry.DIR_FstClusLO = freeCluster & 0xFFFF;  // Point to the new cluster
+    dirEntry.DIR_FstClusHI = freeCluster >> 16;
+    if (dir_add_entry(fp, bpb, currentCluster, dirname, &dirEntry, NULL) != 0) {
+        alloc_free(freeCluster);
+        free(dotEntries);
+        print_error("Error: No space to create directory '%s'.\n", dirname);
+        return;
+    }
+    if (session->debugOutput) {
+        fprintf(session->out, "Debug: Created directory entry for '%s'.\n", dirname);
+    }
 
-                // Move to the next cluster
-                unsigned int fatOffset = fatStart + (fileCluster * 4);
-                fseek(fp, fatOffset, SEEK_SET);
-                fread(&fileCluster, sizeof(unsigned int), 1, fp);
-                fileCluster &= 0x0FFFFFFF;
+    fill_dot_entries(dotEntries, freeCluster, currentCluster);
 
-                if (fileCluster == 0x0FFFFFF8 || fileCluster == 0x0FFFFFFF) {
-                    fileCluster = 0; // End of file chain
-                }
-            }
+    // Write the '.' and '..' entries into the new directory
+    journal_write(fp, cluster_offset(bpb, freeCluster), dotEntries, bytesPerCluster);
+    free(dotEntries);
 
-            // Write updated directory entry back to disk
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
-            fwrite(&dirEntry, sizeof(DIR), 1, fp);
+    fprintf(session->out, "Directory '%s' created successfully.\n", dirname);
+}
 
-            // Update the file's offset
-            fileEntry->offset = storedOffset;
+// add an empty file called filename, reporting only errors; the new entry
+// and its image offset go to *dirEntry and *entryPos. Returns 0 or -1
+int create_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename, DIR *dirEntry, long *entryPos) {
+    if (file_exists(fp, bpb, currentCluster, filename)) {
+        print_error("Error: Directory or file '%s' already exists.\n", filename);
+        return -1;
+    }
 
-            printf("Finished writing to '%s'. Total bytes written: %u. Updated offset: %u.\n", filename, bytesWritten, storedOffset);
-            return;
-        }
+    if (!lfn_name_valid(filename)) {
+        print_error("Error: '%s' is not a valid file name.\n", filename);
+        return -1;
     }
 
-    printf("Error: File '%s' not found in the current directory.\n", filename);
+    memset(dirEntry, 0, sizeof(DIR));
+    dirEntry->DIR_Attr = 0x20; // File attribute
+    dirEntry->DIR_FileSize = 0;
+    if (dir_add_entry(fp, bpb, currentCluster, filename, dirEntry, entryPos) != 0) {
+        print_error("Error: No space to create file '%s'.\n", filename);
+        return -1;
+    }
+    return 0;
 }
- 
-int file_exists(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+
+void creat_command(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
     DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+    long entryPos;
+    if (create_file(fp, bpb, currentCluster, filename, &dirEntry, &entryPos) == 0) {
+        fprintf(session->out, "File '%s' created successfully.\n", filename);
+    }
+}
+
+// names for 'creat -n' and 'mkdir -p': the arguments after the flag, plus
+// one name per line of a host file given as '< HOSTLIST' at the end
+typedef struct NameList {
+    const char **items;
+    int count;
+    char *text;          // contents of the host file, split in place
+} NameList;
+
+int collect_names(tokenlist *tokens, NameList *list) {
+    memset(list, 0, sizeof(NameList));
+    int last = (int)tokens->size;
+    const char *hostPath = NULL;
+    if (last >= 4 && strcmp(tokens->items[last - 2], "<") == 0) {
+        hostPath = tokens->items[last - 1];
+        last -= 2;
+    } else if (last >= 3 && tokens->items[last - 1][0] == '<' && tokens->items[last - 1][1] != '\0') {
+        hostPath = tokens->items[last - 1] + 1;
+        last -= 1;
+    }
 
-    fseek(fp, clusterOffset, SEEK_SET);
+    size_t textLen = 0;
+    int lines = 0;
+    if (hostPath != NULL) {
+        FILE *host = fopen(hostPath, "r");
+        if (host == NULL) {
+            print_error("Error: Cannot open '%s': %s\n", hostPath, strerror(errno));
+            return -1;
+        }
+        size_t capacity = 4096;
+        list->text = (char *)malloc(capacity);
+        size_t n;
+        while (list->text != NULL && (n = fread(list->text + textLen, 1, capacity - textLen - 1, host)) > 0) {
+            textLen += n;
+            if (textLen + 1 == capacity) {
+                char *grown = (char *)realloc(list->text, capacity * 2);
+                if (grown == NULL) {
+                    free(list->text);
+                }
+                list->text = grown;
+                capacity *= 2;
+            }
+        }
+        fclose(host);
+        if (list->text == NULL) {
+            print_error("Error: Out of memory.\n");
+            return -1;
+        }
+        list->text[textLen] = '\0';
+        for (size_t i = 0; i < textLen; i++) {
+            lines += list->text[i] == '\n';
+        }
+        lines++;
+    }
 
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00) {
-            break; // End of directory
+    // one pointer per argument and per host-file line; the strings stay in
+    // the tokens and in list->text. At least one slot, so an empty list
+    // never asks malloc for 0 bytes (which may legitimately return NULL)
+    size_t slots = (size_t)(last - 2 + lines);
+    list->items = (const char **)malloc((slots > 0 ? slots : 1) * sizeof(char *));
+    if (list->items == NULL) {
+        free(list->text);
+        print_error("Error: Out of memory.\n");
+        return -1;
+    }
+    for (int i = 2; i < last; i++) {
+        list->items[list->count++] = tokens->items[i];
+    }
+    for (char *line = list->text; line != NULL && *line != '\0'; ) {
+        char *end = strchr(line, '\n');
+        if (end != NULL) {
+            *end = '\0';
         }
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            list->items[list->count++] = line;
+        }
+        line = end != NULL ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+void free_names(NameList *list) {
+    free(list->items);
+    free(list->text);
+}
+
+// create a batch of files or directories in one directory with one pass
+// over it. New directories get their clusters as a batch, initialized in
+// runs of adjacent clusters before any entry points at them. Returns how
+// many were created
+int bulk_create_in(FILE *fp, BPB *bpb, unsigned int dirCluster, const char **names, const char **args, int count, int directories) {
+    DIR *entries = (DIR *)calloc(count, sizeof(DIR));
+    int *status = (int *)malloc(count * sizeof(int));
+    unsigned int *clusters = (unsigned int *)calloc(count, sizeof(unsigned int));
+    if (entries == NULL || status == NULL || clusters == NULL) {
+        free(entries);
+        free(status);
+        free(clusters);
+        print_error("Error: Out of memory.\n");
+        return 0;
+    }
+    if (dirCluster < 2) {
+        dirCluster = bpb->BPB_RootClus;
+    }
 
-        if (dirEntry.DIR_Name[0] == 0xE5) {
-            continue; // Deleted entry
+    // names that are already there are skipped up front, so only new
+    // directories take clusters; 'mkdir -p' accepts an existing directory
+    const char **fresh = (const char **)malloc(count * sizeof(char *));
+    int *freshIndex = (int *)malloc(count * sizeof(int));
+    int freshCount = 0;
+    for (int i = 0; i < count && fresh != NULL && freshIndex != NULL; i++) {
+        DIR existing;
+        if (!dir_lookup(fp, bpb, dirCluster, names[i], &existing, NULL)) {
+            freshIndex[freshCount] = i;
+            fresh[freshCount++] = names[i];
+        } else if (!directories || !(existing.DIR_Attr & 0x10)) {
+            print_error("Error: Directory or file '%s' already exists.\n", args[i]);
         }
+    }
 
-        char entryName[13] = {0};
-        strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-        entryName[11] = '\0';
+    int created = 0;
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    if (fresh == NULL || freshIndex == NULL) {
+        print_error("Error: Out of memory.\n");
+    } else if (directories && alloc_clusters(freshCount, clusters) != 0) {
+        print_error("Error: No free clusters found for directory creation.\n");
+    } else {
+        for (int i = 0; i < freshCount; i++) {
+            entries[i].DIR_Attr = directories ? 0x10 : 0x20;
+            entries[i].DIR_FstClusLO = clusters[i] & 0xFFFF;
+            entries[i].DIR_FstClusHI = clusters[i] >> 16;
+        }
 
-        // Remove trailing spaces
-        char *end = entryName + strlen(entryName) - 1;
-        while (end > entryName && *end == ' ') {
-            *end = '\0';
-            end--;
+        // zeroed clusters with '.' and '..', one write per run of adjacent clusters
+        unsigned int maxRun = BULK_INIT_BYTES / bytesPerCluster > 0 ? BULK_INIT_BYTES / bytesPerCluster : 1;
+        unsigned char *init = directories && freshCount > 0 ? (unsigned char *)malloc((size_t)maxRun * bytesPerCluster) : NULL;
+        int initFailed = directories && freshCount > 0 && init == NULL;
+        for (int i = 0; i < freshCount && !initFailed && directories; ) {
+            unsigned int run = 1;
+            while (i + run < (unsigned int)freshCount && run < maxRun && clusters[i + run] == clusters[i] + run) {
+                run++;
+            }
+            memset(init, 0, (size_t)run * bytesPerCluster);
+            for (unsigned int j = 0; j < run; j++) {
+                dir_index_drop(clusters[i + j]);  // left over from a directory that used the cluster
+                fill_dot_entries((DIR *)(init + (size_t)j * bytesPerCluster), clusters[i + j], dirCluster);
+            }
+            initFailed = journal_write(fp, cluster_offset(bpb, clusters[i]), init, (size_t)run * bytesPerCluster) != 0;
+            i += run;
         }
+        free(init);
 
-        if (strcmp(entryName, filename) == 0) {
-            return 1; // File exists
+        if (initFailed) {
+            print_error("Error: Failed to initialize the new directories.\n");
+        } else {
+            created = dir_add_entries(fp, bpb, dirCluster, fresh, entries, status, freshCount);
+        }
+        for (int i = 0; i < freshCount; i++) {
+            const char *arg = args[freshIndex[i]];
+            int result = initFailed ? DIR_ADD_FULL : status[i];
+            if (result != DIR_ADD_OK && directories) {
+                alloc_free(clusters[i]);
+            }
+            if (result == DIR_ADD_EXISTS && (!directories || !dir_lookup(fp, bpb, dirCluster, fresh[i], &entries[i], NULL) ||
+                                             !(entries[i].DIR_Attr & 0x10))) {
+                print_error("Error: Directory or file '%s' already exists.\n", arg);
+            } else if (result == DIR_ADD_INVALID) {
+                print_error("Error: '%s' is not a valid file name.\n", arg);
+            } else if (result == DIR_ADD_FULL && !initFailed) {
+                print_error("Error: No space to create '%s'.\n", arg);
+            }
         }
     }
+    free(fresh);
+    free(freshIndex);
+    free(entries);
+    free(status);
+    free(clusters);
+    return created;
+}
+
+// mkdir -p: create the directories leading up to path's last component
+// that don't exist yet; returns 0, or -1 after printing an error
+int make_parents(FILE *fp, BPB *bpb, const char *cwd, const char *path) {
+    char absPath[PATH_MAX_LEN];
+    if (path_normalize(cwd, path, absPath) != 0) {
+        print_error("Error: Path '%s' is too long.\n", path);
+        return -1;
+    }
+    *strrchr(absPath, '/') = '\0';  // the parent; empty for the root
 
-    return 0; // File does not exist
+    unsigned int dirCluster = bpb->BPB_RootClus;
+    for (char *end = absPath + 1; end[-1] != '\0'; end++) {
+        if (*end != '/' && *end != '\0') {
+            continue;
+        }
+        char saved = *end;
+        *end = '\0';
+        unsigned int cluster;
+        if (!path_lookup_dir(fp, bpb, absPath, &cluster)) {
+            const char *name = strrchr(absPath, '/') + 1;
+            DIR existing;
+            if (dir_lookup(fp, bpb, dirCluster, name, &existing, NULL)) {
+                print_error("Error: '%s' is not a directory.\n", absPath);
+                return -1;
+            }
+            const char *arg = absPath;
+            if (bulk_create_in(fp, bpb, dirCluster, &name, &arg, 1, 1) != 1 ||
+                !path_lookup_dir(fp, bpb, absPath, &cluster)) {
+                return -1;
+            }
+        }
+        dirCluster = cluster;
+        *end = saved;
+    }
+    return 0;
 }
 
-void rename_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *oldName, const char *newName) {
-    printf("Renaming file '%s' to '%s'.\n", oldName, newName);
-    if (!file_exists(fp, bpb, currentCluster, oldName)) {
-        printf("Error: File '%s' not found.\n", oldName);
+// creat -n / mkdir -p: names that share a parent directory are created
+// together, so each directory is scanned and written once per batch.
+// mkdir -p also creates missing parents, one at a time, before the batch
+// that needs them
+void bulk_create(FILE *fp, BPB *bpb, const char *cwd, NameList *list, int directories) {
+    const char **batch = (const char **)malloc(list->count * sizeof(char *));
+    const char **batchArgs = (const char **)malloc(list->count * sizeof(char *));
+    if (batch == NULL || batchArgs == NULL) {
+        free(batch);
+        free(batchArgs);
+        print_error("Error: Out of memory.\n");
         return;
     }
 
-    if (file_exists(fp, bpb, currentCluster, newName)) {
-        printf("Error: File '%s' already exists.\n", newName);
+    int created = 0;
+    int batchCount = 0;
+    unsigned int batchCluster = 0;
+    for (int i = 0; i <= list->count; i++) {
+        unsigned int dirCluster = 0;
+        char leaf[NAME_MAX_BYTES];
+        int resolved = i < list->count && path_resolve_parent(fp, bpb, cwd, list->items[i], &dirCluster, leaf);
+        if (batchCount > 0 && (i == list->count || !resolved || dirCluster != batchCluster)) {
+            created += bulk_create_in(fp, bpb, batchCluster, batch, batchArgs, batchCount, directories);
+            for (int j = 0; j < batchCount; j++) {
+                free((char *)batch[j]);
+            }
+            batchCount = 0;
+            if (!resolved && i < list->count) {
+                // the parent may be one of the directories just created
+                resolved = path_resolve_parent(fp, bpb, cwd, list->items[i], &dirCluster, leaf);
+            }
+        }
+        if (i == list->count) {
+            break;
+        }
+        if (!resolved && directories) {
+            if (make_parents(fp, bpb, cwd, list->items[i]) != 0) {
+                continue;
+            }
+            resolved = path_resolve_parent(fp, bpb, cwd, list->items[i], &dirCluster, leaf);
+        }
+        if (!resolved) {
+            print_error("Error: Path '%s' not found.\n", list->items[i]);
+            continue;
+        }
+        if ((batch[batchCount] = strdup(leaf)) == NULL) {
+            print_error("Error: Out of memory.\n");
+            continue;
+        }
+        batchCluster = dirCluster;
+        batchArgs[batchCount++] = list->items[i];
+    }
+    fprintf(session->out, "Created %d of %d %s.\n", created, list->count, directories ? "directories" : "files");
+    free(batch);
+    free(batchArgs);
+}
+
+// function for put: stream a host file into a new file in the image. The
+// chain is sized and linked up front, the data moves one contiguous run per
+// copy, and the directory entry is written once at the end
+void put_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *hostPath, const char *filename) {
+    int inFd = open(hostPath, O_RDONLY);
+    if (inFd < 0) {
+        print_error("Error: Cannot open '%s': %s\n", hostPath, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(inFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        print_error("Error: '%s' is not a regular file.\n", hostPath);
+        close(inFd);
+        return;
+    }
+    if ((unsigned long long)st.st_size > 0xFFFFFFFFULL) {
+        print_error("Error: '%s' is too large for a FAT32 file.\n", hostPath);
+        close(inFd);
         return;
     }
 
-    DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+    unsigned int bytesPerCluster = cluster_size(bpb);
+    unsigned int fileSize = (unsigned int)st.st_size;
+    unsigned int clustersNeeded = (unsigned int)(((unsigned long long)fileSize + bytesPerCluster - 1) / bytesPerCluster);
+    if (clustersNeeded > alloc_free_count()) {
+        print_error("Error: No free clusters available.\n");
+        close(inFd);
+        return;
+    }
 
-    fseek(fp, clusterOffset, SEEK_SET);
+    DIR dirEntry;
+    long entryPos;
+    if (create_file(fp, bpb, currentCluster, filename, &dirEntry, &entryPos) != 0) {
+        close(inFd);
+        return;
+    }
 
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00) {
-            break; // End of directory
+    // the whole chain at once, as one run when free space allows
+    unsigned int firstCluster = 0;
+    ExtentMap extents;
+    extent_init(&extents);
+    if (clustersNeeded > 0) {
+        firstCluster = alloc_contiguous(clustersNeeded);
+        if (firstCluster == 0) {
+            firstCluster = alloc_run(clustersNeeded);
         }
-
-        if (dirEntry.DIR_Name[0] == 0xE5) {
-            continue; // Deleted entry
+        if (firstCluster == 0 || extent_build(&extents, firstCluster) != 0) {
+            // without a map of the chain there is nowhere to copy to
+            print_error("Error: Failed to map the clusters for '%s'.\n", filename);
+            extent_free(&extents);
+            close(inFd);
+            alloc_free_chain(firstCluster);
+            return;
         }
+    }
 
-        char filename[13] = {0};
-        strncpy(filename, (char *)dirEntry.DIR_Name, 11);
-        filename[11] = '\0';
-
-        // Remove trailing spaces
-        char *end = filename + strlen(filename) - 1;
-        while (end > filename && *end == ' ') {
-            *end = '\0';
-            end--;
+    unsigned long long copied = 0;
+    for (unsigned int i = 0; i < extents.count && copied < fileSize; i++) {
+        unsigned long long runBytes = (unsigned long long)extents.items[i].length * bytesPerCluster;
+        if (runBytes > fileSize - copied) {
+            runBytes = fileSize - copied;
+        }
+        if (image_copy_in(fp, cluster_offset(bpb, extents.items[i].start), runBytes, inFd, (long)copied) != 0) {
+            break;
         }
+        if (session->debugOutput) {
+            fprintf(session->out, "Wrote %llu bytes to clusters %u-%u\n", runBytes, extents.items[i].start,
+                   extents.items[i].start + extents.items[i].length - 1);
+        }
+        copied += runBytes;
+    }
+    extent_free(&extents);
+    close(inFd);
+
+    if (copied < fileSize) {
+        // leave an empty file rather than one with a hole of stale data
+        print_error("Error: Failed to copy '%s' into the image.\n", hostPath);
+        alloc_free_chain(firstCluster);
+        firstCluster = 0;
+        fileSize = 0;
+    }
 
-        if (strcmp(filename, oldName) == 0) {
-            // Found the file to rename
-            memset(dirEntry.DIR_Name, ' ', 11);
-            strncpy((char *)dirEntry.DIR_Name, newName, strlen(newName));
+    dirEntry.DIR_FileSize = fileSize;
+    dirEntry.DIR_FstClusLO = firstCluster & 0xFFFF;
+    dirEntry.DIR_FstClusHI = firstCluster >> 16;
+    journal_write(fp, entryPos, &dirEntry, sizeof(DIR));
 
-            // Move file pointer back to the start of this entry
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
+    if (fileSize == st.st_size) {
+        fprintf(session->out, "Copied %u bytes from '%s' to '%s'.\n", fileSize, hostPath, filename);
+    }
+}
 
-            // Write the updated directory entry
-            fwrite(&dirEntry, sizeof(DIR), 1, fp);
+// Function to mark a cluster as free in the FAT table
+void mark_cluster_free(FILE *fp, BPB *bpb, unsigned int cluster) {
+    // Mark the cluster as free (0x00000000) and return it to the allocator
+    alloc_free(cluster);
+}
 
-            printf("File '%s' renamed to '%s' successfully.\n", oldName, newName);
-            return;
+// Function to check if the directory is empty (ignoring '.' and '..')
+int is_directory_empty(FILE *fp, BPB *bpb, unsigned int cluster) {
+    DirCursor cursor;
+    DIR *dirEntry;
+    int empty = 1;
+
+    dir_open(bpb, &cursor, cluster);
+    while ((dirEntry = dir_next(fp, bpb, &cursor)) != NULL) {
+        // Nothing follows the end marker; skip deleted entries
+        if (dirEntry->DIR_Name[0] == 0x00) {
+            break;
+        }
+        if (dirEntry->DIR_Name[0] == 0xE5) {
+            continue;
+        }
+        // long name parts belong to the entry after them; '.' and '..' are always there
+        if ((dirEntry->DIR_Attr & 0x3F) == ATTR_LONG_NAME ||
+            memcmp(dirEntry->DIR_Name, ".          ", 11) == 0 || memcmp(dirEntry->DIR_Name, "..         ", 11) == 0) {
+            continue;
         }
+        // any other entry, file or subdirectory, means the directory is not empty
+        empty = 0;
+        break;
     }
+    dir_close(&cursor);
+    return empty; // Directory is empty
 }
 
-void delete_file(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
+// Function to remove the directory entry from the parent directory
+void remove_directory_entry(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
+    // Mark the entry and its long name entries deleted; clearing it to 0x00
+    // would end the directory early for every entry after it
+    dir_remove_entry(fp, bpb, currentCluster, dirname);
+}
+
+// Function to remove a directory
+void delete_dir(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
+    // Check if the directory exists
     DIR dirEntry;
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
-
-    fseek(fp, clusterOffset, SEEK_SET);
-
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00) break; // End of directory
-        if (dirEntry.DIR_Name[0] == 0xE5) continue; // Deleted entry
-
-        char entryName[12] = {0};
-        strncpy(entryName, (char *)dirEntry.DIR_Name, 11);
-
-        // Remove trailing spaces
-        for (int i = 10; i >= 0 && entryName[i] == ' '; i--) entryName[i] = '\0';
-
-        if (strcmp(entryName, filename) == 0) {
-            // Mark directory entry as deleted
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
-            unsigned char deletedMarker = 0xE5;
-            fwrite(&deletedMarker, sizeof(unsigned char), 1, fp);
-
-            // Deallocate clusters
-            unsigned int firstCluster = (dirEntry.DIR_FstClusHI << 16) | dirEntry.DIR_FstClusLO;
-            unsigned int currentCluster = firstCluster;
-            unsigned int fatOffset;
-
-            while (currentCluster < 0x0FFFFFF8 && currentCluster >= 2) {
-                // Get the next cluster
-                fatOffset = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec + (currentCluster * 4);
-                fseek(fp, fatOffset, SEEK_SET);
-                unsigned int nextCluster;
-                fread(&nextCluster, sizeof(unsigned int), 1, fp);
-
-                // Mark current cluster as free
-                fseek(fp, fatOffset, SEEK_SET);
-                unsigned int freeCluster = 0x00000000;
-                fwrite(&freeCluster, sizeof(unsigned int), 1, fp);
-
-                currentCluster = nextCluster & 0x0FFFFFFF;
-            }
+    if (!dir_lookup(fp, bpb, currentCluster, dirname, &dirEntry, NULL) || !(dirEntry.DIR_Attr & 0x10)) {
+        print_error("Error: Directory '%s' not found or is not a directory.\n", dirname);
+        return;
+    }
+    unsigned int targetCluster = dirEntry.DIR_FstClusLO | (dirEntry.DIR_FstClusHI << 16); // Get the cluster of the directory
+    if (targetCluster == session->currentCluster) {
+        print_error("Error: Directory '%s' is the current directory.\n", dirname);
+        return;
+    }
+    if (cwd_elsewhere(targetCluster)) {
+        print_error("Error: Directory '%s' is the current directory of another session.\n", dirname);
+        return;
+    }
 
-            printf("File '%s' deleted successfully.\n", filename);
-            return;
-        }
+    // Check if the directory is empty
+    if (!is_directory_empty(fp, bpb, targetCluster)) {
+        print_error("Error: Directory '%s' is not empty.\n", dirname);
+        return;
     }
-    printf("Error: File '%s' not found.\n", filename);
+
+    // Remove the directory entry from the parent directory
+    remove_directory_entry(fp, bpb, currentCluster, dirname);
+
+    // Mark the directory's clusters as free in the FAT
+    dir_index_drop(targetCluster);
+    alloc_free_chain(targetCluster);
+
+    fprintf(session->out, "Directory '%s' removed successfully.\n", dirname);
 }
 
-unsigned int find_free_cluster(FILE *fp, BPB *bpb) {
-    unsigned int fatStart = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec; // Start of the FAT
-    unsigned int totalClusters = bpb->BPB_TotSec32 / bpb->BPB_SecsPerClus; // Total number of clusters in the FAT32 volume
-    unsigned int fatEntrySize = 4; // FAT32 entry size is 4 bytes
+// resolve a command's path argument to the directory holding it and its final
+// name; prints an error and returns 0 if the directory doesn't exist
+int resolve_path_arg(FILE *fp, BPB *bpb, const char *cwd, const char *arg, unsigned int *dirCluster, char *leaf) {
+    if (!path_resolve_parent(fp, bpb, cwd, arg, dirCluster, leaf)) {
+        print_error("Error: Path '%s' not found.\n", arg);
+        return 0;
+    }
+    return 1;
+}
 
-    // Iterate over the FAT table to find the first free cluster (value 0x00000000 in FAT32 indicates free)
-    for (unsigned int i = 2; i < totalClusters; ++i) { // Start from cluster 2 (clusters 0 and 1 are reserved)
-        unsigned int fatOffset = fatStart + (i * fatEntrySize);
-        unsigned int fatValue;
+// drop cached lookups for a directory that is being renamed or removed
+void invalidate_path_arg(const char *cwd, const char *arg) {
+    char absPath[PATH_MAX_LEN];
+    if (path_normalize(cwd, arg, absPath) == 0) {
+        path_cache_invalidate(absPath);
+    }
+}
 
-        fseek(fp, fatOffset, SEEK_SET);
-        fread(&fatValue, sizeof(unsigned int), 1, fp);
+// walk the tree under arg (or the cwd when arg is NULL); prints an error and
+// returns -1 if it isn't a directory or memory runs out
+int walk_path_arg(FILE *fp, BPB *bpb, const char *cwd, unsigned int cwdCluster, const char *arg, WalkResult *result) {
+    char absPath[PATH_MAX_LEN];
+    unsigned int dirCluster = cwdCluster;
+    if (path_normalize(cwd, arg != NULL ? arg : ".", absPath) != 0 ||
+        (arg != NULL && !path_lookup_dir(fp, bpb, absPath, &dirCluster))) {
+        print_error("Error: Directory '%s' not found.\n", arg);
+        return -1;
+    }
+    if (walk_tree(fp, bpb, absPath, dirCluster, walkThreads, result) != 0) {
+        print_error("Error: Out of memory.\n");
+        return -1;
+    }
+    return 0;
+}
 
-        // If the cluster is marked as free (0x00000000), return its index
-        if (fatValue == 0x00000000) {
-            printf("Debug: Found free cluster: %u\n", i);
-            return i;
+// function for find: every path under the directory whose name matches pattern
+void find_command(WalkResult *result, const char *pattern) {
+    for (size_t i = 0; i < result->count; i++) {
+        if (pattern == NULL || fnmatch(pattern, result->items[i].name, 0) == 0) {
+            fprintf(session->out, "%s\n", result->items[i].path);
         }
     }
-
-    printf("Error: No free clusters found.\n");
-    return 0; // No free clusters found, should handle this case.
 }
 
-// Function to mark a cluster as used in the FAT table
-void mark_cluster_used(FILE *fp, BPB *bpb, unsigned int cluster) {
-    // The location of the FAT starts after the reserved sectors, 
-    // followed by the FAT tables (depending on BPB_FATSz32).
-    unsigned int fatStart = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec;
-    unsigned int fatEntryOffset = fatStart + cluster * 4; // 4 bytes per FAT entry (32-bit)
+// function for du: file bytes and allocated clusters of every subtree
+void du_command(WalkResult *result) {
+    size_t count = result->count;
+    unsigned long long *bytes = (unsigned long long *)calloc(count, sizeof(unsigned long long));
+    unsigned long long *clusters = (unsigned long long *)calloc(count, sizeof(unsigned long long));
+    size_t *parent = (size_t *)malloc(count * sizeof(size_t));
+    size_t *open = (size_t *)malloc(count * sizeof(size_t));  // innermost directory at each depth
+    if (bytes == NULL || clusters == NULL || parent == NULL || open == NULL) {
+        print_error("Error: Out of memory.\n");
+        free(bytes);
+        free(clusters);
+        free(parent);
+        free(open);
+        return;
+    }
 
-    // Seek to the FAT entry for the given cluster
-    fseek(fp, fatEntryOffset, SEEK_SET);
+    // entries come in path order, so each one's parent is the last
+    // directory seen one level up
+    for (size_t i = 0; i < count; i++) {
+        WalkEntry *entry = &result->items[i];
+        parent[i] = entry->depth > 0 ? open[entry->depth - 1] : i;
+        open[entry->depth] = i;
+        bytes[i] = (entry->attr & 0x10) ? 0 : entry->fileSize;
+        clusters[i] = entry->clusters;
+    }
+    for (size_t i = count; i-- > 1; ) {
+        bytes[parent[i]] += bytes[i];
+        clusters[parent[i]] += clusters[i];
+    }
 
-    // The FAT entry for a used cluster should contain a non-zero value. 
-    // For simplicity, we'll just mark it as allocated (you can choose the actual value here).
-    unsigned int fatEntry = 0xFFFFFFF8; // This is the marker for a used cluster in FAT32 (FAT12 and FAT16 have different values)
-    
-    // Write the updated FAT entry
-    fwrite(&fatEntry, sizeof(unsigned int), 1, fp);
+    fprintf(session->out, "%-12s %-10s %s\n", "Bytes", "Clusters", "Path");
+    for (size_t i = 0; i < count; i++) {
+        if (result->items[i].attr & 0x10) {
+            fprintf(session->out, "%-12llu %-10llu %s\n", bytes[i], clusters[i], result->items[i].path);
+        }
+    }
+    free(bytes);
+    free(clusters);
+    free(parent);
+    free(open);
 }
 
-void mkdir_command(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
-    // Check if the directory already exists
-    if (file_exists(fp, bpb, currentCluster, dirname)) {
-        printf("Error: Directory '%s' already exists.\n", dirname);
-        return;
+// function for tree: the directory hierarchy drawn with ASCII branches
+void tree_command(WalkResult *result) {
+    size_t count = result->count;
+    int maxDepth = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (result->items[i].depth > maxDepth) {
+            maxDepth = result->items[i].depth;
+        }
     }
 
-    // Find a free cluster for the new directory
-    unsigned int freeCluster = find_free_cluster(fp, bpb);
-    if (freeCluster == 0) {
-        printf("Error: No free clusters found for directory creation.\n");
+    // an entry is the last child if no sibling follows before the parent ends
+    char *isLast = (char *)malloc(count);
+    char *siblingAfter = (char *)calloc(maxDepth + 2, 1);
+    char *lastAt = (char *)calloc(maxDepth + 1, 1);  // was the ancestor at each depth a last child
+    if (isLast == NULL || siblingAfter == NULL || lastAt == NULL) {
+        print_error("Error: Out of memory.\n");
+        free(isLast);
+        free(siblingAfter);
+        free(lastAt);
         return;
     }
+    for (size_t i = count; i-- > 0; ) {
+        int depth = result->items[i].depth;
+        isLast[i] = !siblingAfter[depth];
+        siblingAfter[depth] = 1;
+        siblingAfter[depth + 1] = 0;
+    }
 
-    // Write the directory entry for the new directory in the parent directory
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
-
-    fseek(fp, clusterOffset, SEEK_SET);
-    DIR dirEntry = {0};
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            // Empty or deleted directory entry found
-            memset(&dirEntry, 0, sizeof(DIR));
-            strncpy((char *)dirEntry.DIR_Name, dirname, 11);
-            dirEntry.DIR_Attr = 0x10;  // Directory attribute (0x10)
-            dirEntry.DIR_FstClusLO = freeCluster;  // Point to the new cluster
-
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
-            fwrite(&dirEntry, sizeof(DIR), 1, fp);
-
-            printf("Debug: Created directory entry for '%s'.\n", dirname);
-            break;
+    unsigned int dirs = 0, files = 0;
+    fprintf(session->out, "%s\n", result->items[0].path);
+    for (size_t i = 1; i < count; i++) {
+        WalkEntry *entry = &result->items[i];
+        for (int d = 1; d < entry->depth; d++) {
+            fprintf(session->out, "%s", lastAt[d] ? "    " : "|   ");
+        }
+        fprintf(session->out, "%s%s\n", isLast[i] ? "`-- " : "|-- ", entry->name);
+        lastAt[entry->depth] = isLast[i];
+        if (entry->attr & 0x10) {
+            dirs++;
+        } else {
+            files++;
         }
     }
+    fprintf(session->out, "\n%u directories, %u files\n", dirs, files);
+    free(isLast);
+    free(siblingAfter);
+    free(lastAt);
+}
 
-    // Write the '.' and '..' entries in the new directory
-    DIR dotEntry = {0};
-    strncpy((char *)dotEntry.DIR_Name, ".", 1);
-    dotEntry.DIR_Name[1] = '\0';  // Ensure null-termination
-    dotEntry.DIR_Attr = 0x10;  // Directory attribute
-    dotEntry.DIR_FstClusLO = freeCluster;  // Point to the new directory itself
+/************************************************************************************************/
 
-    DIR dotDotEntry = {0};
-    strncpy((char *)dotDotEntry.DIR_Name, "..", 2);
-    dotDotEntry.DIR_Name[2] = '\0';  // Ensure null-termination
-    dotDotEntry.DIR_Attr = 0x10;  // Directory attribute
-    dotDotEntry.DIR_FstClusLO = currentCluster;  // Point to the parent directory (root)
+#define CMD_CONTINUE 0
+#define CMD_EXIT     1
 
-    unsigned int newDirOffset = dataRegionStart + (freeCluster - 2) * bytesPerCluster;
-    fseek(fp, newDirOffset, SEEK_SET);
+typedef int (*CommandFn)(Shell *sh, tokenlist *tokens);
 
-    // Write the '.' and '..' entries into the new directory
-    fwrite(&dotEntry, sizeof(DIR), 1, fp);
-    fwrite(&dotDotEntry, sizeof(DIR), 1, fp);
+#define CMD_READS  0   // leaves the image alone: runs alongside other sessions under --serve
+#define CMD_WRITES 1   // may change the image or the FAT: runs alone
 
-    // Mark the cluster as used in the FAT table
-    mark_cluster_used(fp, bpb, freeCluster);
+typedef struct Command {
+    const char *name;
+    int minArgs;        // argument count range, not counting the command name
+    int maxArgs;
+    int access;         // CMD_READS or CMD_WRITES
+    const char *usage;
+    CommandFn run;
+} Command;
 
-    printf("Directory '%s' created successfully.\n", dirname);
+int cmd_cd(Shell *sh, tokenlist *tokens) {
+    change_directory(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &sh->currentCluster);
+    return CMD_CONTINUE;
 }
 
-void creat_command(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *filename) {
-    if (file_exists(fp, bpb, currentCluster, filename)) {
-        printf("Error: Directory or file '%s' already exists.\n", filename);
+int cmd_close(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        close_file(sh->fp, &sh->bpb, dirCluster, name);
+    }
+    return CMD_CONTINUE;
+}
+
+// 'creat -n' and 'mkdir -p' with the names that follow the flag
+void run_bulk(Shell *sh, tokenlist *tokens, int directories) {
+    NameList list;
+    if (collect_names(tokens, &list) != 0) {
         return;
     }
+    if (list.count == 0) {
+        print_error("Error: Usage: %s\n", directories ? "mkdir -p [DIRNAME...] [< HOSTLIST]" : "creat -n [NAME...] [< HOSTLIST]");
+    } else {
+        bulk_create(sh->fp, &sh->bpb, sh->cwd, &list, directories);
+    }
+    free_names(&list);
+}
+
+int cmd_creat(Shell *sh, tokenlist *tokens) {
+    if (strcmp(tokens->items[1], "-n") == 0) {
+        run_bulk(sh, tokens, 0);
+        return CMD_CONTINUE;
+    } else if (tokens->size != 2) {
+        print_error("Error: Usage: creat [FILENAME] | creat -n [NAME...] [< HOSTLIST]\n");
+        return CMD_CONTINUE;
+    }
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        creat_command(sh->fp, &sh->bpb, dirCluster, name);
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_debug(Shell *sh, tokenlist *tokens) {
+    if (strcmp(tokens->items[1], "on") == 0 || strcmp(tokens->items[1], "off") == 0) {
+        sh->debugOutput = strcmp(tokens->items[1], "on") == 0;
+    } else {
+        print_error("Error: Usage: debug [on|off]\n");
+    }
+    return CMD_CONTINUE;
+}
 
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+int cmd_du(Shell *sh, tokenlist *tokens) {
+    WalkResult result;
+    if (walk_path_arg(sh->fp, &sh->bpb, sh->cwd, sh->currentCluster, tokens->items[1], &result) == 0) {
+        du_command(&result);
+        walk_free(&result);
+    }
+    return CMD_CONTINUE;
+}
 
-    fseek(fp, clusterOffset, SEEK_SET);
+int cmd_exit(Shell *sh, tokenlist *tokens) {
+    return CMD_EXIT;
+}
+
+int cmd_fallocate(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    unsigned int bytes = strtoul(tokens->items[2], NULL, 10);
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        fallocate_file(sh->fp, &sh->bpb, dirCluster, name, bytes);
+    }
+    return CMD_CONTINUE;
+}
 
-    DIR dirEntry = {0};
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            // Empty or deleted directory entry found
-            memset(&dirEntry, 0, sizeof(DIR));
-            strncpy((char *)dirEntry.DIR_Name, filename, 11);
-            dirEntry.DIR_Attr = 0x20; // File attribute
-            dirEntry.DIR_FileSize = 0;
+// find [PATH] [-name PATTERN]
+int cmd_find(Shell *sh, tokenlist *tokens) {
+    const char *path = NULL;
+    const char *pattern = NULL;
+    for (size_t i = 1; i < tokens->size; i++) {
+        if (strcmp(tokens->items[i], "-name") == 0 && i + 1 < tokens->size && pattern == NULL) {
+            pattern = tokens->items[++i];
+        } else if (path == NULL && tokens->items[i][0] != '-') {
+            path = tokens->items[i];
+        } else {
+            print_error("Error: Usage: find [PATH] [-name PATTERN]\n");
+            return CMD_CONTINUE;
+        }
+    }
 
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
-            fwrite(&dirEntry, sizeof(DIR), 1, fp);
+    WalkResult result;
+    if (walk_path_arg(sh->fp, &sh->bpb, sh->cwd, sh->currentCluster, path, &result) == 0) {
+        find_command(&result, pattern);
+        walk_free(&result);
+    }
+    return CMD_CONTINUE;
+}
 
-            printf("File '%s' created successfully.\n", filename);
-            return;
+// fsck [--repair]
+int cmd_fsck(Shell *sh, tokenlist *tokens) {
+    int repair = tokens->size == 2;
+    if (repair && strcmp(tokens->items[1], "--repair") != 0) {
+        print_error("Error: Usage: fsck [--repair]\n");
+        return CMD_CONTINUE;
+    }
+    if (repair && (sh->openFileCount > 0 || files_open_elsewhere())) {
+        // handles hold extent maps and sizes a repair could invalidate
+        print_error("Error: Close all open files before 'fsck --repair'.\n");
+        return CMD_CONTINUE;
+    }
+
+    if (fsck_run(sh->fp, &sh->bpb, walkThreads, repair, sh->out) != 0) {
+        sh->commandFailed = 1;
+    }
+    if (repair) {
+        dir_index_clear();
+        path_cache_clear();
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_info(Shell *sh, tokenlist *tokens) {
+    print_bpb_info(&sh->bpb, sh->fp);
+    return CMD_CONTINUE;
+}
+
+int cmd_ls(Shell *sh, tokenlist *tokens) {
+    if (tokens->size > 1) {
+        char absPath[PATH_MAX_LEN];
+        unsigned int dirCluster;
+        if (path_normalize(sh->cwd, tokens->items[1], absPath) == 0 &&
+            path_lookup_dir(sh->fp, &sh->bpb, absPath, &dirCluster)) {
+            list_directory(sh->fp, &sh->bpb, dirCluster);
+        } else {
+            print_error("Error: Directory '%s' not found.\n", tokens->items[1]);
         }
+    } else {
+        list_directory(sh->fp, &sh->bpb, sh->currentCluster);
     }
+    return CMD_CONTINUE;
+}
 
-    printf("Error: No space to create file '%s'.\n", filename);
+int cmd_lseek(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    unsigned int offset = strtoul(tokens->items[2], NULL, 10);
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        lseek_file(name, offset, sh->fp, &sh->bpb, dirCluster);
+    }
+    return CMD_CONTINUE;
 }
 
-// Function to mark a cluster as free in the FAT table
-void mark_cluster_free(FILE *fp, BPB *bpb, unsigned int cluster) {
-    unsigned int fatStart = bpb->BPB_RsvdSecCnt * bpb->BPB_BytesPerSec;
-    unsigned int fatEntryOffset = fatStart + cluster * 4; // 4 bytes per FAT entry (32-bit)
+int cmd_lsof(Shell *sh, tokenlist *tokens) {
+    lsof();
+    return CMD_CONTINUE;
+}
 
-    // Seek to the FAT entry for the given cluster
-    fseek(fp, fatEntryOffset, SEEK_SET);
+int cmd_mkdir(Shell *sh, tokenlist *tokens) {
+    if (strcmp(tokens->items[1], "-p") == 0) {
+        run_bulk(sh, tokens, 1);
+        return CMD_CONTINUE;
+    } else if (tokens->size != 2) {
+        print_error("Error: Usage: mkdir [DIRNAME] | mkdir -p [DIRNAME...] [< HOSTLIST]\n");
+        return CMD_CONTINUE;
+    }
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        mkdir_command(sh->fp, &sh->bpb, dirCluster, name);
+    }
+    return CMD_CONTINUE;
+}
 
-    // Mark the cluster as free (0x00000000)
-    unsigned int fatEntry = 0x00000000;
-    
-    // Write the updated FAT entry
-    fwrite(&fatEntry, sizeof(unsigned int), 1, fp);
+int cmd_open(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    unsigned int reserve = tokens->size == 4 ? strtoul(tokens->items[3], NULL, 10) : 0;
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        open_file(sh->fp, &sh->bpb, dirCluster, name, tokens->items[2], sh->imageName, reserve);
+    }
+    return CMD_CONTINUE;
 }
 
-// Function to check if the directory is empty (ignoring '.' and '..')
-int is_directory_empty(FILE *fp, BPB *bpb, unsigned int cluster) {
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int dataRegionStart = (bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32)) * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (cluster - 2) * bytesPerCluster;
+// put HOSTPATH [NAME]; NAME defaults to the host file's base name
+int cmd_put(Shell *sh, tokenlist *tokens) {
+    char defaultName[PATH_MAX_LEN];
+    const char *target = tokens->items[2];
+    if (target == NULL) {
+        snprintf(defaultName, sizeof(defaultName), "%s", tokens->items[1]);
+        target = basename(defaultName);
+    }
 
-    fseek(fp, clusterOffset, SEEK_SET);
-    DIR dirEntry;
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        // Skip '.' and '..' entries
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            continue;
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, target, &dirCluster, name)) {
+        put_file(sh->fp, &sh->bpb, dirCluster, tokens->items[1], name);
+    }
+    return CMD_CONTINUE;
+}
+
+// read [--raw] FILENAME SIZE [> HOSTPATH]
+int cmd_read(Shell *sh, tokenlist *tokens) {
+    int arg = 1;
+    int raw = 0;
+    if (strcmp(tokens->items[1], "--raw") == 0) {
+        raw = 1;
+        arg++;
+    }
+    const char *hostPath = NULL;
+    if (tokens->size == arg + 4 && strcmp(tokens->items[arg + 2], ">") == 0) {
+        hostPath = tokens->items[arg + 3];
+    } else if (tokens->size == arg + 3 && tokens->items[arg + 2][0] == '>' && tokens->items[arg + 2][1] != '\0') {
+        hostPath = tokens->items[arg + 2] + 1;
+    } else if (tokens->size != arg + 2) {
+        print_error("Error: Usage: read [--raw] [FILENAME] [SIZE] [> HOSTPATH]\n");
+        return CMD_CONTINUE;
+    }
+
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (!resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[arg], &dirCluster, name)) {
+        return CMD_CONTINUE;
+    }
+    unsigned int size = strtoul(tokens->items[arg + 1], NULL, 10); // Convert SIZE from string to unsigned int
+    if (hostPath != NULL) {
+        int outFd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0) {
+            print_error("Error: Cannot open '%s': %s\n", hostPath, strerror(errno));
+        } else {
+            read_file(sh->fp, &sh->bpb, dirCluster, name, size, outFd);
+            close(outFd);
         }
-        // If any other entry is found, the directory is not empty
-        if (dirEntry.DIR_Attr != 0x10) { // Not a directory
-            return 0;
+    } else {
+        read_file(sh->fp, &sh->bpb, dirCluster, name, size, raw ? fileno(sh->out) : -1);
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_rename(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster, newDirCluster;
+    char name[NAME_MAX_BYTES], newName[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name) &&
+        resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[2], &newDirCluster, newName)) {
+        if (newDirCluster != dirCluster) {
+            print_error("Error: '%s' must be in the same directory as '%s'.\n", tokens->items[2], tokens->items[1]);
+        } else {
+            // sessions inside a renamed directory follow it to its new path
+            char oldPath[PATH_MAX_LEN], newPath[PATH_MAX_LEN];
+            path_normalize(sh->cwd, tokens->items[1], oldPath);
+            path_normalize(sh->cwd, tokens->items[2], newPath);
+            if (cwd_rename_too_long(oldPath, newPath)) {
+                print_error("Error: A current directory under '%s' would have too long a path.\n", tokens->items[1]);
+                return CMD_CONTINUE;
+            }
+            path_cache_invalidate(oldPath);
+            rename_file(sh->fp, &sh->bpb, dirCluster, name, newName);
+            if (!sh->commandFailed) {
+                cwd_rename(oldPath, newPath);
+            }
         }
     }
-    return 1; // Directory is empty
+    return CMD_CONTINUE;
 }
 
-// Function to remove the directory entry from the parent directory
-void remove_directory_entry(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int dataRegionStart = (bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32)) * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
+int cmd_rm(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        delete_file(sh->fp, &sh->bpb, dirCluster, name);
+    }
+    return CMD_CONTINUE;
+}
 
-    fseek(fp, clusterOffset, SEEK_SET);
-    DIR dirEntry;
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (strncmp((char *)dirEntry.DIR_Name, dirname, 11) == 0) {
-            // Clear the directory entry
-            memset(&dirEntry, 0, sizeof(DIR));
-            fseek(fp, -sizeof(DIR), SEEK_CUR);
-            fwrite(&dirEntry, sizeof(DIR), 1, fp); // Write the cleared entry
-            break;
-        }
+int cmd_rmdir(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        invalidate_path_arg(sh->cwd, tokens->items[1]);
+        delete_dir(sh->fp, &sh->bpb, dirCluster, name);
     }
+    return CMD_CONTINUE;
 }
 
-// Function to remove a directory
-void delete_dir(FILE *fp, BPB *bpb, unsigned int currentCluster, const char *dirname) {
-    // Check if the directory exists
-    DIR dirEntry;
-    int found = 0;
-    unsigned int targetCluster = 0;
-    
-    // Search for the directory entry in the current directory
-    unsigned int bytesPerCluster = bpb->BPB_BytesPerSec * bpb->BPB_SecsPerClus;
-    unsigned int rootDirSector = bpb->BPB_RsvdSecCnt + (bpb->BPB_NumFATs * bpb->BPB_FATSz32);
-    unsigned int dataRegionStart = rootDirSector * bpb->BPB_BytesPerSec;
-    unsigned int clusterOffset = dataRegionStart + (currentCluster - 2) * bytesPerCluster;
-
-    fseek(fp, clusterOffset, SEEK_SET);
-    while (fread(&dirEntry, sizeof(DIR), 1, fp) == 1) {
-        if (dirEntry.DIR_Name[0] == 0x00 || dirEntry.DIR_Name[0] == 0xE5) {
-            continue; // Skip empty or deleted entries
-        }
-        
-        // Check if the directory name matches
-        if (strncmp((char *)dirEntry.DIR_Name, dirname, 11) == 0 && dirEntry.DIR_Attr == 0x10) {
-            found = 1;
-            targetCluster = dirEntry.DIR_FstClusLO; // Get the cluster of the directory
-            break;
+int cmd_stats(Shell *sh, tokenlist *tokens) {
+    if (tokens->size == 1) {
+        stats_print(sh->out);
+    } else if (strcmp(tokens->items[1], "reset") == 0) {
+        stats_reset();
+    } else {
+        print_error("Error: Usage: stats [reset]\n");
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_sync(Shell *sh, tokenlist *tokens) {
+    for (int i = 0; i < sh->openFileCount; i++) {
+        flush_write_buffer(sh->fp, &sh->bpb, &sh->openFiles[i]);
+    }
+    if (journal_checkpoint(sh->fp) != 0) {
+        print_error("Error: Failed to write the FAT back to the image.\n");
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_tree(Shell *sh, tokenlist *tokens) {
+    WalkResult result;
+    if (walk_path_arg(sh->fp, &sh->bpb, sh->cwd, sh->currentCluster, tokens->items[1], &result) == 0) {
+        tree_command(&result);
+        walk_free(&result);
+    }
+    return CMD_CONTINUE;
+}
+
+int cmd_write(Shell *sh, tokenlist *tokens) {
+    unsigned int dirCluster;
+    char name[NAME_MAX_BYTES];
+    if (resolve_path_arg(sh->fp, &sh->bpb, sh->cwd, tokens->items[1], &dirCluster, name)) {
+        update_file(sh->fp, &sh->bpb, dirCluster, name, tokens->items[2]);
+    }
+    return CMD_CONTINUE;
+}
+
+// sorted by name for bsearch; keep it that way when adding commands
+const Command commands[] = {
+    { "cd",        1, 1, CMD_READS,  "cd [DIRNAME]",                               cmd_cd },
+    { "close",     1, 1, CMD_WRITES, "close [FILENAME]",                           cmd_close },
+    { "creat",     1, INT_MAX, CMD_WRITES, "creat [FILENAME] | creat -n [NAME...] [< HOSTLIST]", cmd_creat },
+    { "debug",     1, 1, CMD_READS,  "debug [on|off]",                             cmd_debug },
+    { "du",        0, 1, CMD_READS,  "du [PATH]",                                  cmd_du },
+    { "exit",      0, 0, CMD_READS,  "exit",                                       cmd_exit },
+    { "fallocate", 2, 2, CMD_WRITES, "fallocate [FILENAME] [BYTES]",               cmd_fallocate },
+    { "find",      0, 3, CMD_READS,  "find [PATH] [-name PATTERN]",                cmd_find },
+    { "fsck",      0, 1, CMD_WRITES, "fsck [--repair]",                            cmd_fsck },
+    { "info",      0, 0, CMD_READS,  "info",                                       cmd_info },
+    { "ls",        0, 1, CMD_READS,  "ls [PATH]",                                  cmd_ls },
+    { "lseek",     2, 2, CMD_WRITES, "lseek [FILENAME] [OFFSET]",                  cmd_lseek },
+    { "lsof",      0, 0, CMD_READS,  "lsof",                                       cmd_lsof },
+    { "mkdir",     1, INT_MAX, CMD_WRITES, "mkdir [DIRNAME] | mkdir -p [DIRNAME...] [< HOSTLIST]", cmd_mkdir },
+    { "open",      2, 3, CMD_WRITES, "open [FILENAME] [FLAGS] [RESERVE_BYTES]",    cmd_open },
+    { "put",       1, 2, CMD_WRITES, "put [HOSTPATH] [NAME]",                      cmd_put },
+    { "read",      2, 5, CMD_READS,  "read [--raw] [FILENAME] [SIZE] [> HOSTPATH]", cmd_read },
+    { "rename",    2, 2, CMD_WRITES, "rename [OLDNAME] [NEWNAME]",                 cmd_rename },
+    { "rm",        1, 1, CMD_WRITES, "rm [FILENAME]",                              cmd_rm },
+    { "rmdir",     1, 1, CMD_WRITES, "rmdir [DIRNAME]",                            cmd_rmdir },
+    { "stats",     0, 1, CMD_READS,  "stats [reset]",                              cmd_stats },
+    { "sync",      0, 0, CMD_WRITES, "sync",                                       cmd_sync },
+    { "tree",      0, 1, CMD_READS,  "tree [PATH]",                                cmd_tree },
+    { "write",     2, 2, CMD_WRITES, "write [FILENAME] [DATA]",                    cmd_write },
+};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+int compare_command(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const Command *)entry)->name);
+}
+
+// look up and run one tokenized command line; returns CMD_EXIT for 'exit'.
+// commandFailed tells whether it reported an error
+int run_command(Shell *sh, tokenlist *tokens) {
+    sh->commandFailed = 0;
+    if (tokens->size == 0) {
+        return CMD_CONTINUE;
+    }
+
+    const Command *command = bsearch(tokens->items[0], commands, COMMAND_COUNT, sizeof(Command), compare_command);
+    if (command == NULL) {
+        print_error("Error: Unknown command '%s'.\n", tokens->items[0]);
+        return CMD_CONTINUE;
+    }
+    int args = (int)tokens->size - 1;
+    if (args < command->minArgs || args > command->maxArgs) {
+        print_error("Error: Usage: %s\n", command->usage);
+        return CMD_CONTINUE;
+    }
+    // a read-only command under --serve logs nothing, so it leaves the
+    // journal's commit group to the next command that changes something
+    int shared = serving && command->access == CMD_READS;
+    if (shared) {
+        pthread_rwlock_rdlock(&treeLock);
+    } else {
+        pthread_rwlock_wrlock(&treeLock);
+    }
+    StatsMark mark;
+    stats_begin(&mark);
+    int result = command->run(sh, tokens);
+    if (!shared && journal_end_op(sh->fp) != 0) {
+        print_error("Error: Failed to write to the journal.\n");
+    }
+    stats_end(&mark, command->name, (int)tokens->size, tokens->items, sh->commandFailed);
+    pthread_rwlock_unlock(&treeLock);
+    return result;
+}
+
+// run every ';'-separated command in line, tokenizing it in place; returns
+// CMD_EXIT once 'exit' runs and counts commands that reported errors in *failures
+int run_line(Shell *sh, char *line, int *failures) {
+    char *next = line;
+    while (next != NULL) {
+        tokenlist *tokens;
+        next = lexer_tokenize(&sh->lex, next, &tokens);
+        int result = run_command(sh, tokens);
+        if (sh->commandFailed) {
+            (*failures)++;
+        }
+        if (result == CMD_EXIT) {
+            return CMD_EXIT;
         }
     }
+    return CMD_CONTINUE;
+}
 
-    if (!found) {
-        printf("Error: Directory '%s' not found or is not a directory.\n", dirname);
-        return;
+// run a script file line by line; returns CMD_EXIT if it ran 'exit'
+int run_script(Shell *sh, const char *scriptPath, int *failures) {
+    FILE *script = fopen(scriptPath, "r");
+    if (script == NULL) {
+        fprintf(stderr, "Error: Cannot open script '%s': %s\n", scriptPath, strerror(errno));
+        (*failures)++;
+        return CMD_CONTINUE;
     }
 
-    // Check if the directory is empty
-    if (!is_directory_empty(fp, bpb, targetCluster)) {
-        printf("Error: Directory '%s' is not empty.\n", dirname);
+    char *line;
+    int result = CMD_CONTINUE;
+    while (result != CMD_EXIT && (line = lexer_read_line(&sh->lex, script)) != NULL) {
+        result = run_line(sh, line, failures);
+    }
+    fclose(script);
+    return result;
+}
+
+// one --serve client: a shell of its own on the shared image, reading
+// command lines from the connection and answering on it with a prompt after
+// each, until 'exit' or end of input
+void serve_session(int fd, void *arg) {
+    const Shell *base = (const Shell *)arg;
+    Shell *sh = (Shell *)calloc(1, sizeof(Shell));
+    int inFd = dup(fd);
+    int outFd = dup(fd);
+    FILE *in = inFd >= 0 ? fdopen(inFd, "r") : NULL;
+    FILE *out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    if (sh == NULL || in == NULL || out == NULL) {
+        free(sh);
+        if (in != NULL) {
+            fclose(in);
+        } else if (inFd >= 0) {
+            close(inFd);
+        }
+        if (out != NULL) {
+            fclose(out);
+        } else if (outFd >= 0) {
+            close(outFd);
+        }
         return;
     }
 
-    // Remove the directory entry from the parent directory
-    remove_directory_entry(fp, bpb, currentCluster, dirname);
+    sh->fp = base->fp;
+    sh->bpb = base->bpb;
+    sh->currentCluster = sh->bpb.BPB_RootClus;
+    strcpy(sh->cwd, "/");
+    sh->imageName = base->imageName;
+    sh->out = out;
+    sh->debugOutput = base->debugOutput;
+    lexer_init(&sh->lex);
+    session = sh;
+
+    pthread_rwlock_wrlock(&treeLock);
+    for (int s = 0; s < SERVE_MAX_SESSIONS; s++) {
+        if (sessions[s] == NULL) {
+            sessions[s] = sh;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&treeLock);
+
+    int failures = 0;
+    while (1) {
+        // another session's rename can rewrite the cwd between commands
+        char cwd[PATH_MAX_LEN];
+        pthread_rwlock_rdlock(&treeLock);
+        strcpy(cwd, sh->cwd);
+        pthread_rwlock_unlock(&treeLock);
+        fprintf(out, "./%s%s> ", sh->imageName, cwd);
+        fflush(out);
+        char *input = lexer_read_line(&sh->lex, in);
+        if (input == NULL || run_line(sh, input, &failures) == CMD_EXIT) {
+            break;
+        }
+    }
 
-    // Mark the directory's clusters as free in the FAT
-    mark_cluster_free(fp, bpb, targetCluster);
+    // what the client left open is closed for it, as one more command
+    pthread_rwlock_wrlock(&treeLock);
+    for (int i = 0; i < sh->openFileCount; i++) {
+        flush_write_buffer(sh->fp, &sh->bpb, &sh->openFiles[i]);
+        free(sh->openFiles[i].writeBuf);
+        free(sh->openFiles[i].readBuf);
+        extent_free(&sh->openFiles[i].extents);
+    }
+    sh->openFileCount = 0;
+    if (journal_end_op(sh->fp) != 0) {
+        fprintf(stderr, "Error: Failed to write to the journal.\n");
+    }
+    stats_flush();  // the thread's counts would go with it
+    for (int s = 0; s < SERVE_MAX_SESSIONS; s++) {
+        if (sessions[s] == sh) {
+            sessions[s] = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&treeLock);
 
-    printf("Directory '%s' removed successfully.\n", dirname);
+    session = NULL;
+    fclose(in);
+    fclose(out);
+    lexer_free(&sh->lex);
+    free(sh);
 }
 
-/************************************************************************************************/
-
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [FAT32 ISO file]\n", argv[0]);
+    // optional --mmap selects the memory-mapped image backend; -c and -f
+    // run commands in batch mode instead of the interactive prompt
+    int useMmap = 0;
+    int useJournal = 0;
+    int useUring = 0;
+    int uringFixed = 0;
+    unsigned int uringDepth = URING_DEPTH;
+    unsigned long cacheKb = CACHE_KB;
+    unsigned int journalOps = JOURNAL_GROUP_OPS;
+    unsigned int journalMs = JOURNAL_GROUP_MS;
+    char *imagePath = NULL;
+    const char *tracePath = NULL;
+    const char *servePath = NULL;
+    const char *batch[argc];      // command strings and script paths, in order
+    int batchIsScript[argc];
+    int batchCount = 0;
+    int badArgs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            useMmap = 1;
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            useJournal = 1;
+        } else if (strcmp(argv[i], "--journal-ops") == 0 && i + 1 < argc) {
+            journalOps = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--journal-ms") == 0 && i + 1 < argc) {
+            journalMs = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            useUring = 1;
+        } else if (strcmp(argv[i], "--uring-depth") == 0 && i + 1 < argc) {
+            uringDepth = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--uring-fixed") == 0) {
+            uringFixed = 1;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheKb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            walkThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            servePath = argv[++i];
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-f") == 0) && i + 1 < argc) {
+            batchIsScript[batchCount] = argv[i][1] == 'f';
+            batch[batchCount++] = argv[++i];
+        } else if (imagePath == NULL) {
+            imagePath = argv[i];
+        } else {
+            badArgs = 1;
+        }
+    }
+    if (imagePath == NULL || badArgs || (servePath != NULL && batchCount > 0)) {
+        fprintf(stderr, "Usage: %s [--mmap] [--journal [--journal-ops N] [--journal-ms T]] [--io-uring [--uring-depth N] [--uring-fixed]] [--cache KB] [--threads N] [--trace FILE] [--serve SOCKET | -c \"CMD; CMD\" | -f SCRIPT] [FAT32 ISO file]\n", argv[0]);
         return 1;
     }
-    if (access(argv[1], F_OK) == -1) {
+    if (walkThreads <= 0) {
+        walkThreads = walk_default_threads();
+    }
+    if (access(imagePath, F_OK) == -1) {
         perror("Error");
         return 1;
     }
-    FILE *fp = fopen(argv[1], "r+b");
+    // one JSON line per command with its latency and the I/O it caused
+    if (tracePath != NULL && stats_trace_open(tracePath) != 0) {
+        fprintf(stderr, "Error: Cannot open trace file '%s': %s\n", tracePath, strerror(errno));
+        return 1;
+    }
+    FILE *fp = fopen(imagePath, "r+b");
     if (!fp) {
         perror("Error opening the image file");
         return 1;
     }
+    // finish whatever a crashed session left in the journal before reading anything
+    char walPath[strlen(imagePath) + 5];
+    sprintf(walPath, "%s.wal", imagePath);
+    int replayed = journal_recover(fp, walPath);
+    if (replayed < 0) {
+        fprintf(stderr, "Error: Failed to replay the journal '%s'.\n", walPath);
+        fclose(fp);
+        return 1;
+    } else if (replayed > 0) {
+        fprintf(stderr, "Recovered the image from %d journal records in '%s'.\n", replayed, walPath);
+    }
 
-    BPB bpb;
-    fseek(fp, 0, SEEK_SET);
-    if (fread(&bpb, sizeof(BPB), 1, fp) != 1) {
+    if (image_open(fp, useMmap) != 0) {
+        fprintf(stderr, "Warning: Could not map the image, using stdio instead.\n");
+    }
+    // batched cluster and FAT I/O through io_uring, registering one read buffer with --uring-fixed
+    if (useUring && !image_is_mapped() && image_use_uring(uringDepth, uringFixed ? MAX_IO_BYTES : 0) != 0) {
+        fprintf(stderr, "Warning: io_uring is not available, using synchronous I/O instead.\n");
+    }
+
+    Shell sh;
+    sh.fp = fp;
+    if (image_read(fp, 0, &sh.bpb, sizeof(BPB)) != 0) {
         perror("Failed to read BPB structure");
+        image_close();
         fclose(fp);
         return 1;
     }
+    // directory and file clusters on the stdio backend go through a shared
+    // buffer cache; --cache 0 turns it off
+    if (cacheKb > 0) {
+        unsigned int dataSectors = sh.bpb.BPB_TotSec32 - (sh.bpb.BPB_RsvdSecCnt + sh.bpb.BPB_NumFATs * sh.bpb.BPB_FATSz32);
+        unsigned int clusters = sh.bpb.BPB_SecsPerClus > 0 ? dataSectors / sh.bpb.BPB_SecsPerClus + 2 : 0;
+        if (image_use_cache(fp, cluster_offset(&sh.bpb, 2), cluster_size(&sh.bpb), clusters, (size_t)cacheKb * 1024) != 0) {
+            fprintf(stderr, "Warning: Could not set up the buffer cache, running without it.\n");
+        }
+    }
+
+    // load the FAT once; every chain walk after this is an array lookup
+    if (useJournal && journal_open(walPath, journalOps, journalMs) != 0) {
+        fprintf(stderr, "Warning: Could not open the journal '%s', running without it.\n", walPath);
+    }
+    if (fat_load(fp, &sh.bpb, !journal_enabled()) != 0 || (journal_enabled() && fat_track_changes() != 0)) {
+        fprintf(stderr, "Error: Failed to load the FAT.\n");
+        image_close();
+        fclose(fp);
+        return 1;
+    }
+    if (alloc_init(fp, &sh.bpb) != 0) {
+        fprintf(stderr, "Error: Failed to build the free-cluster map.\n");
+        fat_unload();
+        image_close();
+        fclose(fp);
+        return 1;
+    }
+    // FSInfo isn't journaled; bring it in line with the FAT the log restored
+    if (replayed > 0 && alloc_sync(fp) != 0) {
+        fprintf(stderr, "Warning: Could not update FSInfo after recovery.\n");
+    }
 
     // initial current cluster is the root directory
-    unsigned int currentCluster = bpb.BPB_RootClus;
-
-    char *imageName = basename(argv[1]);
-    char pathToImage[256] = "/";
-    char *input;
-   while (1) {
-        printf("./%s%s> ", imageName, pathToImage);
-        input = get_input();
-
-        tokenlist *tokens = get_tokens(input);
-        if (tokens->size > 0) {
-            if (strcmp(tokens->items[0], "info") == 0) {
-                print_bpb_info(&bpb, fp);
-            } else if (strcmp(tokens->items[0], "ls") == 0) {
-                list_directory(fp, &bpb, currentCluster);
-            } else if (strcmp(tokens->items[0], "cd") == 0) {
-                if (tokens->size > 1) {
-                    change_directory(fp, &bpb, pathToImage, tokens->items[1], &currentCluster);
-                } else {
-                    printf("Error: No directory name provided.\n");
-                }
-            } else if (strcmp(tokens->items[0], "open") == 0) {
-                if (tokens->size == 3) {
-                    open_file(fp, &bpb, currentCluster, tokens->items[1], tokens->items[2], imageName);
-                } else {
-                    printf("Error: Usage: open [FILENAME] [FLAGS]\n");
-                }
-            } else if (strcmp(tokens->items[0], "close") == 0) {
-                if (tokens->size > 1) {
-                    close_file(tokens->items[1]);
-                } else {
-                    printf("Error: No filename provided for 'close'.\n");
-                }
-            } else if (strcmp(tokens->items[0], "lsof") == 0) {
-                lsof();
-            } else if (strcmp(tokens->items[0], "lseek") == 0) {
-                if (tokens->size == 3) {
-                    unsigned int offset = strtoul(tokens->items[2], NULL, 10);
-                    lseek_file(tokens->items[1], offset, fp, &bpb, currentCluster);
-                } else {
-                    printf("Error: Usage: lseek [FILENAME] [OFFSET]\n");
-                }
-            } else if (strcmp(tokens->items[0], "read") == 0) {
-                if (tokens->size == 3) {
-                    unsigned int size = strtoul(tokens->items[2], NULL, 10); // Convert SIZE from string to unsigned int
-                    read_file(fp, &bpb, currentCluster, tokens->items[1], size);
-                } else {
-                    printf("Error: Usage: read [FILENAME] [SIZE]\n");
-                }
-            } else if (strcmp(tokens->items[0], "write") == 0) {
-                if (tokens->size == 3) {
-                    update_file(fp, &bpb, currentCluster, tokens->items[1], tokens->items[2]);
-                } else {
-                    printf("Error: Usage: write [FILENAME] [DATA]\n");
-                }
-            } else if (strcmp(tokens->items[0], "rename") == 0) {
-                if (tokens->size == 3) {
-                    rename_file(fp, &bpb, currentCluster, tokens->items[1], tokens->items[2]);
-                } else {
-                    printf("Error: Usage: rename [OLDNAME] [NEWNAME]\n");
-                }
-            } else if (strcmp(tokens->items[0], "rm") == 0) {
-                if (tokens->size == 2) {
-                    delete_file(fp, &bpb, currentCluster, tokens->items[1]);
-                } else {
-                    printf("Error: Usage: rm [FILENAME]\n");
-                }
-            } else if (strcmp(tokens->items[0], "rmdir") == 0) {
-                if (tokens->size == 2) {
-                    delete_dir(fp, &bpb, currentCluster, tokens->items[1]);
-                } else {
-                    printf("Error: Usage: rmdir [DIRNAME]\n");
-                }
-            } else if (strcmp(tokens->items[0], "mkdir") == 0) {
-                if (tokens->size == 2) {
-                    mkdir_command(fp, &bpb, currentCluster, tokens->items[1]);
-                } else {
-                    printf("Error: Usage: mkdir [DIRNAME]\n");
-                }
-            } else if (strcmp(tokens->items[0], "creat") == 0) {
-                if (tokens->size == 2) {
-                    creat_command(fp, &bpb, currentCluster, tokens->items[1]);
-                } else {
-                    printf("Error: Usage: creat [FILENAME]\n");
-                }
-            } else if (strcmp(tokens->items[0], "exit") == 0) {
-                free(input);
-                free_tokens(tokens);
+    sh.currentCluster = sh.bpb.BPB_RootClus;
+    sh.imageName = basename(imagePath);
+    strcpy(sh.cwd, "/");
+    lexer_init(&sh.lex);
+    sh.out = stdout;
+    sh.openFileCount = 0;
+    sh.debugOutput = 0;  // 'debug on' turns on the per-cluster lines
+    sh.commandFailed = 0;
+    session = &sh;
+
+    int failures = 0;
+    if (servePath != NULL) {
+        // each client gets a shell like this one; this one runs no commands
+        serving = 1;
+        fprintf(stderr, "Serving '%s' on %s.\n", sh.imageName, servePath);
+        if (server_run(servePath, SERVE_MAX_SESSIONS, serve_session, &sh) != 0) {
+            fprintf(stderr, "Error: Cannot listen on '%s': %s\n", servePath, strerror(errno));
+            failures++;
+        }
+        serving = 0;
+    } else if (batchCount > 0) {
+        // no prompt, and output goes out in large blocks instead of per line
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BYTES);
+        int result = CMD_CONTINUE;
+        for (int i = 0; i < batchCount && result != CMD_EXIT; i++) {
+            if (batchIsScript[i]) {
+                result = run_script(&sh, batch[i], &failures);
+            } else {
+                char *line = strdup(batch[i]);
+                result = run_line(&sh, line, &failures);
+                free(line);
+            }
+        }
+    } else {
+        while (1) {
+            fprintf(sh.out, "./%s%s> ", sh.imageName, sh.cwd);
+            char *input = lexer_read_line(&sh.lex, stdin);
+            if (input == NULL) {
+                break;  // end of input acts like 'exit'
+            }
+            if (run_line(&sh, input, &failures) == CMD_EXIT) {
                 break;
             }
-            free(input);
-            free_tokens(tokens);
         }
     }
 
+    // flush buffered writes and pending FAT updates before closing the image
+    for (int i = 0; i < sh.openFileCount; i++) {
+        flush_write_buffer(fp, &sh.bpb, &sh.openFiles[i]);
+    }
+    if (journal_checkpoint(fp) != 0) {
+        fprintf(stderr, "Error: Failed to write the FAT back to the image.\n");
+        failures++;
+    }
+    journal_close();
+    stats_trace_close();
+    for (int i = 0; i < sh.openFileCount; i++) {
+        free(sh.openFiles[i].writeBuf);
+        free(sh.openFiles[i].readBuf);
+        extent_free(&sh.openFiles[i].extents);
+    }
+    lexer_free(&sh.lex);
+    dir_index_clear();
+    alloc_shutdown();
+    fat_unload();
+    image_close();
     fclose(fp);
-    return 0;
+
+    // batch runs report whether every command succeeded, a server whether it could listen
+    return (batchCount > 0 || servePath != NULL) && failures > 0 ? 1 : 0;
 }
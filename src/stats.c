@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define STATS_MAX_COMMANDS 64
+#define STATS_BUCKETS 32    // bucket 0 is under 1us, bucket b is [2^(b-1), 2^b) us
+
+typedef struct CommandStats {
+    const char *name;        // points into the command table
+    unsigned long long count;
+    double totalUs;
+    double maxUs;
+    unsigned long long buckets[STATS_BUCKETS];
+} CommandStats;
+
+StatsCounters stats;                 // totals, updated atomically by stats_flush()
+__thread StatsCounters threadStats;  // this thread's counts not yet in the totals
+
+static CommandStats commandStats[STATS_MAX_COMMANDS];
+static int commandStatsCount = 0;
+static FILE *traceFile = NULL;
+static unsigned long long traceSeq = 0;
+static struct timespec sessionStart;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;  // histograms and trace, shared by --serve sessions
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+// move this thread's counts into the totals
+void stats_flush(void) {
+    StatsCounters *local = &threadStats;
+    __atomic_fetch_add(&stats.seeks, local->seeks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.reads, local->reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.writes, local->writes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bytesRead, local->bytesRead, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bytesWritten, local->bytesWritten, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.syncs, local->syncs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.fatReads, local->fatReads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.fatWrites, local->fatWrites, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.dirEntries, local->dirEntries, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.cacheHits, local->cacheHits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.cacheMisses, local->cacheMisses, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.cacheWritebacks, local->cacheWritebacks, __ATOMIC_RELAXED);
+    memset(local, 0, sizeof(StatsCounters));
+}
+
+// the totals, including what the calling thread has counted so far
+void stats_snapshot(StatsCounters *out) {
+    stats_flush();
+    out->seeks = __atomic_load_n(&stats.seeks, __ATOMIC_RELAXED);
+    out->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    out->bytesRead = __atomic_load_n(&stats.bytesRead, __ATOMIC_RELAXED);
+    out->bytesWritten = __atomic_load_n(&stats.bytesWritten, __ATOMIC_RELAXED);
+    out->syncs = __atomic_load_n(&stats.syncs, __ATOMIC_RELAXED);
+    out->fatReads = __atomic_load_n(&stats.fatReads, __ATOMIC_RELAXED);
+    out->fatWrites = __atomic_load_n(&stats.fatWrites, __ATOMIC_RELAXED);
+    out->dirEntries = __atomic_load_n(&stats.dirEntries, __ATOMIC_RELAXED);
+    out->cacheHits = __atomic_load_n(&stats.cacheHits, __ATOMIC_RELAXED);
+    out->cacheMisses = __atomic_load_n(&stats.cacheMisses, __ATOMIC_RELAXED);
+    out->cacheWritebacks = __atomic_load_n(&stats.cacheWritebacks, __ATOMIC_RELAXED);
+}
+
+void stats_begin(StatsMark *mark) {
+    stats_snapshot(&mark->counters);
+    clock_gettime(CLOCK_MONOTONIC, &mark->start);
+}
+
+static CommandStats *command_stats(const char *name) {
+    for (int i = 0; i < commandStatsCount; i++) {
+        if (strcmp(commandStats[i].name, name) == 0) {
+            return &commandStats[i];
+        }
+    }
+    if (commandStatsCount == STATS_MAX_COMMANDS) {
+        return NULL;
+    }
+    CommandStats *entry = &commandStats[commandStatsCount++];
+    memset(entry, 0, sizeof(CommandStats));
+    entry->name = name;
+    return entry;
+}
+
+// counter movement over one command; a reset in between restarts from zero
+static unsigned long long delta(unsigned long long now, unsigned long long before) {
+    return now >= before ? now - before : now;
+}
+
+static int bucket_of(double us) {
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && us >= (double)(1ULL << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// JSON string with the characters JSON can't hold raw escaped
+static void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// record one finished command: its latency into the histogram and, when
+// tracing, a JSON line with what it cost
+void stats_end(const StatsMark *mark, const char *command, int argc, char **argv, int failed) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double us = elapsed_us(&mark->start, &end);
+
+    pthread_mutex_lock(&tableLock);
+    CommandStats *entry = command_stats(command);
+    if (entry != NULL) {
+        entry->count++;
+        entry->totalUs += us;
+        if (us > entry->maxUs) {
+            entry->maxUs = us;
+        }
+        entry->buckets[bucket_of(us)]++;
+    }
+
+    if (traceFile == NULL) {
+        pthread_mutex_unlock(&tableLock);
+        return;
+    }
+    StatsCounters now;
+    stats_snapshot(&now);
+    const StatsCounters *before = &mark->counters;
+    fprintf(traceFile, "{\"seq\":%llu,\"start_us\":%.1f,\"cmd\":", ++traceSeq, elapsed_us(&sessionStart, &mark->start));
+    write_json_string(traceFile, command);
+    fputs(",\"args\":[", traceFile);
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) {
+            fputc(',', traceFile);
+        }
+        write_json_string(traceFile, argv[i]);
+    }
+    fprintf(traceFile, "],\"ok\":%s,\"us\":%.1f,\"seeks\":%llu,\"reads\":%llu,\"writes\":%llu,"
+            "\"bytes_read\":%llu,\"bytes_written\":%llu,\"syncs\":%llu,\"fat_reads\":%llu,"
+            "\"fat_writes\":%llu,\"dir_entries\":%llu,\"cache_hits\":%llu,\"cache_misses\":%llu,"
+            "\"cache_writebacks\":%llu}\n",
+            failed ? "false" : "true", us, delta(now.seeks, before->seeks), delta(now.reads, before->reads),
+            delta(now.writes, before->writes), delta(now.bytesRead, before->bytesRead),
+            delta(now.bytesWritten, before->bytesWritten), delta(now.syncs, before->syncs),
+            delta(now.fatReads, before->fatReads), delta(now.fatWrites, before->fatWrites),
+            delta(now.dirEntries, before->dirEntries), delta(now.cacheHits, before->cacheHits),
+            delta(now.cacheMisses, before->cacheMisses), delta(now.cacheWritebacks, before->cacheWritebacks));
+    pthread_mutex_unlock(&tableLock);
+}
+
+// upper bound in us of the bucket holding the given fraction of the samples
+static unsigned long long percentile_us(const CommandStats *entry, double fraction) {
+    unsigned long long wanted = (unsigned long long)(entry->count * fraction + 0.999999);
+    unsigned long long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += entry->buckets[b];
+        if (seen >= wanted && seen > 0) {
+            return 1ULL << b;
+        }
+    }
+    return 1ULL << (STATS_BUCKETS - 1);
+}
+
+void stats_print(FILE *out) {
+    StatsCounters now;
+    stats_snapshot(&now);
+    fprintf(out, "I/O counters:\n");
+    fprintf(out, "  seeks          %llu\n", now.seeks);
+    fprintf(out, "  reads          %llu (%llu bytes)\n", now.reads, now.bytesRead);
+    fprintf(out, "  writes         %llu (%llu bytes)\n", now.writes, now.bytesWritten);
+    fprintf(out, "  syncs          %llu\n", now.syncs);
+    fprintf(out, "  FAT entries    %llu read, %llu written\n", now.fatReads, now.fatWrites);
+    fprintf(out, "  dir entries    %llu scanned\n", now.dirEntries);
+    if (now.cacheHits + now.cacheMisses > 0) {
+        fprintf(out, "  buffer cache   %llu hits, %llu misses (%.1f%% hit), %llu write-backs\n", now.cacheHits, now.cacheMisses,
+                100.0 * now.cacheHits / (now.cacheHits + now.cacheMisses), now.cacheWritebacks);
+    }
+
+    pthread_mutex_lock(&tableLock);
+    if (commandStatsCount == 0) {
+        pthread_mutex_unlock(&tableLock);
+        return;
+    }
+    fprintf(out, "Command latency (p50/p99 are histogram bucket bounds):\n");
+    fprintf(out, "  %-10s %8s %12s %10s %8s %8s %10s\n", "command", "count", "total_ms", "mean_us", "p50_us", "p99_us", "max_us");
+    for (int i = 0; i < commandStatsCount; i++) {
+        const CommandStats *entry = &commandStats[i];
+        if (entry->count == 0) {
+            continue;
+        }
+        fprintf(out, "  %-10s %8llu %12.3f %10.1f %8llu %8llu %10.1f\n", entry->name, entry->count,
+                entry->totalUs / 1000.0, entry->totalUs / entry->count, percentile_us(entry, 0.5),
+                percentile_us(entry, 0.99), entry->maxUs);
+        fprintf(out, "    ");
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (entry->buckets[b] == 0) {
+                continue;
+            }
+            if (b == 0) {
+                fprintf(out, " <1us:%llu", entry->buckets[b]);
+            } else {
+                fprintf(out, " %llu-%lluus:%llu", 1ULL << (b - 1), 1ULL << b, entry->buckets[b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&tableLock);
+}
+
+// zero the counters and histograms; the trace keeps its sequence numbers
+void stats_reset(void) {
+    memset(&threadStats, 0, sizeof(StatsCounters));
+    __atomic_store_n(&stats.seeks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytesRead, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.bytesWritten, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.syncs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.fatReads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.fatWrites, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.dirEntries, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.cacheHits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.cacheMisses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.cacheWritebacks, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&tableLock);
+    commandStatsCount = 0;
+    pthread_mutex_unlock(&tableLock);
+}
+
+int stats_trace_open(const char *path) {
+    stats_trace_close();
+    traceFile = fopen(path, "w");
+    clock_gettime(CLOCK_MONOTONIC, &sessionStart);
+    return traceFile != NULL ? 0 : -1;
+}
+
+void stats_trace_close(void) {
+    if (traceFile != NULL) {
+        fclose(traceFile);
+    }
+    traceFile = NULL;
+}
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE  // syscall()
+
+#include "uring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define URING_MAX_LEN (1U << 30)  // largest transfer put in one request
+
+typedef struct Ring {
+    int fd;
+    unsigned int entries;        // submission queue size
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqArray;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;                // same mapping as sqRing on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned char *fixedBase;    // registered buffer, NULL if none
+    size_t fixedLen;
+} Ring;
+
+static Ring ring = { .fd = -1 };
+
+static int ring_enter(unsigned int toSubmit, unsigned int minComplete) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+// set up a ring with room for depth requests; -1 if io_uring isn't there
+int uring_open(unsigned int depth) {
+    uring_close();
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, depth > 0 ? depth : 1, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    ring.fd = fd;
+
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring.cqRingSize > ring.sqRingSize) {
+        ring.sqRingSize = ring.cqRingSize;
+    }
+    ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring.sqRing == MAP_FAILED) {
+        ring.sqRing = NULL;
+        uring_close();
+        return -1;
+    }
+    ring.cqRing = single ? ring.sqRing
+                         : mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring.cqRing == MAP_FAILED) {
+        ring.cqRing = NULL;
+        uring_close();
+        return -1;
+    }
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *)mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_close();
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)ring.sqRing;
+    unsigned char *cq = (unsigned char *)ring.cqRing;
+    ring.sqHead = (unsigned int *)(sq + params.sq_off.head);
+    ring.sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned int *)(sq + params.sq_off.array);
+    ring.cqHead = (unsigned int *)(cq + params.cq_off.head);
+    ring.cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.entries = params.sq_entries;
+    return 0;
+}
+
+void uring_close(void) {
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqRing != NULL && ring.cqRing != ring.sqRing) {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    if (ring.sqRing != NULL) {
+        munmap(ring.sqRing, ring.sqRingSize);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);  // also drops the registered buffer
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+int uring_ready(void) {
+    return ring.fd >= 0;
+}
+
+// pin one buffer with the kernel so requests into it skip the per-I/O page mapping
+int uring_register_buffer(void *base, size_t len) {
+    if (ring.fd < 0) {
+        return -1;
+    }
+    struct iovec iov = { base, len };
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+        return -1;
+    }
+    ring.fixedBase = (unsigned char *)base;
+    ring.fixedLen = len;
+    return 0;
+}
+
+static int in_fixed(const unsigned char *buf, size_t len) {
+    return ring.fixedBase != NULL && buf >= ring.fixedBase && len <= ring.fixedLen - (size_t)(buf - ring.fixedBase);
+}
+
+// run every request to completion with up to the ring's depth in flight;
+// returns -1 if any of them fails or hits the end of the image
+int uring_transfer(int fd, const ImageIo *ios, int count, int writing) {
+    if (ring.fd < 0) {
+        return -1;
+    }
+    size_t *done = (size_t *)calloc(count > 0 ? count : 1, sizeof(size_t));
+    int *retry = (int *)malloc((count > 0 ? count : 1) * sizeof(int));  // short or interrupted requests to resubmit
+    if (done == NULL || retry == NULL) {
+        free(done);
+        free(retry);
+        return -1;
+    }
+
+    int next = 0;
+    int retryCount = 0;
+    int finished = 0;
+    int failed = 0;
+    unsigned int inFlight = 0;
+    unsigned int unsubmitted = 0;  // queued in the ring but not yet taken by the kernel
+    while ((finished < count && !failed) || inFlight > 0 || unsubmitted > 0) {
+        unsigned int tail = *ring.sqTail;
+        while (!failed && inFlight + unsubmitted < ring.entries && (retryCount > 0 || next < count)) {
+            int i = retryCount > 0 ? retry[--retryCount] : next++;
+            if (ios[i].len == 0) {
+                finished++;
+                continue;
+            }
+            unsigned char *buf = (unsigned char *)ios[i].buf + done[i];
+            size_t len = ios[i].len - done[i];
+            if (len > URING_MAX_LEN) {
+                len = URING_MAX_LEN;
+            }
+            int fixed = in_fixed(buf, len);
+            struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            if (writing) {
+                sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            } else {
+                sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            }
+            sqe->fd = fd;
+            sqe->off = (unsigned long long)ios[i].offset + done[i];
+            sqe->addr = (unsigned long long)(unsigned long)buf;
+            sqe->len = (unsigned int)len;
+            sqe->buf_index = 0;
+            sqe->user_data = (unsigned long long)i;
+            ring.sqArray[tail & *ring.sqMask] = tail & *ring.sqMask;
+            tail++;
+            unsubmitted++;
+        }
+        __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+        if (inFlight + unsubmitted == 0) {
+            break;
+        }
+
+        int submitted = ring_enter(unsubmitted, 1);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            failed = 1;
+            if (inFlight == 0) {
+                break;  // nothing of ours is left with the kernel
+            }
+            submitted = 0;
+        }
+        unsubmitted -= (unsigned int)submitted;
+        inFlight += (unsigned int)submitted;
+
+        unsigned int head = *ring.cqHead;
+        unsigned int cqTail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        while (head != cqTail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int i = (int)cqe->user_data;
+            int res = cqe->res;
+            head++;
+            inFlight--;
+            if (res == -EINTR || res == -EAGAIN) {
+                retry[retryCount++] = i;
+            } else if (res <= 0) {
+                failed = 1;
+            } else if ((done[i] += (size_t)res) < ios[i].len) {
+                retry[retryCount++] = i;
+            } else {
+                finished++;
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    free(done);
+    free(retry);
+    return failed || finished < count ? -1 : 0;
+}
+
+#else
+
+int uring_open(unsigned int depth) {
+    return -1;
+}
+
+void uring_close(void) {
+}
+
+int uring_ready(void) {
+    return 0;
+}
+
+int uring_register_buffer(void *base, size_t len) {
+    return -1;
+}
+
+int uring_transfer(int fd, const ImageIo *ios, int count, int writing) {
+    return -1;
+}
+
+#endif
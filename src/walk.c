@@ -0,0 +1,386 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "walk.h"
+#include "fatcache.h"
+#include "image.h"
+#include "dir.h"
+#include "lfn.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define WALK_MAX_THREADS 16
+#define WALK_MAX_DEPTH   128   // deeper than this is a directory loop
+
+// a directory waiting to be scanned
+typedef struct WalkTask {
+    char *path;
+    unsigned int cluster;
+    int depth;
+} WalkTask;
+
+// per-worker deque; the owner works at the bottom, thieves take from the top
+typedef struct WalkDeque {
+    pthread_mutex_t lock;
+    WalkTask *tasks;
+    size_t top, bottom, capacity;
+} WalkDeque;
+
+typedef struct WalkWorker {
+    struct WalkShared *shared;
+    int id;
+    WalkDeque deque;
+    WalkResult found;          // entries this worker discovered
+    unsigned char *buffer;     // cluster buffer for the stdio backend
+} WalkWorker;
+
+typedef struct WalkShared {
+    FILE *fp;
+    BPB *bpb;
+    WalkWorker *workers;
+    int threads;
+    long pending;              // directories queued or being scanned
+    int truncated;             // a directory was left out of the walk
+    int failed;                // an allocation failed; the result is incomplete
+} WalkShared;
+
+// number of clusters in the chain starting at first, bounded so a looped
+// chain can't hang the walk
+static unsigned int chain_length(unsigned int first) {
+    unsigned int limit = fat_entry_count();
+    unsigned int count = 0;
+    for (unsigned int c = first; c >= 2 && c < FAT_EOC_MIN && count < limit; c = fat_get(c)) {
+        count++;
+    }
+    return count;
+}
+
+static int result_add(WalkResult *result, WalkEntry *entry) {
+    if (result->count == result->capacity) {
+        size_t capacity = result->capacity ? result->capacity * 2 : 64;
+        WalkEntry *items = (WalkEntry *)realloc(result->items, capacity * sizeof(WalkEntry));
+        if (items == NULL) {
+            return -1;
+        }
+        result->items = items;
+        result->capacity = capacity;
+    }
+    result->items[result->count++] = *entry;
+    return 0;
+}
+
+static int deque_push(WalkDeque *deque, WalkTask task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        // slide live tasks down before growing
+        if (deque->top > 0) {
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(WalkTask));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity) {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 32;
+            WalkTask *tasks = (WalkTask *)realloc(deque->tasks, capacity * sizeof(WalkTask));
+            if (tasks == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// owner side: newest task first keeps the walk depth-first and the deque short
+static int deque_pop(WalkDeque *deque, WalkTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[--deque->bottom];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// thief side: oldest task, which is the one highest in the tree
+static int deque_steal(WalkDeque *deque, WalkTask *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[deque->top++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// read every entry of one directory, recording it and queueing subdirectories
+static void scan_directory(WalkWorker *worker, WalkTask *task) {
+    WalkShared *shared = worker->shared;
+    unsigned int bytesPerCluster = cluster_size(shared->bpb);
+    unsigned int perCluster = bytesPerCluster / sizeof(DIR);
+    unsigned int limit = fat_entry_count();
+    unsigned int visited = 0;
+    LfnState lfn;  // long names can run across a cluster boundary
+    lfn_reset(&lfn);
+
+    for (unsigned int c = task->cluster; c >= 2 && c < FAT_EOC_MIN && visited < limit; c = fat_get(c), visited++) {
+        if (__atomic_load_n(&shared->failed, __ATOMIC_RELAXED)) {
+            return;  // the walk is being abandoned
+        }
+        DIR *entries = (DIR *)image_map_pread(shared->fp, cluster_offset(shared->bpb, c), bytesPerCluster, worker->buffer);
+        if (entries == NULL) {
+            __atomic_store_n(&shared->truncated, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        for (unsigned int i = 0; i < perCluster; i++) {
+            DIR *dirEntry = &entries[i];
+            if (dirEntry->DIR_Name[0] == 0x00) {
+                STATS_ADD(dirEntries, i + 1);
+                return;  // end of the directory
+            }
+            long entryPos = cluster_offset(shared->bpb, c) + (long)i * sizeof(DIR);
+            char name[NAME_MAX_BYTES];
+            // fsck takes whatever the walk misses for lost clusters, so
+            // only the volume label is skipped besides '.' and '..'
+            if (lfn_scan(&lfn, dirEntry, entryPos, name) == 0 || dirEntry->DIR_Name[0] == '.' ||
+                (dirEntry->DIR_Attr & 0x08)) {
+                continue;
+            }
+            int len = (int)strlen(name);
+
+            size_t parentLen = strlen(task->path);
+            char *path = (char *)malloc(parentLen + len + 2);
+            if (path == NULL) {
+                __atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            if (parentLen == 1) {
+                parentLen = 0;  // parent is the root
+            }
+            memcpy(path, task->path, parentLen);
+            path[parentLen] = '/';
+            strcpy(path + parentLen + 1, name);
+
+            WalkEntry entry;
+            entry.path = path;
+            entry.name = path + parentLen + 1;
+            entry.depth = task->depth + 1;
+            entry.attr = dirEntry->DIR_Attr;
+            entry.fileSize = dirEntry->DIR_FileSize;
+            entry.firstCluster = dirEntry->DIR_FstClusLO | (dirEntry->DIR_FstClusHI << 16);
+            entry.clusters = chain_length(entry.firstCluster);
+            entry.entryPos = entryPos;
+            if (result_add(&worker->found, &entry) != 0) {
+                free(path);
+                __atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+                return;
+            }
+
+            if ((entry.attr & 0x10) && entry.firstCluster >= 2 && entry.depth >= WALK_MAX_DEPTH) {
+                __atomic_store_n(&shared->truncated, 1, __ATOMIC_RELAXED);
+            } else if ((entry.attr & 0x10) && entry.firstCluster >= 2) {
+                WalkTask child = { path, entry.firstCluster, entry.depth };
+                __atomic_add_fetch(&shared->pending, 1, __ATOMIC_SEQ_CST);
+                if (deque_push(&worker->deque, child) != 0) {
+                    // the path stays with the recorded entry
+                    __atomic_sub_fetch(&shared->pending, 1, __ATOMIC_SEQ_CST);
+                    __atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+                    return;
+                }
+            }
+        }
+        STATS_ADD(dirEntries, perCluster);
+    }
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *worker = (WalkWorker *)arg;
+    WalkShared *shared = worker->shared;
+    WalkTask task;
+
+    while (1) {
+        int found = deque_pop(&worker->deque, &task);
+        for (int n = 1; !found && n < shared->threads; n++) {
+            found = deque_steal(&shared->workers[(worker->id + n) % shared->threads].deque, &task);
+        }
+        if (found) {
+            scan_directory(worker, &task);
+            __atomic_sub_fetch(&shared->pending, 1, __ATOMIC_SEQ_CST);
+        } else if (__atomic_load_n(&shared->pending, __ATOMIC_SEQ_CST) == 0) {
+            break;  // nothing queued and nobody scanning, so nothing more can appear
+        } else {
+            sched_yield();
+        }
+    }
+    stats_flush();
+    return NULL;
+}
+
+// path order with '/' below every other character, so a directory's
+// subtree sorts directly after it. A damaged directory can hold the same
+// name twice; those go by entry position, then first cluster, so the order
+// doesn't depend on which worker found them
+static int compare_paths(const void *a, const void *b) {
+    const WalkEntry *x = (const WalkEntry *)a;
+    const WalkEntry *y = (const WalkEntry *)b;
+    const unsigned char *p = (const unsigned char *)x->path;
+    const unsigned char *q = (const unsigned char *)y->path;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    if (*p != *q) {
+        int c = *p == '/' ? 1 : *p;
+        int d = *q == '/' ? 1 : *q;
+        return c - d;
+    }
+    if (x->entryPos != y->entryPos) {
+        return x->entryPos < y->entryPos ? -1 : 1;
+    }
+    return x->firstCluster < y->firstCluster ? -1 : x->firstCluster > y->firstCluster;
+}
+
+int walk_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int)cpus;
+}
+
+// release everything the first n workers hold, including the paths they found
+static void free_workers(WalkWorker *workers, int n) {
+    for (int i = 0; i < n; i++) {
+        for (size_t j = 0; j < workers[i].found.count; j++) {
+            free(workers[i].found.items[j].path);
+        }
+        free(workers[i].found.items);
+        free(workers[i].deque.tasks);
+        free(workers[i].buffer);
+        pthread_mutex_destroy(&workers[i].deque.lock);
+    }
+}
+
+// walk the tree under the directory at rootCluster (named rootPath); the
+// result starts with the directory itself, followed by everything below it.
+// Returns -1 with nothing allocated if memory runs out
+int walk_tree(FILE *fp, BPB *bpb, const char *rootPath, unsigned int rootCluster, int threads, WalkResult *result) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > WALK_MAX_THREADS) {
+        threads = WALK_MAX_THREADS;
+    }
+    if (rootCluster < 2) {
+        rootCluster = bpb->BPB_RootClus;
+    }
+
+    // workers read the descriptor directly, so nothing may sit in stdio's
+    // buffer or the buffer cache
+    image_flush(fp);
+
+    WalkShared shared;
+    WalkWorker workers[WALK_MAX_THREADS];
+    pthread_t ids[WALK_MAX_THREADS];
+    shared.fp = fp;
+    shared.bpb = bpb;
+    shared.workers = workers;
+    shared.threads = threads;
+    shared.pending = 1;
+    shared.truncated = 0;
+    shared.failed = 0;
+    for (int i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(WalkWorker));
+        workers[i].shared = &shared;
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+        if (!image_is_mapped()) {
+            workers[i].buffer = (unsigned char *)malloc(cluster_size(bpb));
+            if (workers[i].buffer == NULL) {
+                free_workers(workers, i + 1);
+                return -1;
+            }
+        }
+    }
+
+    WalkEntry root;
+    root.path = strdup(rootPath);
+    if (root.path == NULL) {
+        free_workers(workers, threads);
+        return -1;
+    }
+    root.name = strrchr(root.path, '/') + 1;
+    root.depth = 0;
+    root.attr = 0x10;
+    root.fileSize = 0;
+    root.firstCluster = rootCluster;
+    root.clusters = chain_length(rootCluster);
+    root.entryPos = -1;
+    WalkTask first = { root.path, rootCluster, 0 };
+    if (result_add(&workers[0].found, &root) != 0) {
+        free(root.path);
+        free_workers(workers, threads);
+        return -1;
+    }
+    if (deque_push(&workers[0].deque, first) != 0) {
+        free_workers(workers, threads);
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&ids[i], NULL, walk_worker, &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    walk_worker(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    // merge what each worker found and put it in path order
+    result->items = NULL;
+    result->count = 0;
+    result->capacity = 0;
+    result->truncated = shared.truncated;
+    size_t total = 0;
+    for (int i = 0; i < threads; i++) {
+        total += workers[i].found.count;
+    }
+    if (!shared.failed) {
+        result->items = (WalkEntry *)malloc(total * sizeof(WalkEntry));
+    }
+    if (result->items == NULL) {
+        free_workers(workers, threads);
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        memcpy(result->items + result->count, workers[i].found.items, workers[i].found.count * sizeof(WalkEntry));
+        result->count += workers[i].found.count;
+        workers[i].found.count = 0;  // the paths now belong to result
+    }
+    result->capacity = total;
+    free_workers(workers, threads);
+    qsort(result->items, result->count, sizeof(WalkEntry), compare_paths);
+    return 0;
+}
+
+void walk_free(WalkResult *result) {
+    for (size_t i = 0; i < result->count; i++) {
+        free(result->items[i].path);
+    }
+    free(result->items);
+    result->items = NULL;
+    result->count = 0;
+    result->capacity = 0;
+}